@@ -1359,51 +1359,35 @@ static inline void smb2_sg_set_buf(struct scatterlist *sg, const void *buf,
 	sg_set_page(sg, addr, buflen, offset_in_page(buf));
 }
 
-static struct scatterlist *ksmbd_init_sg(struct kvec *iov, unsigned int nvec,
-					 u8 *sign)
+/* Number of scatterlist entries needed for @data */
+static int ksmbd_sg_nents(void *data, unsigned int len)
 {
-	struct scatterlist *sg;
-	unsigned int assoc_data_len = sizeof(struct smb2_transform_hdr) - 20;
-	int i, nr_entries[3] = {0}, total_entries = 0, sg_idx = 0;
-
-	if (!nvec)
-		return NULL;
-
-	for (i = 0; i < nvec - 1; i++) {
-		unsigned long kaddr = (unsigned long)iov[i + 1].iov_base;
+	unsigned long kaddr = (unsigned long)data;
 
-		if (is_vmalloc_addr(iov[i + 1].iov_base)) {
-			nr_entries[i] = ((kaddr + iov[i + 1].iov_len +
-					PAGE_SIZE - 1) >> PAGE_SHIFT) -
-				(kaddr >> PAGE_SHIFT);
-		} else {
-			nr_entries[i]++;
-		}
-		total_entries += nr_entries[i];
-	}
-
-	/* Add two entries for transform header and signature */
-	total_entries += 2;
+	if (!is_vmalloc_addr(data))
+		return 1;
+	return ((kaddr + len + PAGE_SIZE - 1) >> PAGE_SHIFT) -
+		(kaddr >> PAGE_SHIFT);
+}
 
-	sg = kmalloc_array(total_entries, sizeof(struct scatterlist), GFP_KERNEL);
-	if (!sg)
-		return NULL;
+static void ksmbd_init_sg(struct scatterlist *sg, unsigned int nents,
+			  struct kvec *iov, unsigned int nvec, u8 *sign)
+{
+	unsigned int assoc_data_len = sizeof(struct smb2_transform_hdr) - 20;
+	int i, sg_idx = 0;
 
-	sg_init_table(sg, total_entries);
+	sg_init_table(sg, nents);
 	smb2_sg_set_buf(&sg[sg_idx++], iov[0].iov_base + 24, assoc_data_len);
 	for (i = 0; i < nvec - 1; i++) {
 		void *data = iov[i + 1].iov_base;
 		int len = iov[i + 1].iov_len;
 
 		if (is_vmalloc_addr(data)) {
-			int j, offset = offset_in_page(data);
+			int offset = offset_in_page(data);
 
-			for (j = 0; j < nr_entries[i]; j++) {
+			while (len) {
 				unsigned int bytes = PAGE_SIZE - offset;
 
-				if (!len)
-					break;
-
 				if (bytes > len)
 					bytes = len;
 
@@ -1421,7 +1405,51 @@ static struct scatterlist *ksmbd_init_sg(struct kvec *iov, unsigned int nvec,
 		}
 	}
 	smb2_sg_set_buf(&sg[sg_idx], sign, SMB2_SIGNATURE_SIZE);
-	return sg;
+}
+
+/*
+ * Everything a message needs besides its own buffers, the aead request,
+ * the scatterlist over @iov, the signature and the iv, comes from a
+ * single allocation. The data is transformed in place.
+ */
+struct ksmbd_aead_buf {
+	struct aead_request	*req;
+	struct scatterlist	*sg;
+	u8			*sign;
+	u8			*iv;
+};
+
+static void *ksmbd_alloc_aead_buf(struct crypto_aead *tfm, struct kvec *iov,
+				  unsigned int nvec, struct ksmbd_aead_buf *ab)
+{
+	size_t sg_off, sign_off, iv_off, size;
+	unsigned int nents = 0, i;
+	void *p;
+
+	for (i = 1; i < nvec; i++)
+		nents += ksmbd_sg_nents(iov[i].iov_base, iov[i].iov_len);
+	/* Add two entries for transform header and signature */
+	nents += 2;
+
+	sg_off = ALIGN(sizeof(struct aead_request) + crypto_aead_reqsize(tfm),
+		       __alignof__(struct scatterlist));
+	sign_off = sg_off + nents * sizeof(struct scatterlist);
+	iv_off = sign_off + SMB2_SIGNATURE_SIZE;
+	size = iv_off + crypto_aead_alignmask(tfm) + crypto_aead_ivsize(tfm);
+
+	p = kmalloc(size, GFP_KERNEL);
+	if (!p)
+		return NULL;
+
+	ab->req = p;
+	aead_request_set_tfm(ab->req, tfm);
+	ab->sg = p + sg_off;
+	ab->sign = p + sign_off;
+	ab->iv = PTR_ALIGN((u8 *)p + iv_off, crypto_aead_alignmask(tfm) + 1);
+	memset(ab->sign, 0, SMB2_SIGNATURE_SIZE);
+	memset(ab->iv, 0, crypto_aead_ivsize(tfm));
+	ksmbd_init_sg(ab->sg, nents, iov, nvec, ab->sign);
+	return p;
 }
 
 int ksmbd_crypt_message(struct ksmbd_work *work, struct kvec *iov,
@@ -1431,16 +1459,16 @@ int ksmbd_crypt_message(struct ksmbd_work *work, struct kvec *iov,
 	struct smb2_transform_hdr *tr_hdr = smb2_get_msg(iov[0].iov_base);
 	unsigned int assoc_data_len = sizeof(struct smb2_transform_hdr) - 20;
 	int rc;
-	struct scatterlist *sg;
-	u8 sign[SMB2_SIGNATURE_SIZE] = {};
 	u8 key[SMB3_ENC_DEC_KEY_SIZE];
-	struct aead_request *req;
-	char *iv;
-	unsigned int iv_len;
+	struct ksmbd_aead_buf ab;
+	void *aead_buf;
 	struct crypto_aead *tfm;
 	unsigned int crypt_len = le32_to_cpu(tr_hdr->OriginalMessageSize);
 	struct ksmbd_crypto_ctx *ctx;
 
+	if (!nvec)
+		return -EINVAL;
+
 	rc = ksmbd_get_encryption_key(work,
 				      le64_to_cpu(tr_hdr->SessionId),
 				      enc,
@@ -1482,59 +1510,43 @@ int ksmbd_crypt_message(struct ksmbd_work *work, struct kvec *iov,
 		goto free_ctx;
 	}
 
-	req = aead_request_alloc(tfm, GFP_KERNEL);
-	if (!req) {
+	aead_buf = ksmbd_alloc_aead_buf(tfm, iov, nvec, &ab);
+	if (!aead_buf) {
+		pr_err("Failed to init sg\n");
 		rc = -ENOMEM;
 		goto free_ctx;
 	}
 
 	if (!enc) {
-		memcpy(sign, &tr_hdr->Signature, SMB2_SIGNATURE_SIZE);
+		memcpy(ab.sign, &tr_hdr->Signature, SMB2_SIGNATURE_SIZE);
 		crypt_len += SMB2_SIGNATURE_SIZE;
 	}
 
-	sg = ksmbd_init_sg(iov, nvec, sign);
-	if (!sg) {
-		pr_err("Failed to init sg\n");
-		rc = -ENOMEM;
-		goto free_req;
-	}
-
-	iv_len = crypto_aead_ivsize(tfm);
-	iv = kzalloc(iv_len, GFP_KERNEL);
-	if (!iv) {
-		rc = -ENOMEM;
-		goto free_sg;
-	}
-
 	if (conn->cipher_type == SMB2_ENCRYPTION_AES128_GCM ||
 	    conn->cipher_type == SMB2_ENCRYPTION_AES256_GCM) {
-		memcpy(iv, (char *)tr_hdr->Nonce, SMB3_AES_GCM_NONCE);
+		memcpy(ab.iv, (char *)tr_hdr->Nonce, SMB3_AES_GCM_NONCE);
 	} else {
-		iv[0] = 3;
-		memcpy(iv + 1, (char *)tr_hdr->Nonce, SMB3_AES_CCM_NONCE);
+		ab.iv[0] = 3;
+		memcpy(ab.iv + 1, (char *)tr_hdr->Nonce, SMB3_AES_CCM_NONCE);
 	}
 
-	aead_request_set_crypt(req, sg, sg, crypt_len, iv);
-	aead_request_set_ad(req, assoc_data_len);
-	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_SLEEP, NULL, NULL);
+	aead_request_set_crypt(ab.req, ab.sg, ab.sg, crypt_len, ab.iv);
+	aead_request_set_ad(ab.req, assoc_data_len);
+	aead_request_set_callback(ab.req, CRYPTO_TFM_REQ_MAY_SLEEP, NULL, NULL);
 
 	if (enc)
-		rc = crypto_aead_encrypt(req);
+		rc = crypto_aead_encrypt(ab.req);
 	else
-		rc = crypto_aead_decrypt(req);
-	if (rc)
-		goto free_iv;
+		rc = crypto_aead_decrypt(ab.req);
+	if (!rc && enc)
+		memcpy(&tr_hdr->Signature, ab.sign, SMB2_SIGNATURE_SIZE);
 
-	if (enc)
-		memcpy(&tr_hdr->Signature, sign, SMB2_SIGNATURE_SIZE);
-
-free_iv:
-	kfree(iv);
-free_sg:
-	kfree(sg);
-free_req:
-	kfree(req);
+	/* holds the cipher request context and the nonce */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 9, 0)
+	kfree_sensitive(aead_buf);
+#else
+	kzfree(aead_buf);
+#endif
 free_ctx:
 	ksmbd_release_crypto_ctx(ctx);
 	return rc;
@@ -77,6 +77,7 @@ struct ksmbd_conn *ksmbd_conn_alloc(void)
 	atomic_set(&conn->r_count, 0);
 	conn->total_credits = 1;
 	conn->outstanding_credits = 0;
+	conn->cpu = WORK_CPU_UNBOUND;
 
 	init_waitqueue_head(&conn->req_running_q);
 	init_waitqueue_head(&conn->r_count_q);
@@ -187,36 +188,38 @@ void ksmbd_conn_wait_idle(struct ksmbd_conn *conn)
 int ksmbd_conn_write(struct ksmbd_work *work)
 {
 	struct ksmbd_conn *conn = work->conn;
+	struct kvec iov_inline[4], *iov = iov_inline;
+	int nr_iov = ksmbd_work_nr_rsp_iov(work) + 1;
 	size_t len = 0;
-	int sent;
-	struct kvec iov[3];
-	int iov_idx = 0;
+	int sent, i, iov_idx = 0;
 
 	if (!work->response_buf) {
 		pr_err("NULL response header\n");
 		return -EINVAL;
 	}
 
-	if (work->tr_buf) {
-		iov[iov_idx] = (struct kvec) { work->tr_buf,
-				sizeof(struct smb2_transform_hdr) + 4 };
-		len += iov[iov_idx++].iov_len;
+	if (nr_iov > ARRAY_SIZE(iov_inline)) {
+		iov = kmalloc_array(nr_iov, sizeof(*iov), GFP_KERNEL);
+		if (!iov)
+			return -ENOMEM;
 	}
 
-	if (work->aux_payload_sz) {
-		iov[iov_idx] = (struct kvec) { work->response_buf, work->resp_hdr_sz };
-		len += iov[iov_idx++].iov_len;
-		iov[iov_idx] = (struct kvec) { work->aux_payload_buf, work->aux_payload_sz };
-		len += iov[iov_idx++].iov_len;
+	/* an encrypted message starts with the transform header */
+	if (work->tr_buf) {
+		iov[iov_idx++] = (struct kvec) { work->tr_buf,
+				sizeof(struct smb2_transform_hdr) + 4 };
+		iov_idx += ksmbd_work_rsp_iov(work, 4,
+					      get_rfc1002_len(work->response_buf),
+					      &iov[iov_idx], nr_iov - iov_idx);
 	} else {
-		if (work->tr_buf)
-			iov[iov_idx].iov_len = work->resp_hdr_sz;
-		else
-			iov[iov_idx].iov_len = get_rfc1002_len(work->response_buf) + 4;
-		iov[iov_idx].iov_base = work->response_buf;
-		len += iov[iov_idx++].iov_len;
+		iov_idx += ksmbd_work_rsp_iov(work, 0,
+					      get_rfc1002_len(work->response_buf) + 4,
+					      iov, nr_iov);
 	}
 
+	for (i = 0; i < iov_idx; i++)
+		len += iov[i].iov_len;
+
 	ksmbd_conn_lock(conn);
 	sent = conn->transport->ops->writev(conn->transport, &iov[0],
 					iov_idx, len,
@@ -224,6 +227,9 @@ int ksmbd_conn_write(struct ksmbd_work *work)
 					work->remote_key);
 	ksmbd_conn_unlock(conn);
 
+	if (iov != iov_inline)
+		kfree(iov);
+
 	if (sent < 0) {
 		pr_err("Failed to send message: %d\n", sent);
 		return sent;
@@ -232,17 +238,36 @@ int ksmbd_conn_write(struct ksmbd_work *work)
 	return 0;
 }
 
+/**
+ * ksmbd_conn_rdma_read() - pull data from the client through RDMA read
+ * @conn:	connection instance
+ * @buf:	destination buffer
+ * @buflen:	length of @buf
+ * @desc:	buffer descriptors of the client
+ * @desc_len:	length of @desc in bytes
+ * @done:	optional completion callback
+ * @arg:	argument passed to @done
+ *
+ * If @done is given and the transport can complete the transfer
+ * asynchronously, -EINPROGRESS is returned and @done is called with the
+ * result from the completion context later. Otherwise the transfer is
+ * completed before returning and @done is not called.
+ *
+ * Return:	0 on success, -EINPROGRESS if pending, otherwise error
+ */
 int ksmbd_conn_rdma_read(struct ksmbd_conn *conn,
 			 void *buf, unsigned int buflen,
 			 struct smb2_buffer_desc_v1 *desc,
-			 unsigned int desc_len)
+			 unsigned int desc_len,
+			 void (*done)(void *arg, int status), void *arg)
 {
 	int ret = -EINVAL;
 
 	if (conn->transport->ops->rdma_read)
 		ret = conn->transport->ops->rdma_read(conn->transport,
 						      buf, buflen,
-						      desc, desc_len);
+						      desc, desc_len,
+						      done, arg);
 	return ret;
 }
 
@@ -260,6 +285,66 @@ int ksmbd_conn_rdma_write(struct ksmbd_conn *conn,
 	return ret;
 }
 
+/**
+ * ksmbd_conn_rdma_buf_alloc() - allocate a buffer for RDMA read/write
+ * @conn:	connection instance
+ * @len:	buffer length
+ *
+ * Use a buffer pre-mapped by the transport if it has one available.
+ * Callers fall back to a kvmalloc buffer, which ksmbd_conn_rdma_buf_free()
+ * also releases.
+ *
+ * Return:	pre-mapped buffer, or NULL if none is available
+ */
+void *ksmbd_conn_rdma_buf_alloc(struct ksmbd_conn *conn, unsigned int len)
+{
+	if (!conn->transport->ops->alloc_rdma_buf)
+		return NULL;
+	return conn->transport->ops->alloc_rdma_buf(conn->transport, len);
+}
+
+void ksmbd_conn_rdma_buf_free(struct ksmbd_conn *conn, void *buf)
+{
+	if (!buf)
+		return;
+
+	if (conn->transport->ops->free_rdma_buf &&
+	    conn->transport->ops->free_rdma_buf(conn->transport, buf))
+		return;
+	kvfree(buf);
+}
+
+static atomic_t chann_cpu_rotor = ATOMIC_INIT(0);
+
+/**
+ * ksmbd_conn_set_affinity() - bind a channel to a CPU of its own
+ * @conn:	connection of a multichannel session
+ *
+ * Channels are spread over the NUMA nodes first and over the CPUs of a
+ * node second, so that channels of a session don't share a CPU while
+ * there are enough of them. The receive thread of the channel is pinned
+ * to the CPU and its requests are run on the CPU's node.
+ */
+void ksmbd_conn_set_affinity(struct ksmbd_conn *conn)
+{
+	unsigned int n, nr_nodes = num_online_nodes();
+	int node, cpu;
+
+	if (conn->cpu != WORK_CPU_UNBOUND || conn->status == KSMBD_SESS_EXITING)
+		return;
+
+	n = atomic_inc_return(&chann_cpu_rotor) - 1;
+	node = first_online_node;
+	for (cpu = n % nr_nodes; cpu; cpu--)
+		node = next_online_node(node);
+	cpu = cpumask_local_spread(n / nr_nodes, node);
+
+	if (set_cpus_allowed_ptr(conn->transport->handler, cpumask_of(cpu)))
+		return;
+	WRITE_ONCE(conn->cpu, cpu);
+	ksmbd_debug(CONN, "channel bound to cpu %d (node %d)\n", cpu, node);
+}
+
 bool ksmbd_conn_alive(struct ksmbd_conn *conn)
 {
 	if (!ksmbd_server_running())
@@ -318,6 +403,9 @@ int ksmbd_conn_handler_loop(void *p)
 		kvfree(conn->request_buf);
 		conn->request_buf = NULL;
 
+		/* backpressure while buffers in flight exceed the budget */
+		ksmbd_mem_throttle();
+
 		size = t->ops->read(t, hdr_buf, sizeof(hdr_buf));
 		if (size != sizeof(hdr_buf))
 			break;
@@ -103,6 +103,11 @@ struct ksmbd_conn {
 	bool				signing_negotiated;
 	__le16				signing_algorithm;
 	bool				binding;
+	/*
+	 * CPU this channel's receive thread and requests are bound to,
+	 * WORK_CPU_UNBOUND unless it belongs to a multichannel session
+	 */
+	int				cpu;
 };
 
 struct ksmbd_conn_ops {
@@ -121,11 +126,14 @@ struct ksmbd_transport_ops {
 	int (*rdma_read)(struct ksmbd_transport *t,
 			 void *buf, unsigned int len,
 			 struct smb2_buffer_desc_v1 *desc,
-			 unsigned int desc_len);
+			 unsigned int desc_len,
+			 void (*done)(void *arg, int status), void *arg);
 	int (*rdma_write)(struct ksmbd_transport *t,
 			  void *buf, unsigned int len,
 			  struct smb2_buffer_desc_v1 *desc,
 			  unsigned int desc_len);
+	void *(*alloc_rdma_buf)(struct ksmbd_transport *t, unsigned int len);
+	bool (*free_rdma_buf)(struct ksmbd_transport *t, void *buf);
 };
 
 struct ksmbd_transport {
@@ -150,15 +158,19 @@ int ksmbd_conn_write(struct ksmbd_work *work);
 int ksmbd_conn_rdma_read(struct ksmbd_conn *conn,
 			 void *buf, unsigned int buflen,
 			 struct smb2_buffer_desc_v1 *desc,
-			 unsigned int desc_len);
+			 unsigned int desc_len,
+			 void (*done)(void *arg, int status), void *arg);
 int ksmbd_conn_rdma_write(struct ksmbd_conn *conn,
 			  void *buf, unsigned int buflen,
 			  struct smb2_buffer_desc_v1 *desc,
 			  unsigned int desc_len);
+void *ksmbd_conn_rdma_buf_alloc(struct ksmbd_conn *conn, unsigned int len);
+void ksmbd_conn_rdma_buf_free(struct ksmbd_conn *conn, void *buf);
 void ksmbd_conn_enqueue_request(struct ksmbd_work *work);
 int ksmbd_conn_try_dequeue_request(struct ksmbd_work *work);
 void ksmbd_conn_init_server_callbacks(struct ksmbd_conn_ops *ops);
 int ksmbd_conn_handler_loop(void *p);
+void ksmbd_conn_set_affinity(struct ksmbd_conn *conn);
 int ksmbd_conn_transport_init(void);
 void ksmbd_conn_transport_destroy(void);
 
@@ -166,7 +166,10 @@ struct ksmbd_share_config_response {
 	__u16	force_uid;
 	__u16	force_gid;
 	__s8	share_name[KSMBD_REQ_MAX_SHARE_NAME];
-	__u32	reserved[112];		/* Reserved room */
+	__u32	max_iops;		/* 0 for unlimited */
+	__u32	max_bandwidth;		/* in KiB/s, 0 for unlimited */
+	__u32	sched_weight;		/* 0 for the default weight */
+	__u32	reserved[109];		/* Reserved room */
 	__u32	veto_list_sz;
 	__s8	____payload[];
 };
@@ -353,6 +356,8 @@ enum KSMBD_TREE_CONN_STATUS {
 #define KSMBD_SHARE_FLAG_FOLLOW_SYMLINKS	BIT(12)
 #define KSMBD_SHARE_FLAG_ACL_XATTR		BIT(13)
 #define KSMBD_SHARE_FLAG_UPDATE		BIT(14)
+#define KSMBD_SHARE_FLAG_META_XATTR		BIT(15)
+#define KSMBD_SHARE_FLAG_NO_SHORT_NAMES		BIT(16)
 
 /*
  * Tree connect request flags.
@@ -0,0 +1,589 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   Request scheduler of ksmbd
+ *
+ *   Requests are queued per flow, a flow being the requests of a session
+ *   on one tree connection, and handed to the work queue by deficit round
+ *   robin weighted by the share. Only max_running requests are handed to
+ *   the work queue at a time, so that a client keeping many requests in
+ *   flight can't starve the others. Metadata requests go ahead of data
+ *   requests, and shares can be limited in IOPS and bandwidth.
+ */
+
+#include <linux/hashtable.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+#include <linux/sysfs.h>
+#include <linux/workqueue.h>
+
+#include "glob.h"
+#include "connection.h"
+#include "ksmbd_work.h"
+#include "ksmbd_sched.h"
+#include "smb2pdu.h"
+#include "mgmt/share_config.h"
+#include "mgmt/tree_connect.h"
+
+/* Requests handed to the work queue per online CPU */
+static int ksmbd_sched_running_per_cpu = 4;
+
+/* Metadata requests dispatched in a row while data requests wait */
+#define KSMBD_SCHED_META_BURST		8
+/* Cost units a flow of default weight is granted per round */
+#define KSMBD_SCHED_QUANTUM		4
+/* Bytes of read or write payload costing one more unit */
+#define KSMBD_SCHED_COST_BYTES		(64 * 1024)
+#define KSMBD_SCHED_TICK		msecs_to_jiffies(10)
+/* Let one more request run when none completed for this long */
+#define KSMBD_SCHED_STALL_TIMEOUT	(HZ / 10)
+/*
+ * Idle flows are freed, and drop their share reference, after this
+ * long. The share is kept over short pauses so that requests issued one
+ * at a time are still throttled when they are dispatched.
+ */
+#define KSMBD_SCHED_FLOW_IDLE		HZ
+#define KSMBD_SCHED_FLOW_HASH_BITS	8
+
+struct ksmbd_sched_flow {
+	u64			sess_id;
+	u32			tree_id;
+	/* requests without a session are scheduled per connection */
+	struct ksmbd_conn	*conn;
+	struct hlist_node	hlist;
+
+	struct list_head	queue[KSMBD_SCHED_CLASS_MAX];
+	/* on sched.active[] while the queue of the class is not empty */
+	struct list_head	active[KSMBD_SCHED_CLASS_MAX];
+	int			deficit[KSMBD_SCHED_CLASS_MAX];
+
+	/* share the requests were last run against */
+	struct ksmbd_share_config *share;
+	unsigned int		nr_pending;
+	unsigned int		nr_running;
+	unsigned long		last_used;
+};
+
+static struct {
+	spinlock_t		lock;
+	struct list_head	active[KSMBD_SCHED_CLASS_MAX];
+	unsigned int		nr_pending;
+	unsigned int		nr_running;
+	unsigned int		max_running;
+	unsigned int		meta_streak;
+	unsigned int		nr_flows;
+	/* jiffies of the last dispatch or completion */
+	unsigned long		last_progress;
+	unsigned long		last_gc;
+	bool			tick_armed;
+	struct delayed_work	tick;
+
+	u64			dispatched[KSMBD_SCHED_CLASS_MAX];
+	u64			delay_sum[KSMBD_SCHED_CLASS_MAX];
+	u64			delay_max[KSMBD_SCHED_CLASS_MAX];
+} sched;
+
+static DEFINE_HASHTABLE(flow_table, KSMBD_SCHED_FLOW_HASH_BITS);
+
+static const char * const sched_class_str[] = { "meta", "data" };
+
+struct ksmbd_sched_key {
+	u64			sess_id;
+	u32			tree_id;
+	struct ksmbd_conn	*conn;
+};
+
+static u64 sched_key_hash(struct ksmbd_sched_key *key)
+{
+	return key->sess_id ^ ((u64)key->tree_id << 32) ^
+		(unsigned long)key->conn;
+}
+
+/*
+ * Classify a request from its SMB2 header. Encrypted requests only
+ * reveal their session, SMB1 requests nothing.
+ */
+static void ksmbd_sched_classify(struct ksmbd_work *work,
+				 struct ksmbd_sched_key *key)
+{
+	unsigned int len = get_rfc1002_len(work->request_buf);
+	struct smb2_hdr *hdr = smb2_get_msg(work->request_buf);
+
+	memset(key, 0, sizeof(*key));
+	work->sched_class = KSMBD_SCHED_CLASS_DATA;
+	work->sched_bytes = 0;
+
+	if (len < sizeof(__le32))
+		goto out;
+
+	if (hdr->ProtocolId == SMB2_TRANSFORM_PROTO_NUM) {
+		if (len >= sizeof(struct smb2_transform_hdr))
+			key->sess_id = le64_to_cpu(((struct smb2_transform_hdr *)
+						    hdr)->SessionId);
+		goto out;
+	}
+
+	if (hdr->ProtocolId != SMB2_PROTO_NUMBER ||
+	    len < sizeof(struct smb2_hdr))
+		goto out;
+
+	key->sess_id = le64_to_cpu(hdr->SessionId);
+	if (!(hdr->Flags & SMB2_FLAGS_ASYNC_COMMAND))
+		key->tree_id = le32_to_cpu(hdr->Id.SyncId.TreeId);
+
+	switch (hdr->Command) {
+	case SMB2_READ:
+		if (len >= offsetof(struct smb2_read_req, Offset))
+			work->sched_bytes =
+				le32_to_cpu(((struct smb2_read_req *)hdr)->Length);
+		break;
+	case SMB2_WRITE:
+		if (len >= offsetof(struct smb2_write_req, Offset))
+			work->sched_bytes =
+				le32_to_cpu(((struct smb2_write_req *)hdr)->Length);
+		break;
+	case SMB2_FLUSH:
+	case SMB2_IOCTL:
+	case SMB2_QUERY_DIRECTORY:
+		break;
+	default:
+		work->sched_class = KSMBD_SCHED_CLASS_META;
+	}
+
+out:
+	work->sched_cost = 1 + work->sched_bytes / KSMBD_SCHED_COST_BYTES;
+	if (!key->sess_id)
+		key->conn = work->conn;
+}
+
+static struct ksmbd_sched_flow *
+__ksmbd_sched_lookup_flow(struct ksmbd_sched_key *key, u64 hash)
+{
+	struct ksmbd_sched_flow *flow;
+
+	hash_for_each_possible(flow_table, flow, hlist, hash) {
+		if (flow->sess_id == key->sess_id &&
+		    flow->tree_id == key->tree_id &&
+		    flow->conn == key->conn)
+			return flow;
+	}
+	return NULL;
+}
+
+static struct ksmbd_sched_flow *
+ksmbd_sched_alloc_flow(struct ksmbd_sched_key *key)
+{
+	struct ksmbd_sched_flow *flow;
+	int i;
+
+	flow = kzalloc(sizeof(struct ksmbd_sched_flow), GFP_KERNEL);
+	if (!flow)
+		return NULL;
+
+	flow->sess_id = key->sess_id;
+	flow->tree_id = key->tree_id;
+	flow->conn = key->conn;
+	for (i = 0; i < KSMBD_SCHED_CLASS_MAX; i++) {
+		INIT_LIST_HEAD(&flow->queue[i]);
+		INIT_LIST_HEAD(&flow->active[i]);
+	}
+	return flow;
+}
+
+static void ksmbd_sched_free_flow(struct ksmbd_sched_flow *flow)
+{
+	if (flow->share)
+		ksmbd_share_config_put(flow->share);
+	kfree(flow);
+}
+
+static int ksmbd_sched_quantum(struct ksmbd_sched_flow *flow)
+{
+	unsigned int weight = KSMBD_SCHED_DEFAULT_WEIGHT;
+
+	if (flow->share && flow->share->sched_weight)
+		weight = flow->share->sched_weight;
+	return DIV_ROUND_UP(KSMBD_SCHED_QUANTUM * weight,
+			    KSMBD_SCHED_DEFAULT_WEIGHT);
+}
+
+/*
+ * Token buckets are kept in nanosecond and microsecond units of a token
+ * so that slow refill rates don't round down to nothing. They hold up
+ * to one second worth of tokens.
+ */
+static bool ksmbd_sched_throttled(struct ksmbd_sched_flow *flow)
+{
+	struct ksmbd_share_config *share = flow->share;
+	struct ksmbd_qos_bucket *b;
+	u64 now, elapsed;
+
+	if (!share || (!share->max_iops && !share->max_bandwidth))
+		return false;
+
+	b = &share->qos;
+	now = ktime_get_ns();
+	elapsed = min_t(u64, now - b->stamp, NSEC_PER_SEC);
+	b->stamp = now;
+
+	if (share->max_iops) {
+		b->iops_tokens = min_t(s64,
+				       b->iops_tokens + elapsed * share->max_iops,
+				       (s64)share->max_iops * NSEC_PER_SEC);
+		if (b->iops_tokens < 0)
+			return true;
+	}
+
+	if (share->max_bandwidth) {
+		elapsed = div_u64(elapsed, NSEC_PER_USEC);
+		b->byte_tokens = min_t(s64,
+				       b->byte_tokens + elapsed * share->max_bandwidth,
+				       (s64)share->max_bandwidth * USEC_PER_SEC);
+		if (b->byte_tokens < 0)
+			return true;
+	}
+	return false;
+}
+
+static void ksmbd_sched_charge(struct ksmbd_sched_flow *flow,
+			       struct ksmbd_work *work)
+{
+	struct ksmbd_share_config *share = flow->share;
+
+	if (!share)
+		return;
+
+	work->sched_charged = true;
+	if (share->max_iops)
+		share->qos.iops_tokens -= NSEC_PER_SEC;
+	if (share->max_bandwidth)
+		share->qos.byte_tokens -= (s64)work->sched_bytes * USEC_PER_SEC;
+}
+
+/*
+ * Deficit round robin over the flows with pending requests of a class.
+ * Flows of a throttled share are skipped until their bucket refills.
+ */
+static struct ksmbd_work *ksmbd_sched_pick(int class)
+{
+	struct list_head *active = &sched.active[class];
+	struct ksmbd_sched_flow *flow, *first_throttled = NULL;
+	struct ksmbd_work *work;
+
+	while (!list_empty(active)) {
+		flow = list_first_entry(active, struct ksmbd_sched_flow,
+					active[class]);
+		if (flow == first_throttled)
+			return NULL;
+
+		if (ksmbd_sched_throttled(flow)) {
+			if (!first_throttled)
+				first_throttled = flow;
+			list_move_tail(&flow->active[class], active);
+			continue;
+		}
+
+		work = list_first_entry(&flow->queue[class], struct ksmbd_work,
+					sched_entry);
+		if (flow->deficit[class] < (int)work->sched_cost) {
+			flow->deficit[class] += ksmbd_sched_quantum(flow);
+			first_throttled = NULL;
+			list_move_tail(&flow->active[class], active);
+			continue;
+		}
+
+		flow->deficit[class] -= work->sched_cost;
+		list_del_init(&work->sched_entry);
+		if (list_empty(&flow->queue[class])) {
+			list_del_init(&flow->active[class]);
+			flow->deficit[class] = 0;
+		}
+		ksmbd_sched_charge(flow, work);
+		return work;
+	}
+	return NULL;
+}
+
+/*
+ * Move the requests which may run now to @dispatch. Called with
+ * sched.lock held, @force lets one request run beyond max_running.
+ */
+static void ksmbd_sched_dispatch(struct list_head *dispatch, bool force)
+{
+	struct ksmbd_work *work;
+	u64 now = ktime_get_ns(), delay;
+	int class;
+
+	while (force || sched.nr_running < sched.max_running) {
+		work = NULL;
+		if (sched.meta_streak >= KSMBD_SCHED_META_BURST)
+			work = ksmbd_sched_pick(KSMBD_SCHED_CLASS_DATA);
+		if (!work)
+			work = ksmbd_sched_pick(KSMBD_SCHED_CLASS_META);
+		if (!work)
+			work = ksmbd_sched_pick(KSMBD_SCHED_CLASS_DATA);
+		if (!work)
+			break;
+
+		class = work->sched_class;
+		if (class == KSMBD_SCHED_CLASS_META)
+			sched.meta_streak++;
+		else
+			sched.meta_streak = 0;
+
+		delay = now - work->sched_time;
+		sched.dispatched[class]++;
+		sched.delay_sum[class] += delay;
+		if (delay > sched.delay_max[class])
+			sched.delay_max[class] = delay;
+
+		work->sched_flow->nr_pending--;
+		work->sched_flow->nr_running++;
+		sched.nr_pending--;
+		sched.nr_running++;
+		sched.last_progress = jiffies;
+		list_add_tail(&work->sched_entry, dispatch);
+		force = false;
+	}
+
+	if (sched.nr_pending && !sched.tick_armed) {
+		sched.tick_armed = true;
+		mod_delayed_work(system_wq, &sched.tick, KSMBD_SCHED_TICK);
+	}
+}
+
+static void ksmbd_sched_submit(struct list_head *dispatch)
+{
+	struct ksmbd_work *work, *tmp;
+
+	list_for_each_entry_safe(work, tmp, dispatch, sched_entry) {
+		list_del_init(&work->sched_entry);
+		ksmbd_queue_work(work);
+	}
+}
+
+static void ksmbd_sched_tick(struct work_struct *wk)
+{
+	struct ksmbd_sched_flow *flow;
+	struct hlist_node *tmp;
+	LIST_HEAD(dispatch);
+	LIST_HEAD(idle);
+	bool stalled;
+	int bkt;
+
+	spin_lock(&sched.lock);
+	sched.tick_armed = false;
+
+	/*
+	 * Requests known to wait for others release their slot, see
+	 * ksmbd_sched_work_done(). Let one more run when none completed
+	 * for a while anyway, so that other waits can't deadlock.
+	 */
+	stalled = sched.nr_running >= sched.max_running &&
+		time_after(jiffies,
+			   sched.last_progress + KSMBD_SCHED_STALL_TIMEOUT);
+	ksmbd_sched_dispatch(&dispatch, stalled);
+
+	if (time_after(jiffies, sched.last_gc + KSMBD_SCHED_FLOW_IDLE)) {
+		hash_for_each_safe(flow_table, bkt, tmp, flow, hlist) {
+			if (flow->nr_pending || flow->nr_running ||
+			    time_before(jiffies,
+					flow->last_used + KSMBD_SCHED_FLOW_IDLE))
+				continue;
+			hash_del(&flow->hlist);
+			sched.nr_flows--;
+			/* active lists of an idle flow are unused */
+			list_add(&flow->active[0], &idle);
+		}
+		sched.last_gc = jiffies;
+	}
+
+	if (!sched.tick_armed && sched.nr_flows)
+		schedule_delayed_work(&sched.tick, KSMBD_SCHED_FLOW_IDLE);
+	spin_unlock(&sched.lock);
+
+	ksmbd_sched_submit(&dispatch);
+
+	while (!list_empty(&idle)) {
+		flow = list_first_entry(&idle, struct ksmbd_sched_flow,
+					active[0]);
+		list_del(&flow->active[0]);
+		ksmbd_sched_free_flow(flow);
+	}
+}
+
+/**
+ * ksmbd_sched_queue_work() - queue a request to the scheduler
+ * @work:	smb work of the request
+ *
+ * The request is handed to the work queue once its flow gets its turn.
+ */
+void ksmbd_sched_queue_work(struct ksmbd_work *work)
+{
+	struct ksmbd_sched_flow *flow, *new = NULL;
+	struct ksmbd_sched_key key;
+	LIST_HEAD(dispatch);
+	u64 hash;
+	int class;
+
+	ksmbd_sched_classify(work, &key);
+	hash = sched_key_hash(&key);
+	class = work->sched_class;
+
+	spin_lock(&sched.lock);
+	flow = __ksmbd_sched_lookup_flow(&key, hash);
+	if (!flow) {
+		spin_unlock(&sched.lock);
+		new = ksmbd_sched_alloc_flow(&key);
+		if (!new) {
+			/* run it unscheduled rather than dropping it */
+			ksmbd_queue_work(work);
+			return;
+		}
+
+		spin_lock(&sched.lock);
+		flow = __ksmbd_sched_lookup_flow(&key, hash);
+		if (!flow) {
+			flow = new;
+			new = NULL;
+			hash_add(flow_table, &flow->hlist, hash);
+			if (!sched.nr_flows++ && !sched.tick_armed)
+				schedule_delayed_work(&sched.tick,
+						      KSMBD_SCHED_FLOW_IDLE);
+		}
+	}
+
+	work->sched_flow = flow;
+	work->sched_time = ktime_get_ns();
+	list_add_tail(&work->sched_entry, &flow->queue[class]);
+	if (list_empty(&flow->active[class]))
+		list_add_tail(&flow->active[class], &sched.active[class]);
+	flow->nr_pending++;
+	flow->last_used = jiffies;
+	sched.nr_pending++;
+
+	ksmbd_sched_dispatch(&dispatch, false);
+	spin_unlock(&sched.lock);
+
+	kfree(new);
+	ksmbd_sched_submit(&dispatch);
+}
+
+/**
+ * ksmbd_sched_work_done() - release the slot of a request
+ * @work:	smb work of the request
+ *
+ * Called when the request finishes, or earlier when it is about to wait
+ * for another request, e.g. a blocking byte-range lock going async or an
+ * open waiting for an oplock break acknowledgment, so that waiting
+ * requests don't hold slots the ones they wait for need. Calls after the
+ * first are no-ops.
+ */
+void ksmbd_sched_work_done(struct ksmbd_work *work)
+{
+	struct ksmbd_sched_flow *flow = work->sched_flow;
+	LIST_HEAD(dispatch);
+
+	if (!flow)
+		return;
+	work->sched_flow = NULL;
+
+	spin_lock(&sched.lock);
+	flow->nr_running--;
+	flow->last_used = jiffies;
+	sched.nr_running--;
+	sched.last_progress = jiffies;
+	ksmbd_sched_dispatch(&dispatch, false);
+	spin_unlock(&sched.lock);
+
+	ksmbd_sched_submit(&dispatch);
+}
+
+/**
+ * ksmbd_sched_set_share() - apply the weight and limits of the share
+ *			     a request runs against to its flow
+ * @work:	smb work with a tree connection
+ *
+ * The share of a flow is only known once one of its requests has been
+ * dispatched. Requests dispatched before that are charged to the limits
+ * of the share here, so that a flow's first requests are not free.
+ */
+void ksmbd_sched_set_share(struct ksmbd_work *work)
+{
+	struct ksmbd_sched_flow *flow = work->sched_flow;
+	struct ksmbd_share_config *share, *old = NULL;
+
+	if (!flow || !work->tcon || !work->tcon->share_conf)
+		return;
+
+	share = work->tcon->share_conf;
+	if (READ_ONCE(flow->share) == share && work->sched_charged)
+		return;
+
+	spin_lock(&sched.lock);
+	if (flow->share != share) {
+		/* the tree connection holds a reference */
+		atomic_inc(&share->refcount);
+		old = flow->share;
+		flow->share = share;
+	}
+	if (!work->sched_charged)
+		ksmbd_sched_charge(flow, work);
+	spin_unlock(&sched.lock);
+
+	if (old)
+		ksmbd_share_config_put(old);
+}
+
+int ksmbd_sched_stats_show(char *buf)
+{
+	ssize_t sz = 0;
+	u64 avg;
+	int i;
+
+	spin_lock(&sched.lock);
+	sz += sysfs_emit_at(buf, sz, "running: %u/%u pending: %u flows: %u\n",
+			    sched.nr_running, sched.max_running,
+			    sched.nr_pending, sched.nr_flows);
+	for (i = 0; i < KSMBD_SCHED_CLASS_MAX; i++) {
+		avg = sched.dispatched[i] ?
+			div64_u64(sched.delay_sum[i], sched.dispatched[i]) : 0;
+		sz += sysfs_emit_at(buf, sz,
+				    "%s: dispatched %llu avg_delay_us %llu max_delay_us %llu\n",
+				    sched_class_str[i], sched.dispatched[i],
+				    div_u64(avg, NSEC_PER_USEC),
+				    div_u64(sched.delay_max[i], NSEC_PER_USEC));
+	}
+	spin_unlock(&sched.lock);
+	return sz;
+}
+
+int ksmbd_sched_init(void)
+{
+	int i;
+
+	spin_lock_init(&sched.lock);
+	for (i = 0; i < KSMBD_SCHED_CLASS_MAX; i++)
+		INIT_LIST_HEAD(&sched.active[i]);
+	sched.max_running = max_t(unsigned int, 16,
+				  ksmbd_sched_running_per_cpu *
+				  num_online_cpus());
+	sched.last_progress = jiffies;
+	sched.last_gc = jiffies;
+	INIT_DELAYED_WORK(&sched.tick, ksmbd_sched_tick);
+	return 0;
+}
+
+void ksmbd_sched_destroy(void)
+{
+	struct ksmbd_sched_flow *flow;
+	struct hlist_node *tmp;
+	int bkt;
+
+	cancel_delayed_work_sync(&sched.tick);
+	hash_for_each_safe(flow_table, bkt, tmp, flow, hlist) {
+		hash_del(&flow->hlist);
+		ksmbd_sched_free_flow(flow);
+	}
+	sched.nr_flows = 0;
+}
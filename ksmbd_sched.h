@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ *   Request scheduler of ksmbd
+ */
+
+#ifndef __KSMBD_SCHED_H__
+#define __KSMBD_SCHED_H__
+
+#include <linux/types.h>
+
+struct ksmbd_work;
+
+/* Latency class of a request */
+enum {
+	KSMBD_SCHED_CLASS_META = 0,
+	KSMBD_SCHED_CLASS_DATA,
+	KSMBD_SCHED_CLASS_MAX
+};
+
+#define KSMBD_SCHED_DEFAULT_WEIGHT	100
+#define KSMBD_SCHED_MAX_WEIGHT		1000
+
+/*
+ * Token bucket enforcing the IOPS and bandwidth limits of a share.
+ * Protected by the scheduler lock.
+ */
+struct ksmbd_qos_bucket {
+	u64	stamp;
+	s64	iops_tokens;
+	s64	byte_tokens;
+};
+
+int ksmbd_sched_init(void);
+void ksmbd_sched_destroy(void);
+void ksmbd_sched_queue_work(struct ksmbd_work *work);
+void ksmbd_sched_work_done(struct ksmbd_work *work);
+void ksmbd_sched_set_share(struct ksmbd_work *work);
+int ksmbd_sched_stats_show(char *buf);
+
+#endif /* __KSMBD_SCHED_H__ */
@@ -16,34 +16,317 @@
 static struct kmem_cache *work_cache;
 static struct workqueue_struct *ksmbd_wq;
 
+/*
+ * Works in flight per online CPU of a node beyond which new works are
+ * handed to a less loaded node.
+ */
+static int ksmbd_node_overload = 4;
+
+/* Works queued on each node and not yet freed */
+static atomic_t *node_load;
+
+/*
+ * Request, response and read buffers of works in flight are charged to
+ * a server wide budget. Over budget, connections stop reading new PDUs
+ * and credit grants shrink.
+ */
+static atomic_long_t inflight_mem = ATOMIC_LONG_INIT(0);
+static unsigned long mem_budget;
+static DECLARE_WAIT_QUEUE_HEAD(mem_budget_wait);
+
+/* Minimum budget, the default is an eighth of the memory */
+#define KSMBD_MIN_MEM_BUDGET		(64UL << 20)
+/*
+ * A connection reads its next PDU after this long even over budget,
+ * requests can be waiting for a PDU of the same connection.
+ */
+#define KSMBD_MEM_THROTTLE_TIMEOUT	HZ
+
 struct ksmbd_work *ksmbd_alloc_work_struct(void)
 {
-	struct ksmbd_work *work = kmem_cache_zalloc(work_cache, GFP_KERNEL);
+	struct ksmbd_work *work = kmem_cache_alloc(work_cache, GFP_KERNEL);
 
 	if (work) {
+		memset(work, 0, offsetof(struct ksmbd_work, scratch));
+		work->node = NUMA_NO_NODE;
+		work->recv_node = NUMA_NO_NODE;
 		work->compound_fid = KSMBD_NO_FID;
 		work->compound_pfid = KSMBD_NO_FID;
 		INIT_LIST_HEAD(&work->request_entry);
 		INIT_LIST_HEAD(&work->async_request_entry);
 		INIT_LIST_HEAD(&work->fp_entry);
 		INIT_LIST_HEAD(&work->interim_entry);
+		INIT_LIST_HEAD(&work->sched_entry);
 	}
 	return work;
 }
 
 void ksmbd_free_work_struct(struct ksmbd_work *work)
 {
+	unsigned int i;
+
 	WARN_ON(work->saved_cred != NULL);
 
+	for (i = 0; i < work->nr_payloads; i++)
+		kvfree(work->payloads[i].priv);
+	if (work->payloads != work->payload_inline)
+		kfree(work->payloads);
+
 	kvfree(work->response_buf);
 	kvfree(work->aux_payload_buf);
 	kfree(work->tr_buf);
-	kvfree(work->request_buf);
+	kvfree(work->request_alloc ?: work->request_buf);
 	if (work->async_id)
 		ksmbd_release_id(&work->conn->async_ida, work->async_id);
+	if (work->node != NUMA_NO_NODE)
+		atomic_dec(&node_load[work->node]);
+	if (work->mem_charged) {
+		atomic_long_sub(work->mem_charged, &inflight_mem);
+		if (waitqueue_active(&mem_budget_wait) &&
+		    !ksmbd_mem_over_budget())
+			wake_up_all(&mem_budget_wait);
+	}
 	kmem_cache_free(work_cache, work);
 }
 
+/**
+ * ksmbd_work_add_payload() - append data to the response without copying
+ * @work:	smb work containing response buffer
+ * @buf:	data to send
+ * @len:	length of @buf
+ * @priv:	allocation released with kvfree() when the work is freed,
+ *		may be NULL
+ *
+ * The data follows what has been written to the response buffer so far
+ * and the RFC1002 length is updated. Responses built later, including
+ * those of further compound elements, go after it.
+ *
+ * Return:	0 on success, otherwise -ENOMEM and @priv is not taken over
+ */
+int ksmbd_work_add_payload(struct ksmbd_work *work, void *buf,
+			   unsigned int len, void *priv)
+{
+	struct ksmbd_rsp_payload *p;
+
+	if (!work->max_payloads) {
+		work->payloads = work->payload_inline;
+		work->max_payloads = ARRAY_SIZE(work->payload_inline);
+	}
+
+	if (work->nr_payloads == work->max_payloads) {
+		unsigned int max = work->max_payloads * 2;
+
+		p = kmalloc_array(max, sizeof(*p), GFP_KERNEL);
+		if (!p)
+			return -ENOMEM;
+
+		memcpy(p, work->payloads, work->nr_payloads * sizeof(*p));
+		if (work->payloads != work->payload_inline)
+			kfree(work->payloads);
+		work->payloads = p;
+		work->max_payloads = max;
+	}
+
+	p = &work->payloads[work->nr_payloads++];
+	p->off = get_rfc1002_len(work->response_buf) + 4 - work->aux_payload_sz;
+	p->len = len;
+	p->buf = buf;
+	p->priv = priv;
+
+	work->aux_payload_sz += len;
+	inc_rfc1001_len(work->response_buf, len);
+	return 0;
+}
+
+/* Add the part of a segment at @start on the wire inside [*off, *off + *len) */
+static int ksmbd_rsp_iov_seg(struct kvec *iov, char *seg, unsigned int start,
+			     unsigned int seg_len, unsigned int *off,
+			     unsigned int *len)
+{
+	unsigned int skip;
+
+	if (!*len || *off >= start + seg_len)
+		return 0;
+
+	skip = *off - start;
+	iov->iov_base = seg + skip;
+	iov->iov_len = min(seg_len - skip, *len);
+	*off += iov->iov_len;
+	*len -= iov->iov_len;
+	return 1;
+}
+
+/**
+ * ksmbd_work_rsp_iov() - describe a range of the response on the wire
+ * @work:	smb work containing response buffer
+ * @off:	offset of the range on the wire, RFC1002 header included
+ * @len:	length of the range
+ * @iov:	kvecs to fill
+ * @nr_iov:	number of entries in @iov, ksmbd_work_nr_rsp_iov() is enough
+ *
+ * The response buffer is split around the payloads. The range may end
+ * beyond the RFC1002 length, the padding of a compound element is signed
+ * before it is counted.
+ *
+ * Return:	number of kvecs filled
+ */
+int ksmbd_work_rsp_iov(struct ksmbd_work *work, unsigned int off,
+		       unsigned int len, struct kvec *iov, int nr_iov)
+{
+	char *rsp = work->response_buf;
+	unsigned int pos = 0, buf_off = 0, i;
+	int n = 0;
+
+	for (i = 0; len && i < work->nr_payloads; i++) {
+		struct ksmbd_rsp_payload *p = &work->payloads[i];
+		unsigned int seg_len = p->off - buf_off;
+
+		if (WARN_ON_ONCE(n + 2 > nr_iov))
+			return n;
+
+		n += ksmbd_rsp_iov_seg(&iov[n], rsp + buf_off, pos, seg_len,
+				       &off, &len);
+		pos += seg_len;
+		n += ksmbd_rsp_iov_seg(&iov[n], p->buf, pos, p->len, &off, &len);
+		pos += p->len;
+		buf_off = p->off;
+	}
+
+	/* the rest of the response buffer */
+	if (len && !WARN_ON_ONCE(n == nr_iov))
+		n += ksmbd_rsp_iov_seg(&iov[n], rsp + buf_off, pos,
+				       off + len - pos, &off, &len);
+	return n;
+}
+
+/*
+ * Each block of the scratch arena is preceded by the offset of the block
+ * allocated before it, so blocks freed in reverse order of allocation are
+ * given back to the arena.
+ */
+#define KSMBD_SCRATCH_HDR	sizeof(long)
+
+/**
+ * ksmbd_scratch_alloc() - allocate memory needed until the end of a request
+ * @work:	smb work
+ * @size:	number of bytes
+ *
+ * Small blocks are carved out of the arena embedded in the work, so the
+ * names of a typical request don't touch the allocator. Blocks that don't
+ * fit come from kmalloc().
+ *
+ * Return:	pointer to the block, NULL on failure
+ */
+void *ksmbd_scratch_alloc(struct ksmbd_work *work, size_t size)
+{
+	unsigned int off = ALIGN(work->scratch_used, KSMBD_SCRATCH_HDR);
+
+	if (size > KSMBD_WORK_SCRATCH_SIZE ||
+	    off + KSMBD_SCRATCH_HDR + size > KSMBD_WORK_SCRATCH_SIZE)
+		return kmalloc(size, GFP_KERNEL);
+
+	*(unsigned int *)(work->scratch + off) = work->scratch_top;
+	work->scratch_top = off;
+	work->scratch_used = off + KSMBD_SCRATCH_HDR + size;
+	return work->scratch + off + KSMBD_SCRATCH_HDR;
+}
+
+/**
+ * ksmbd_scratch_free() - free a block from ksmbd_scratch_alloc()
+ * @work:	smb work
+ * @ptr:	block to free, may be NULL
+ */
+void ksmbd_scratch_free(struct ksmbd_work *work, const void *ptr)
+{
+	const char *p = ptr;
+	unsigned int off;
+
+	if (p < work->scratch || p >= work->scratch + KSMBD_WORK_SCRATCH_SIZE) {
+		kfree(ptr);
+		return;
+	}
+
+	/* a block freed out of order is reclaimed with the work */
+	off = p - work->scratch - KSMBD_SCRATCH_HDR;
+	if (off != work->scratch_top)
+		return;
+	work->scratch_used = off;
+	work->scratch_top = *(unsigned int *)(work->scratch + off);
+}
+
+/**
+ * ksmbd_scratch_avail() - largest block the arena can still provide
+ * @work:	smb work
+ *
+ * Return:	number of bytes
+ */
+size_t ksmbd_scratch_avail(struct ksmbd_work *work)
+{
+	unsigned int off = ALIGN(work->scratch_used, KSMBD_SCRATCH_HDR);
+
+	if (off + KSMBD_SCRATCH_HDR >= KSMBD_WORK_SCRATCH_SIZE)
+		return 0;
+	return KSMBD_WORK_SCRATCH_SIZE - off - KSMBD_SCRATCH_HDR;
+}
+
+void ksmbd_work_charge_mem(struct ksmbd_work *work, size_t size)
+{
+	work->mem_charged += size;
+	atomic_long_add(size, &inflight_mem);
+}
+
+/**
+ * ksmbd_work_charge_payload() - charge the read payload buffer of a work
+ * @work:	smb work
+ * @size:	size of the buffer
+ *
+ * A read retried from a worker after it would have blocked inline
+ * allocates its buffer again, only the first allocation is charged.
+ */
+void ksmbd_work_charge_payload(struct ksmbd_work *work, size_t size)
+{
+	if (work->payload_charged)
+		return;
+	work->payload_charged = true;
+	ksmbd_work_charge_mem(work, size);
+}
+
+bool ksmbd_mem_over_budget(void)
+{
+	return atomic_long_read(&inflight_mem) > READ_ONCE(mem_budget);
+}
+
+/**
+ * ksmbd_mem_throttle() - wait for buffers in flight to drop below budget
+ *
+ * Called by connection threads before reading a new PDU.
+ */
+void ksmbd_mem_throttle(void)
+{
+	if (!ksmbd_mem_over_budget())
+		return;
+
+	wait_event_interruptible_timeout(mem_budget_wait,
+					 !ksmbd_mem_over_budget(),
+					 KSMBD_MEM_THROTTLE_TIMEOUT);
+}
+
+unsigned long ksmbd_mem_budget(void)
+{
+	return READ_ONCE(mem_budget);
+}
+
+void ksmbd_set_mem_budget(unsigned long budget)
+{
+	WRITE_ONCE(mem_budget, max(budget, KSMBD_MIN_MEM_BUDGET));
+	wake_up_all(&mem_budget_wait);
+}
+
+unsigned long ksmbd_mem_usage(void)
+{
+	return atomic_long_read(&inflight_mem);
+}
+
 void ksmbd_work_pool_destroy(void)
 {
 	kmem_cache_destroy(work_cache);
@@ -51,6 +334,9 @@ void ksmbd_work_pool_destroy(void)
 
 int ksmbd_work_pool_init(void)
 {
+	mem_budget = max((totalram_pages() << PAGE_SHIFT) / 8,
+			 KSMBD_MIN_MEM_BUDGET);
+
 	work_cache = kmem_cache_create("ksmbd_work_cache",
 				       sizeof(struct ksmbd_work), 0,
 				       SLAB_HWCACHE_ALIGN, NULL);
@@ -61,9 +347,16 @@ int ksmbd_work_pool_init(void)
 
 int ksmbd_workqueue_init(void)
 {
-	ksmbd_wq = alloc_workqueue("ksmbd-io", 0, 0);
-	if (!ksmbd_wq)
+	node_load = kcalloc(nr_node_ids, sizeof(atomic_t), GFP_KERNEL);
+	if (!node_load)
+		return -ENOMEM;
+
+	ksmbd_wq = alloc_workqueue("ksmbd-io", WQ_UNBOUND, 0);
+	if (!ksmbd_wq) {
+		kfree(node_load);
+		node_load = NULL;
 		return -ENOMEM;
+	}
 	return 0;
 }
 
@@ -71,9 +364,58 @@ void ksmbd_workqueue_destroy(void)
 {
 	destroy_workqueue(ksmbd_wq);
 	ksmbd_wq = NULL;
+	kfree(node_load);
+	node_load = NULL;
+}
+
+static bool node_overloaded(int node, int load)
+{
+	return load >= ksmbd_node_overload *
+		(int)cpumask_weight(cpumask_of_node(node));
+}
+
+/*
+ * Works run on the node of the CPU the connection is bound to, or of
+ * the context which received the request, so that the request and the
+ * buffers allocated for the response stay node local. The receiving
+ * node is recorded when the request is read, as works may be handed
+ * to the work queue later from the scheduler. An overloaded node hands
+ * new works to the least loaded node which is not.
+ */
+static int ksmbd_work_select_node(struct ksmbd_work *work)
+{
+	int cpu = work->conn ? READ_ONCE(work->conn->cpu) : WORK_CPU_UNBOUND;
+	int node, n, load, best_load;
+
+	if (cpu != WORK_CPU_UNBOUND && cpu_online(cpu))
+		node = cpu_to_node(cpu);
+	else if (work->recv_node != NUMA_NO_NODE)
+		node = work->recv_node;
+	else
+		node = numa_node_id();
+
+	best_load = atomic_read(&node_load[node]);
+	if (!node_overloaded(node, best_load))
+		return node;
+
+	for_each_online_node(n) {
+		if (!cpumask_weight(cpumask_of_node(n)))
+			continue;
+		load = atomic_read(&node_load[n]);
+		if (load < best_load && !node_overloaded(n, load)) {
+			node = n;
+			best_load = load;
+		}
+	}
+	return node;
 }
 
 bool ksmbd_queue_work(struct ksmbd_work *work)
 {
-	return queue_work(ksmbd_wq, &work->work);
+	/* a resumed work stays on the node it was accounted to */
+	if (work->node == NUMA_NO_NODE) {
+		work->node = ksmbd_work_select_node(work);
+		atomic_inc(&node_load[work->node]);
+	}
+	return queue_work_node(work->node, ksmbd_wq, &work->work);
 }
@@ -7,11 +7,14 @@
 #define __KSMBD_WORK_H__
 
 #include <linux/ctype.h>
+#include <linux/uio.h>
 #include <linux/workqueue.h>
 
 struct ksmbd_conn;
 struct ksmbd_session;
 struct ksmbd_tree_connect;
+struct ksmbd_file;
+struct ksmbd_sched_flow;
 
 enum {
 	KSMBD_WORK_ACTIVE = 0,
@@ -19,6 +22,23 @@ enum {
 	KSMBD_WORK_CLOSED,
 };
 
+#define KSMBD_WORK_SCRATCH_SIZE		1024
+
+/*
+ * Data sent as part of the response without being copied into the
+ * response buffer. It goes on the wire after the first @off bytes of
+ * the response buffer, see ksmbd_work_add_payload().
+ */
+struct ksmbd_rsp_payload {
+	unsigned int	off;
+	unsigned int	len;
+	void		*buf;
+	/* released with kvfree() along with the work */
+	void		*priv;
+};
+
+#define KSMBD_WORK_INLINE_PAYLOADS	2
+
 /* one of these for every pending CIFS request at the connection */
 struct ksmbd_work {
 	/* Server corresponding to this mid */
@@ -28,16 +48,26 @@ struct ksmbd_work {
 
 	/* Pointer to received SMB header */
 	void                            *request_buf;
+	/* Allocation holding request_buf once decrypted in place */
+	void				*request_alloc;
 	/* Response buffer */
 	void                            *response_buf;
 
 	/* Read data buffer */
 	void                            *aux_payload_buf;
 
+	/* Payloads of the response, in wire order */
+	struct ksmbd_rsp_payload	*payloads;
+	unsigned int			nr_payloads;
+	unsigned int			max_payloads;
+	struct ksmbd_rsp_payload	payload_inline[KSMBD_WORK_INLINE_PAYLOADS];
+
 	/* Next cmd hdr in compound req buf*/
 	int                             next_smb2_rcv_hdr_off;
 	/* Next cmd hdr in compound rsp buf*/
 	int                             next_smb2_rsp_hdr_off;
+	/* Payload bytes on the wire before the next cmd hdr in compound rsp */
+	unsigned int			next_smb2_rsp_aux_off;
 
 	/*
 	 * Current Local FID assigned compound response if SMB2 CREATE
@@ -46,16 +76,18 @@ struct ksmbd_work {
 	u64				compound_fid;
 	u64				compound_pfid;
 	u64				compound_sid;
+	/* Reference on the file of compound_fid, reused by related commands */
+	struct ksmbd_file		*compound_fp;
+	/* the current command is the last related one, it takes compound_fp */
+	bool				compound_fp_last;
 
 	const struct cred		*saved_cred;
 
 	/* Number of granted credits */
 	unsigned int			credits_granted;
 
-	/* response smb header size */
-	unsigned int                    resp_hdr_sz;
 	unsigned int                    response_sz;
-	/* Read data count */
+	/* Bytes of all payloads, counted in the RFC1002 length */
 	unsigned int                    aux_payload_sz;
 
 	void				*tr_buf;
@@ -70,8 +102,40 @@ struct ksmbd_work {
 	/* Is this SYNC or ASYNC ksmbd_work */
 	bool                            synchronous:1;
 	bool                            need_invalidate_rkey:1;
+	/* Executed in the receiving thread, see queue_ksmbd_work() */
+	bool                            inline_exec:1;
 
 	unsigned int                    remote_key;
+
+	/*
+	 * Continuation of a command whose handler returned before an
+	 * asynchronous RDMA read completed. It is run from the work queue
+	 * and is expected to fill the response.
+	 */
+	int				(*resume_fn)(struct ksmbd_work *work);
+	struct ksmbd_file		*rdma_fp;
+	void				*rdma_buf;
+	int				rdma_status;
+
+	/* NUMA node the work is accounted to while in flight */
+	int				node;
+	/* NUMA node of the context which received the request */
+	int				recv_node;
+	/* bytes of buffers charged to the memory budget */
+	size_t				mem_charged;
+	/* the read payload buffer was charged */
+	bool				payload_charged;
+
+	/* request scheduler state, see ksmbd_sched.c */
+	struct ksmbd_sched_flow		*sched_flow;
+	struct list_head		sched_entry;
+	u64				sched_time;
+	unsigned int			sched_cost;
+	unsigned int			sched_bytes;
+	unsigned char			sched_class;
+	/* the request was charged to the limits of its share */
+	bool				sched_charged;
+
 	/* cancel works */
 	int                             async_id;
 	void                            **cancel_argv;
@@ -84,6 +148,15 @@ struct ksmbd_work {
 	struct list_head                async_request_entry;
 	struct list_head                fp_entry;
 	struct list_head                interim_entry;
+
+	/*
+	 * Arena for names needed only while the request is processed,
+	 * see ksmbd_scratch_alloc(). Kept last, it is not zeroed on alloc.
+	 */
+	unsigned int			scratch_used;
+	unsigned int			scratch_top;
+	char				scratch[KSMBD_WORK_SCRATCH_SIZE]
+						__aligned(sizeof(long));
 };
 
 /**
@@ -110,6 +183,32 @@ void ksmbd_free_work_struct(struct ksmbd_work *work);
 void ksmbd_work_pool_destroy(void);
 int ksmbd_work_pool_init(void);
 
+int ksmbd_work_add_payload(struct ksmbd_work *work, void *buf,
+			   unsigned int len, void *priv);
+int ksmbd_work_rsp_iov(struct ksmbd_work *work, unsigned int off,
+		       unsigned int len, struct kvec *iov, int nr_iov);
+
+/**
+ * ksmbd_work_nr_rsp_iov - Upper bound of the kvecs describing a response.
+ * @work: smb work containing response buffer
+ */
+static inline int ksmbd_work_nr_rsp_iov(struct ksmbd_work *work)
+{
+	return 2 * work->nr_payloads + 1;
+}
+
+void *ksmbd_scratch_alloc(struct ksmbd_work *work, size_t size);
+void ksmbd_scratch_free(struct ksmbd_work *work, const void *ptr);
+size_t ksmbd_scratch_avail(struct ksmbd_work *work);
+
+void ksmbd_work_charge_mem(struct ksmbd_work *work, size_t size);
+void ksmbd_work_charge_payload(struct ksmbd_work *work, size_t size);
+bool ksmbd_mem_over_budget(void);
+void ksmbd_mem_throttle(void);
+unsigned long ksmbd_mem_budget(void);
+void ksmbd_set_mem_budget(unsigned long budget);
+unsigned long ksmbd_mem_usage(void);
+
 int ksmbd_workqueue_init(void);
 void ksmbd_workqueue_destroy(void);
 bool ksmbd_queue_work(struct ksmbd_work *work);
@@ -17,6 +17,7 @@
 #include "user_session.h"
 #include "../transport_ipc.h"
 #include "../misc.h"
+#include "../vfs.h"
 
 #define SHARE_HASH_BITS		3
 static DEFINE_HASHTABLE(shares_table, SHARE_HASH_BITS);
@@ -45,8 +46,11 @@ static void kill_share(struct ksmbd_share_config *share)
 		kfree(p);
 	}
 
-	if (share->path)
+	if (share->path) {
+		if (test_share_config_flag(share, KSMBD_SHARE_FLAG_META_XATTR))
+			ksmbd_vfs_disable_meta_xattr(share->vfs_path.dentry->d_sb);
 		path_put(&share->vfs_path);
+	}
 	kfree(share->name);
 	kfree(share->path);
 	kfree(share);
@@ -168,6 +172,10 @@ static struct ksmbd_share_config *share_config_request(struct unicode_map *um,
 		share->force_directory_mode = resp->force_directory_mode;
 		share->force_uid = resp->force_uid;
 		share->force_gid = resp->force_gid;
+		share->max_iops = resp->max_iops;
+		share->max_bandwidth = (u64)resp->max_bandwidth * 1024;
+		share->sched_weight = min_t(unsigned int, resp->sched_weight,
+					    KSMBD_SCHED_MAX_WEIGHT);
 		ret = parse_veto_list(share,
 				      KSMBD_SHARE_CONFIG_VETO_LIST(resp),
 				      resp->veto_list_sz);
@@ -181,6 +189,13 @@ static struct ksmbd_share_config *share_config_request(struct unicode_map *um,
 				share->path = NULL;
 			}
 		}
+		if (!ret && share->path &&
+		    test_share_config_flag(share, KSMBD_SHARE_FLAG_META_XATTR)) {
+			ret = ksmbd_vfs_enable_meta_xattr(share->vfs_path.dentry->d_sb);
+			/* kill_share() must not disable it */
+			if (ret)
+				share->flags &= ~KSMBD_SHARE_FLAG_META_XATTR;
+		}
 		if (ret || !share->name) {
 			kill_share(share);
 			share = NULL;
@@ -11,6 +11,8 @@
 #include <linux/path.h>
 #include <linux/unicode.h>
 
+#include "../ksmbd_sched.h"
+
 struct ksmbd_share_config {
 	char			*name;
 	char			*path;
@@ -29,6 +31,13 @@ struct ksmbd_share_config {
 	unsigned short		force_directory_mode;
 	unsigned short		force_uid;
 	unsigned short		force_gid;
+
+	/* QoS of the request scheduler, zero limits are unlimited */
+	unsigned int		max_iops;
+	/* in bytes per second */
+	u64			max_bandwidth;
+	unsigned int		sched_weight;
+	struct ksmbd_qos_bucket	qos;
 };
 
 #define KSMBD_SHARE_INVALID_UID	((__u16)-1)
@@ -9,6 +9,8 @@
 #include <linux/xattr.h>
 #include <linux/fs.h>
 #include <linux/unicode.h>
+#include <linux/slab.h>
+#include <linux/bitmap.h>
 
 #include "misc.h"
 #include "smb_common.h"
@@ -16,57 +18,243 @@
 #include "vfs.h"
 
 #include "mgmt/share_config.h"
+#include "mgmt/tree_connect.h"
+
+/* DOS wildcards, see MS-FSA 2.1.4.4 */
+#define DOS_STAR	'<'
+#define DOS_QM		'>'
+#define DOS_DOT		'"'
+
+static bool is_pattern_wildcard(char c)
+{
+	return c == '*' || c == '?' || c == DOS_STAR || c == DOS_QM ||
+		c == DOS_DOT;
+}
 
 /**
- * match_pattern() - compare a string with a pattern which might include
- * wildcard '*' and '?'
- * TODO : implement consideration about DOS_DOT, DOS_QM and DOS_STAR
+ * ksmbd_compile_pattern() - prepare a search pattern for repeated matching
+ * @pattern:	search pattern which might include '*', '?', '<', '>' and '"'
+ * @key:	wire form of the pattern to remember for ksmbd_pattern_same(),
+ *		or NULL
+ * @key_len:	length of @key in bytes
  *
- * @str:	string to compare with a pattern
- * @len:	string length
- * @pattern:	pattern string which might include wildcard '*' and '?'
+ * The pattern is lowercased once and classified so that the common forms
+ * ("*", "name", "prefix*" and "*suffix") match with a single comparison.
+ * Anything else is matched by walking the pattern as an NFA, which keeps
+ * the cost linear in the name length and handles the DOS wildcards.
+ * An empty pattern is treated as "*".
  *
- * Return:	0 if pattern matched with the string, otherwise non zero value
+ * Return:	compiled pattern or error pointer
  */
-int match_pattern(const char *str, size_t len, const char *pattern)
+struct ksmbd_pattern *ksmbd_compile_pattern(const char *pattern,
+					    const void *key, size_t key_len)
 {
-	const char *s = str;
-	const char *p = pattern;
-	bool star = false;
-
-	while (*s && len) {
-		switch (*p) {
-		case '?':
-			s++;
-			len--;
-			p++;
-			break;
-		case '*':
-			star = true;
-			str = s;
-			if (!*++p)
-				return true;
-			pattern = p;
-			break;
-		default:
-			if (tolower(*s) == tolower(*p)) {
-				s++;
-				len--;
-				p++;
-			} else {
-				if (!star)
-					return false;
-				str++;
-				s = str;
-				p = pattern;
+	struct ksmbd_pattern *pat;
+	size_t len = strlen(pattern), i, nr_wild = 0;
+
+	pat = kzalloc(sizeof(struct ksmbd_pattern), GFP_KERNEL);
+	if (!pat)
+		return ERR_PTR(-ENOMEM);
+
+	pat->pattern = kmalloc(2 * (len + 1), GFP_KERNEL);
+	if (!pat->pattern)
+		goto err_out;
+	pat->name = pat->pattern + len + 1;
+	memcpy(pat->name, pattern, len + 1);
+	for (i = 0; i < len; i++) {
+		pat->pattern[i] = tolower(pattern[i]);
+		if (is_pattern_wildcard(pattern[i]))
+			nr_wild++;
+	}
+	pat->pattern[len] = '\0';
+	pat->len = len;
+
+	if (key) {
+		pat->key = kmemdup(key, key_len, GFP_KERNEL);
+		if (!pat->key)
+			goto err_out;
+		pat->key_len = key_len;
+	}
+
+	pat->literal = pat->pattern;
+	pat->literal_len = len;
+	if (strspn(pat->pattern, "*") == len) {
+		pat->type = KSMBD_PATTERN_ANY;
+	} else if (!nr_wild) {
+		pat->type = KSMBD_PATTERN_LITERAL;
+	} else if (nr_wild == 1 && pat->pattern[len - 1] == '*') {
+		pat->type = KSMBD_PATTERN_PREFIX;
+		pat->literal_len--;
+	} else if (nr_wild == 1 && pat->pattern[0] == '*') {
+		pat->type = KSMBD_PATTERN_SUFFIX;
+		pat->literal++;
+		pat->literal_len--;
+	} else {
+		pat->type = KSMBD_PATTERN_GLOB;
+		pat->nr_longs = BITS_TO_LONGS(len + 1);
+		pat->states = kcalloc(pat->nr_longs * 2, sizeof(unsigned long),
+				      GFP_KERNEL);
+		if (!pat->states)
+			goto err_out;
+	}
+
+	return pat;
+
+err_out:
+	ksmbd_free_pattern(pat);
+	return ERR_PTR(-ENOMEM);
+}
+
+void ksmbd_free_pattern(struct ksmbd_pattern *pat)
+{
+	if (!pat)
+		return;
+
+	kfree(pat->states);
+	kfree(pat->key);
+	kfree(pat->pattern);
+	kfree(pat);
+}
+
+/**
+ * ksmbd_pattern_same() - check if a compiled pattern came from @key
+ * @pat:	compiled pattern, may be NULL
+ * @key:	wire form of a search pattern
+ * @key_len:	length of @key in bytes
+ *
+ * Return:	true if @pat can be reused for @key
+ */
+bool ksmbd_pattern_same(struct ksmbd_pattern *pat, const void *key,
+			size_t key_len)
+{
+	return pat && pat->key && pat->key_len == key_len &&
+		!memcmp(pat->key, key, key_len);
+}
+
+static bool pattern_eq(const char *lit, const char *str, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (lit[i] != tolower(str[i]))
+			return false;
+	return true;
+}
+
+/*
+ * Add state @p reached before name position @pos, following the moves
+ * that consume no character of the name.
+ */
+static void pattern_add_state(const struct ksmbd_pattern *pat,
+			      unsigned long *set, size_t p,
+			      const char *str, size_t pos, size_t len)
+{
+	char c;
+
+	for (; p < pat->len; p++) {
+		__set_bit(p, set);
+		c = pat->pattern[p];
+		if (c == '*' || c == DOS_STAR)
+			continue;
+		if (c == DOS_QM && (pos == len || str[pos] == '.'))
+			continue;
+		if (c == DOS_DOT && pos == len)
+			continue;
+		return;
+	}
+	__set_bit(pat->len, set);
+}
+
+static bool pattern_match_glob(const struct ksmbd_pattern *pat,
+			       const char *str, size_t len)
+{
+	unsigned long *cur = pat->states;
+	unsigned long *next = pat->states + pat->nr_longs;
+	size_t i, p, nbits = pat->len + 1;
+	long last_dot = -1;
+	char c;
+
+	for (i = 0; i < len; i++)
+		if (str[i] == '.')
+			last_dot = i;
+
+	bitmap_zero(cur, nbits);
+	pattern_add_state(pat, cur, 0, str, 0, len);
+
+	for (i = 0; i < len; i++) {
+		c = tolower(str[i]);
+		bitmap_zero(next, nbits);
+		for_each_set_bit(p, cur, pat->len) {
+			switch (pat->pattern[p]) {
+			case '*':
+				pattern_add_state(pat, next, p, str, i + 1,
+						  len);
+				break;
+			case DOS_STAR:
+				/* matches up to, not including, the last dot */
+				if (last_dot < 0 || (long)i < last_dot)
+					pattern_add_state(pat, next, p, str,
+							  i + 1, len);
+				break;
+			case '?':
+				pattern_add_state(pat, next, p + 1, str, i + 1,
+						  len);
+				break;
+			case DOS_QM:
+				if (c != '.')
+					pattern_add_state(pat, next, p + 1, str,
+							  i + 1, len);
+				break;
+			case DOS_DOT:
+				if (c == '.')
+					pattern_add_state(pat, next, p + 1, str,
+							  i + 1, len);
+				break;
+			default:
+				if (c == pat->pattern[p])
+					pattern_add_state(pat, next, p + 1, str,
+							  i + 1, len);
+				break;
 			}
-			break;
 		}
+		if (bitmap_empty(next, nbits))
+			return false;
+		swap(cur, next);
 	}
 
-	if (*p == '*')
-		++p;
-	return !*p;
+	return test_bit(pat->len, cur);
+}
+
+/**
+ * ksmbd_match_pattern() - compare a string with a compiled pattern
+ * @pat:	pattern from ksmbd_compile_pattern()
+ * @str:	string to compare with the pattern
+ * @len:	string length
+ *
+ * Matching is case insensitive. A pattern must not be used by two
+ * matches at the same time because it holds the NFA scratch state.
+ *
+ * Return:	true if the string matches the pattern
+ */
+bool ksmbd_match_pattern(const struct ksmbd_pattern *pat, const char *str,
+			 size_t len)
+{
+	switch (pat->type) {
+	case KSMBD_PATTERN_ANY:
+		return true;
+	case KSMBD_PATTERN_LITERAL:
+		return len == pat->literal_len &&
+			pattern_eq(pat->literal, str, len);
+	case KSMBD_PATTERN_PREFIX:
+		return len >= pat->literal_len &&
+			pattern_eq(pat->literal, str, pat->literal_len);
+	case KSMBD_PATTERN_SUFFIX:
+		return len >= pat->literal_len &&
+			pattern_eq(pat->literal, str + len - pat->literal_len,
+				   pat->literal_len);
+	default:
+		return pattern_match_glob(pat, str, len);
+	}
 }
 
 /*
@@ -154,47 +342,112 @@ out:
 /**
  * convert_to_nt_pathname() - extract and return windows path string
  *      whose share directory prefix was removed from file path
- * @share: ksmbd_share_config pointer
+ * @work: smb work
  * @path: path to report
  *
+ * The path is built in the scratch arena of @work when it fits, the caller
+ * releases it with ksmbd_scratch_free().
+ *
  * Return : windows path string or error
  */
-
-char *convert_to_nt_pathname(struct ksmbd_share_config *share,
-			     const struct path *path)
+char *convert_to_nt_pathname(struct ksmbd_work *work, const struct path *path)
 {
-	char *pathname, *ab_pathname, *nt_pathname;
+	struct ksmbd_share_config *share = work->tcon->share_conf;
+	char *pathname, *ab_pathname;
 	int share_path_len = share->path_sz;
+	size_t size, len;
 
-	pathname = kmalloc(PATH_MAX, GFP_KERNEL);
+	size = ksmbd_scratch_avail(work);
+	if (size < share_path_len + NAME_MAX)
+		size = PATH_MAX;
+again:
+	pathname = ksmbd_scratch_alloc(work, size);
 	if (!pathname)
-		return ERR_PTR(-EACCES);
+		return ERR_PTR(-ENOMEM);
 
-	ab_pathname = d_path(path, pathname, PATH_MAX);
+	ab_pathname = d_path(path, pathname, size);
 	if (IS_ERR(ab_pathname)) {
-		nt_pathname = ERR_PTR(-EACCES);
-		goto free_pathname;
+		ksmbd_scratch_free(work, pathname);
+		if (PTR_ERR(ab_pathname) == -ENAMETOOLONG && size < PATH_MAX) {
+			size = PATH_MAX;
+			goto again;
+		}
+		return ERR_PTR(-EACCES);
 	}
 
 	if (strncmp(ab_pathname, share->path, share_path_len)) {
-		nt_pathname = ERR_PTR(-EACCES);
-		goto free_pathname;
+		ksmbd_scratch_free(work, pathname);
+		return ERR_PTR(-EACCES);
+	}
+
+	/* d_path() builds the name at the end of the buffer */
+	ab_pathname += share_path_len;
+	if (*ab_pathname == '\0') {
+		strcpy(pathname, "/");
+	} else {
+		len = strlen(ab_pathname);
+		memmove(pathname, ab_pathname, len + 1);
 	}
 
-	nt_pathname = kzalloc(strlen(&ab_pathname[share_path_len]) + 2, GFP_KERNEL);
-	if (!nt_pathname) {
-		nt_pathname = ERR_PTR(-ENOMEM);
-		goto free_pathname;
+	ksmbd_conv_path_to_windows(pathname);
+	return pathname;
+}
+
+/**
+ * ksmbd_normalize_path() - normalize a path name in place
+ * @path:	path name, '\\' and '/' are both separators
+ *
+ * Separators are converted to '/', empty and "." components are dropped
+ * and ".." components remove the component before them. A leading
+ * separator is kept, a trailing one is dropped.
+ *
+ * Return:	0 on success, -EINVAL if ".." would leave the top directory
+ */
+int ksmbd_normalize_path(char *path)
+{
+	char *in = path, *out = path, *end = path + strlen(path);
+	char *name, *base;
+	size_t len;
+
+	if (*in == '/' || *in == '\\') {
+		*out++ = '/';
+		in++;
 	}
-	if (ab_pathname[share_path_len] == '\0')
-		strcpy(nt_pathname, "/");
-	strcat(nt_pathname, &ab_pathname[share_path_len]);
+	base = out;
+
+	while (in < end) {
+		name = in;
+		while (in < end && *in != '/' && *in != '\\')
+			in++;
+		len = in - name;
+		if (in < end)
+			in++;
+
+		if (!len || (len == 1 && name[0] == '.'))
+			continue;
+
+		if (len == 2 && name[0] == '.' && name[1] == '.') {
+			if (out == base)
+				return -EINVAL;
+			/* drop the last component and its separator */
+			out--;
+			while (out > base && out[-1] != '/')
+				out--;
+			continue;
+		}
 
-	ksmbd_conv_path_to_windows(nt_pathname);
+		memmove(out, name, len);
+		out += len;
+		*out++ = '/';
+	}
 
-free_pathname:
-	kfree(pathname);
-	return nt_pathname;
+	/* a lone separator names the top directory */
+	if (out > base)
+		out--;
+	else
+		out = path;
+	*out = '\0';
+	return 0;
 }
 
 int get_nlink(struct kstat *st)
@@ -284,7 +537,6 @@ char *ksmbd_extract_sharename(struct unicode_map *um, const char *treename)
  *
  * Return:	converted name on success, otherwise NULL
  */
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 6, 0)
 char *convert_to_unix_name(struct ksmbd_share_config *share, const char *name)
 {
 	int no_slash = 0, name_len, path_len;
@@ -308,113 +560,15 @@ char *convert_to_unix_name(struct ksmbd_share_config *share, const char *name)
 	memcpy(new_name + path_len + no_slash, name, name_len);
 	path_len += name_len + no_slash;
 	new_name[path_len] = 0x00;
-	return new_name;
-}
-#else
-static char *normalize_path(const char *path)
-{
-	size_t path_len, remain_path_len, out_path_len;
-	char *out_path, *out_next;
-	int i, pre_dotdot_cnt = 0, slash_cnt = 0;
-	bool is_last;
-
-	path_len = strlen(path);
-	remain_path_len = path_len;
-
-	out_path = kzalloc(path_len + 2, GFP_KERNEL);
-	if (!out_path)
-		return ERR_PTR(-ENOMEM);
-	out_path_len = 0;
-	out_next = out_path;
-
-	do {
-		const char *name = path + path_len - remain_path_len;
-		char *next = strchrnul(name, '/');
-		size_t name_len = next - name;
-
-		is_last = !next[0];
-		if (name_len == 2 && name[0] == '.' && name[1] == '.') {
-			pre_dotdot_cnt++;
-			/* handle the case that path ends with "/.." */
-			if (is_last)
-				goto follow_dotdot;
-		} else {
-			if (pre_dotdot_cnt) {
-follow_dotdot:
-				slash_cnt = 0;
-				for (i = out_path_len - 1; i >= 0; i--) {
-					if (out_path[i] == '/' &&
-					    ++slash_cnt == pre_dotdot_cnt + 1)
-						break;
-				}
-
-				if (i < 0 &&
-				    slash_cnt != pre_dotdot_cnt) {
-					kfree(out_path);
-					return ERR_PTR(-EINVAL);
-				}
-
-				out_next = &out_path[i+1];
-				*out_next = '\0';
-				out_path_len = i + 1;
-
-			}
-
-			if (name_len != 0 &&
-			    !(name_len == 1 && name[0] == '.') &&
-			    !(name_len == 2 && name[0] == '.' && name[1] == '.')) {
-				next[0] = '\0';
-				sprintf(out_next, "%s/", name);
-				out_next += name_len + 1;
-				out_path_len += name_len + 1;
-				if (!is_last)
-					next[0] = '/';
-			}
-			pre_dotdot_cnt = 0;
-		}
-
-		remain_path_len -= name_len + 1;
-	} while (!is_last);
-
-	if (out_path_len > 0)
-		out_path[out_path_len-1] = '\0';
-	return out_path;
-}
-
-char *convert_to_unix_name(struct ksmbd_share_config *share, const char *name)
-{
-	int no_slash = 0, name_len, path_len;
-	char *new_name, *norm_name;
-
-	if (name[0] == '/')
-		name++;
-
-	norm_name = normalize_path(name);
-	if (IS_ERR(norm_name))
-		return norm_name;
-
-	path_len = share->path_sz;
-	name_len = strlen(norm_name);
-	new_name = kmalloc(path_len + name_len + 2, GFP_KERNEL);
-	if (!new_name) {
-		kfree(norm_name);
-		return new_name;
-	}
-
-	memcpy(new_name, share->path, path_len);
-	if (new_name[path_len - 1] != '/') {
-		new_name[path_len] = '/';
-		no_slash = 1;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5, 6, 0)
+	/* there is no LOOKUP_BENEATH to keep ".." inside the share */
+	if (ksmbd_normalize_path(new_name + share->path_sz + no_slash)) {
+		kfree(new_name);
+		return ERR_PTR(-EINVAL);
 	}
-
-	memcpy(new_name + path_len + no_slash, norm_name, name_len);
-	path_len += name_len + no_slash;
-	new_name[path_len] = 0x00;
-	kfree(norm_name);
-
+#endif
 	return new_name;
 }
-#endif
 
 char *ksmbd_convert_dir_info_name(struct ksmbd_dir_info *d_info,
 				  const struct nls_table *local_nls,
@@ -11,11 +11,39 @@ struct nls_table;
 struct kstat;
 struct ksmbd_file;
 
-int match_pattern(const char *str, size_t len, const char *pattern);
+enum {
+	KSMBD_PATTERN_ANY = 0,	/* "*" */
+	KSMBD_PATTERN_LITERAL,	/* no wildcard */
+	KSMBD_PATTERN_PREFIX,	/* "name*" */
+	KSMBD_PATTERN_SUFFIX,	/* "*name" */
+	KSMBD_PATTERN_GLOB,
+};
+
+struct ksmbd_pattern {
+	int		type;
+	char		*pattern;	/* lowercased */
+	char		*name;		/* pattern as given */
+	size_t		len;
+	const char	*literal;	/* literal part of pattern */
+	size_t		literal_len;
+	void		*key;		/* pattern as received on the wire */
+	size_t		key_len;
+	unsigned long	*states;	/* NFA scratch of a GLOB pattern */
+	unsigned int	nr_longs;
+};
+
+struct ksmbd_pattern *ksmbd_compile_pattern(const char *pattern,
+					    const void *key, size_t key_len);
+void ksmbd_free_pattern(struct ksmbd_pattern *pat);
+bool ksmbd_pattern_same(struct ksmbd_pattern *pat, const void *key,
+			size_t key_len);
+bool ksmbd_match_pattern(const struct ksmbd_pattern *pat, const char *str,
+			 size_t len);
 int ksmbd_validate_filename(char *filename);
 int parse_stream_name(char *filename, char **stream_name, int *s_type);
-char *convert_to_nt_pathname(struct ksmbd_share_config *share,
-			     const struct path *path);
+struct ksmbd_work;
+char *convert_to_nt_pathname(struct ksmbd_work *work, const struct path *path);
+int ksmbd_normalize_path(char *path);
 int get_nlink(struct kstat *st);
 void ksmbd_conv_path_to_unix(char *path);
 void ksmbd_strip_last_slash(char *path);
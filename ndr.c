@@ -14,97 +14,131 @@ static inline char *ndr_get_field(struct ndr *n)
 	return n->data + n->offset;
 }
 
-static int try_to_realloc_ndr_blob(struct ndr *n, size_t sz)
+/*
+ * Make room for @sz bytes at the current offset. An ndr without data is
+ * in its sizing pass and only counts the bytes that would be written.
+ */
+static int ndr_reserve(struct ndr *n, size_t sz)
 {
-	char *data;
+	if (n->data && n->offset + sz > n->length)
+		return -ENOSPC;
+	return 0;
+}
 
-	data = krealloc(n->data, n->offset + sz + 1024, GFP_KERNEL);
-	if (!data)
-		return -ENOMEM;
+static int ndr_align(struct ndr *n, int align)
+{
+	int pad = ALIGN(n->offset, align) - n->offset;
+	int ret;
+
+	ret = ndr_reserve(n, pad);
+	if (ret)
+		return ret;
 
-	n->data = data;
-	n->length += 1024;
-	memset(n->data + n->offset, 0, 1024);
+	if (n->data)
+		memset(ndr_get_field(n), 0, pad);
+	n->offset += pad;
 	return 0;
 }
 
 static int ndr_write_int16(struct ndr *n, __u16 value)
 {
-	if (n->length <= n->offset + sizeof(value)) {
-		int ret;
+	int ret;
 
-		ret = try_to_realloc_ndr_blob(n, sizeof(value));
-		if (ret)
-			return ret;
-	}
+	ret = ndr_reserve(n, sizeof(value));
+	if (ret)
+		return ret;
 
-	*(__le16 *)ndr_get_field(n) = cpu_to_le16(value);
+	if (n->data)
+		*(__le16 *)ndr_get_field(n) = cpu_to_le16(value);
 	n->offset += sizeof(value);
 	return 0;
 }
 
 static int ndr_write_int32(struct ndr *n, __u32 value)
 {
-	if (n->length <= n->offset + sizeof(value)) {
-		int ret;
+	int ret;
 
-		ret = try_to_realloc_ndr_blob(n, sizeof(value));
-		if (ret)
-			return ret;
-	}
+	ret = ndr_reserve(n, sizeof(value));
+	if (ret)
+		return ret;
 
-	*(__le32 *)ndr_get_field(n) = cpu_to_le32(value);
+	if (n->data)
+		*(__le32 *)ndr_get_field(n) = cpu_to_le32(value);
 	n->offset += sizeof(value);
 	return 0;
 }
 
 static int ndr_write_int64(struct ndr *n, __u64 value)
 {
-	if (n->length <= n->offset + sizeof(value)) {
-		int ret;
+	int ret;
 
-		ret = try_to_realloc_ndr_blob(n, sizeof(value));
-		if (ret)
-			return ret;
-	}
+	ret = ndr_reserve(n, sizeof(value));
+	if (ret)
+		return ret;
 
-	*(__le64 *)ndr_get_field(n) = cpu_to_le64(value);
+	if (n->data)
+		*(__le64 *)ndr_get_field(n) = cpu_to_le64(value);
 	n->offset += sizeof(value);
 	return 0;
 }
 
-static int ndr_write_bytes(struct ndr *n, void *value, size_t sz)
+static int ndr_write_bytes(struct ndr *n, const void *value, size_t sz)
 {
-	if (n->length <= n->offset + sz) {
-		int ret;
+	int ret;
 
-		ret = try_to_realloc_ndr_blob(n, sz);
-		if (ret)
-			return ret;
-	}
+	ret = ndr_reserve(n, sz);
+	if (ret)
+		return ret;
 
-	memcpy(ndr_get_field(n), value, sz);
+	if (n->data)
+		memcpy(ndr_get_field(n), value, sz);
 	n->offset += sz;
 	return 0;
 }
 
-static int ndr_write_string(struct ndr *n, char *value)
+static int ndr_write_string(struct ndr *n, const char *value)
 {
 	size_t sz;
+	int ret;
 
 	sz = strlen(value) + 1;
-	if (n->length <= n->offset + sz) {
-		int ret;
+	ret = ndr_write_bytes(n, value, sz);
+	if (ret)
+		return ret;
+
+	return ndr_align(n, 2);
+}
 
-		ret = try_to_realloc_ndr_blob(n, sz);
+/*
+ * Run @fn over @n. Unless the caller supplied a buffer with ndr_init(),
+ * a sizing pass runs first and the blob is allocated with its exact size.
+ */
+static int ndr_encode(struct ndr *n, int (*fn)(struct ndr *, const void *),
+		      const void *arg)
+{
+	bool alloc = !n->data;
+	int ret;
+
+	if (alloc) {
+		n->offset = 0;
+		n->length = 0;
+		ret = fn(n, arg);
 		if (ret)
 			return ret;
+
+		n->length = n->offset;
+		n->data = kmalloc(n->length, GFP_KERNEL);
+		if (!n->data)
+			return -ENOMEM;
 	}
 
-	memcpy(ndr_get_field(n), value, sz);
-	n->offset += sz;
-	n->offset = ALIGN(n->offset, 2);
-	return 0;
+	n->offset = 0;
+	ret = fn(n, arg);
+	if (ret && alloc) {
+		kfree(n->data);
+		n->data = NULL;
+	}
+	return ret;
 }
 
 static int ndr_read_string(struct ndr *n, void *value, size_t sz)
@@ -167,17 +201,12 @@ static int ndr_read_int64(struct ndr *n, __u64 *value)
 	return 0;
 }
 
-int ndr_encode_dos_attr(struct ndr *n, struct xattr_dos_attrib *da)
+static int __ndr_encode_dos_attr(struct ndr *n, const void *arg)
 {
+	const struct xattr_dos_attrib *da = arg;
 	char hex_attr[12] = {0};
 	int ret;
 
-	n->offset = 0;
-	n->length = 1024;
-	n->data = kzalloc(n->length, GFP_KERNEL);
-	if (!n->data)
-		return -ENOMEM;
-
 	if (da->version == 3) {
 		snprintf(hex_attr, 10, "0x%x", da->attr);
 		ret = ndr_write_string(n, hex_attr);
@@ -226,13 +255,25 @@ int ndr_encode_dos_attr(struct ndr *n, struct xattr_dos_attrib *da)
 	return ret;
 }
 
+/**
+ * ndr_encode_dos_attr() - encode dos attributes
+ * @n:		ndr blob to fill, zeroed or set up with ndr_init()
+ * @da:		dos attributes
+ *
+ * Return:	0 on success, -ENOSPC if the buffer given to ndr_init() is
+ *		too small, otherwise error
+ */
+int ndr_encode_dos_attr(struct ndr *n, struct xattr_dos_attrib *da)
+{
+	return ndr_encode(n, __ndr_encode_dos_attr, da);
+}
+
 int ndr_decode_dos_attr(struct ndr *n, struct xattr_dos_attrib *da)
 {
-	char hex_attr[12];
 	unsigned int version2, ret;
 
 	n->offset = 0;
-	ret = ndr_read_string(n, hex_attr, sizeof(hex_attr));
+	ret = ndr_read_string(n, NULL, 12);
 	if (ret)
 		return ret;
 
@@ -292,7 +333,8 @@ int ndr_decode_dos_attr(struct ndr *n, struct xattr_dos_attrib *da)
 	return ret;
 }
 
-static int ndr_encode_posix_acl_entry(struct ndr *n, struct xattr_smb_acl *acl)
+static int ndr_encode_posix_acl_entry(struct ndr *n,
+				      const struct xattr_smb_acl *acl)
 {
 	int i, ret;
 
@@ -300,7 +342,10 @@ static int ndr_encode_posix_acl_entry(struct ndr *n, struct xattr_smb_acl *acl)
 	if (ret)
 		return ret;
 
-	n->offset = ALIGN(n->offset, 8);
+	ret = ndr_align(n, 8);
+	if (ret)
+		return ret;
+
 	ret = ndr_write_int32(n, acl->count);
 	if (ret)
 		return ret;
@@ -310,7 +355,10 @@ static int ndr_encode_posix_acl_entry(struct ndr *n, struct xattr_smb_acl *acl)
 		return ret;
 
 	for (i = 0; i < acl->count; i++) {
-		n->offset = ALIGN(n->offset, 8);
+		ret = ndr_align(n, 8);
+		if (ret)
+			return ret;
+
 		ret = ndr_write_int16(n, acl->entries[i].type);
 		if (ret)
 			return ret;
@@ -320,11 +368,13 @@ static int ndr_encode_posix_acl_entry(struct ndr *n, struct xattr_smb_acl *acl)
 			return ret;
 
 		if (acl->entries[i].type == SMB_ACL_USER) {
-			n->offset = ALIGN(n->offset, 8);
-			ret = ndr_write_int64(n, acl->entries[i].uid);
+			ret = ndr_align(n, 8);
+			if (!ret)
+				ret = ndr_write_int64(n, acl->entries[i].uid);
 		} else if (acl->entries[i].type == SMB_ACL_GROUP) {
-			n->offset = ALIGN(n->offset, 8);
-			ret = ndr_write_int64(n, acl->entries[i].gid);
+			ret = ndr_align(n, 8);
+			if (!ret)
+				ret = ndr_write_int64(n, acl->entries[i].gid);
 		}
 		if (ret)
 			return ret;
@@ -336,12 +386,20 @@ static int ndr_encode_posix_acl_entry(struct ndr *n, struct xattr_smb_acl *acl)
 	return ret;
 }
 
-int ndr_encode_posix_acl(struct ndr *n,
-			 struct user_namespace *user_ns,
-			 struct inode *inode,
-			 struct xattr_smb_acl *acl,
-			 struct xattr_smb_acl *def_acl)
+struct ndr_posix_acl_args {
+	struct user_namespace	*user_ns;
+	struct inode		*inode;
+	struct xattr_smb_acl	*acl;
+	struct xattr_smb_acl	*def_acl;
+};
+
+static int __ndr_encode_posix_acl(struct ndr *n, const void *arg)
 {
+	const struct ndr_posix_acl_args *args = arg;
+	struct user_namespace *user_ns = args->user_ns;
+	struct inode *inode = args->inode;
+	struct xattr_smb_acl *acl = args->acl;
+	struct xattr_smb_acl *def_acl = args->def_acl;
 	unsigned int ref_id = 0x00020000;
 	int ret;
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 0, 0)
@@ -349,12 +407,6 @@ int ndr_encode_posix_acl(struct ndr *n,
 	vfsgid_t vfsgid;
 #endif
 
-	n->offset = 0;
-	n->length = 1024;
-	n->data = kzalloc(n->length, GFP_KERNEL);
-	if (!n->data)
-		return -ENOMEM;
-
 	if (acl) {
 		/* ACL ACCESS */
 		ret = ndr_write_int32(n, ref_id);
@@ -414,17 +466,28 @@ int ndr_encode_posix_acl(struct ndr *n,
 	return ret;
 }
 
-int ndr_encode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl)
+int ndr_encode_posix_acl(struct ndr *n,
+			 struct user_namespace *user_ns,
+			 struct inode *inode,
+			 struct xattr_smb_acl *acl,
+			 struct xattr_smb_acl *def_acl)
+{
+	struct ndr_posix_acl_args args = {
+		.user_ns	= user_ns,
+		.inode		= inode,
+		.acl		= acl,
+		.def_acl	= def_acl,
+	};
+
+	return ndr_encode(n, __ndr_encode_posix_acl, &args);
+}
+
+static int __ndr_encode_v4_ntacl(struct ndr *n, const void *arg)
 {
+	const struct xattr_ntacl *acl = arg;
 	unsigned int ref_id = 0x00020004;
 	int ret;
 
-	n->offset = 0;
-	n->length = 2048;
-	n->data = kzalloc(n->length, GFP_KERNEL);
-	if (!n->data)
-		return -ENOMEM;
-
 	ret = ndr_write_int16(n, acl->version);
 	if (ret)
 		return ret;
@@ -467,6 +530,11 @@ int ndr_encode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl)
 	return ret;
 }
 
+int ndr_encode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl)
+{
+	return ndr_encode(n, __ndr_encode_v4_ntacl, acl);
+}
+
 int ndr_decode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl)
 {
 	unsigned int version2;
@@ -508,7 +576,9 @@ int ndr_decode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl)
 	if (ret)
 		return ret;
 
-	ndr_read_bytes(n, acl->desc, 10);
+	ret = ndr_read_bytes(n, acl->desc, 10);
+	if (ret)
+		return ret;
 	if (strncmp(acl->desc, "posix_acl", 9)) {
 		pr_err("Invalid acl description : %s\n", acl->desc);
 		return -EINVAL;
@@ -524,11 +594,118 @@ int ndr_decode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl)
 	if (ret)
 		return ret;
 
+	/* the security descriptor is returned as a view into @n */
 	acl->sd_size = n->length - n->offset;
-	acl->sd_buf = kzalloc(acl->sd_size, GFP_KERNEL);
-	if (!acl->sd_buf)
-		return -ENOMEM;
+	acl->sd_buf = ndr_get_field(n);
+	n->offset = n->length;
+	return 0;
+}
 
-	ret = ndr_read_bytes(n, acl->sd_buf, acl->sd_size);
+static int __ndr_encode_meta(struct ndr *n, const void *arg)
+{
+	struct ndr * const *parts = arg;
+	const struct ndr *dos = parts[0], *acl = parts[1];
+	__u16 flags = 0;
+	int dos_len = dos->data ? dos->offset : 0;
+	int acl_len = acl->data ? acl->offset : 0;
+	int ret;
+
+	if (dos_len)
+		flags |= XATTR_META_DOSINFO;
+	if (acl_len)
+		flags |= XATTR_META_NTACL;
+
+	ret = ndr_write_int16(n, XATTR_META_VERSION);
+	if (ret)
+		return ret;
+
+	ret = ndr_write_int16(n, flags);
+	if (ret)
+		return ret;
+
+	ret = ndr_write_int32(n, dos_len);
+	if (!ret && dos_len)
+		ret = ndr_write_bytes(n, dos->data, dos_len);
+	if (ret)
+		return ret;
+
+	ret = ndr_write_int32(n, acl_len);
+	if (!ret && acl_len)
+		ret = ndr_write_bytes(n, acl->data, acl_len);
 	return ret;
 }
+
+/**
+ * ndr_encode_meta() - encode the consolidated metadata xattr
+ * @n:		ndr blob to fill, zeroed or set up with ndr_init()
+ * @dos:	encoded dos attributes, or a blob without data if absent
+ * @acl:	encoded v4 ntacl, or a blob without data if absent
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ndr_encode_meta(struct ndr *n, struct ndr *dos, struct ndr *acl)
+{
+	struct ndr *parts[2] = { dos, acl };
+
+	return ndr_encode(n, __ndr_encode_meta, parts);
+}
+
+/**
+ * ndr_decode_meta() - split the consolidated metadata xattr
+ * @n:		ndr blob read from the xattr
+ * @dos:	set to the encoded dos attributes inside @n, if present
+ * @acl:	set to the encoded v4 ntacl inside @n, if present
+ *
+ * @dos and @acl point into the data of @n and must not be freed.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ndr_decode_meta(struct ndr *n, struct ndr *dos, struct ndr *acl)
+{
+	__u16 version, flags;
+	__u32 len;
+	int ret;
+
+	memset(dos, 0, sizeof(*dos));
+	memset(acl, 0, sizeof(*acl));
+
+	n->offset = 0;
+	ret = ndr_read_int16(n, &version);
+	if (ret)
+		return ret;
+	if (version != XATTR_META_VERSION) {
+		ksmbd_debug(VFS, "v%d meta version is not supported\n", version);
+		return -EINVAL;
+	}
+
+	ret = ndr_read_int16(n, &flags);
+	if (ret)
+		return ret;
+
+	ret = ndr_read_int32(n, &len);
+	if (ret)
+		return ret;
+	if (len > n->length - n->offset)
+		return -EINVAL;
+	if (flags & XATTR_META_DOSINFO && len) {
+		dos->data = ndr_get_field(n);
+		dos->length = len;
+	}
+	n->offset += len;
+
+	ret = ndr_read_int32(n, &len);
+	if (ret)
+		return ret;
+	if (len > n->length - n->offset)
+		return -EINVAL;
+	if (flags & XATTR_META_NTACL && len) {
+		acl->data = ndr_get_field(n);
+		acl->length = len;
+	}
+	n->offset += len;
+	return 0;
+}
+
+#ifdef CONFIG_KSMBD_KUNIT_TEST
+#include "ndr_test.c"
+#endif
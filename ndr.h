@@ -4,6 +4,14 @@
  *   Author(s): Namjae Jeon <linkinjeon@kernel.org>
  */
 
+#ifndef __KSMBD_NDR_H__
+#define __KSMBD_NDR_H__
+
+/*
+ * An encoder given a zeroed ndr allocates a blob of the exact size, which
+ * the caller frees. ndr_init() makes it encode into the caller's buffer
+ * instead. Decoders return views into the blob they are given.
+ */
 struct ndr {
 	char	*data;
 	int	offset;
@@ -12,6 +20,16 @@ struct ndr {
 
 #define NDR_NTSD_OFFSETOF	0xA0
 
+/* Upper bound of an encoded DOSATTRIB blob */
+#define NDR_DOS_ATTR_MAX_SIZE	64
+
+static inline void ndr_init(struct ndr *n, void *buf, int size)
+{
+	n->data = buf;
+	n->offset = 0;
+	n->length = size;
+}
+
 int ndr_encode_dos_attr(struct ndr *n, struct xattr_dos_attrib *da);
 int ndr_decode_dos_attr(struct ndr *n, struct xattr_dos_attrib *da);
 int ndr_encode_posix_acl(struct ndr *n, struct user_namespace *user_ns,
@@ -20,3 +38,7 @@ int ndr_encode_posix_acl(struct ndr *n, struct user_namespace *user_ns,
 int ndr_encode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl);
 int ndr_encode_v3_ntacl(struct ndr *n, struct xattr_ntacl *acl);
 int ndr_decode_v4_ntacl(struct ndr *n, struct xattr_ntacl *acl);
+int ndr_encode_meta(struct ndr *n, struct ndr *dos, struct ndr *acl);
+int ndr_decode_meta(struct ndr *n, struct ndr *dos, struct ndr *acl);
+
+#endif /* __KSMBD_NDR_H__ */
@@ -0,0 +1,386 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ *   KUnit tests of the ndr encoders and decoders
+ *
+ *   Included from ndr.c. The expected blobs are the output of the
+ *   encoders before they were made to size their blobs exactly. Stored
+ *   posix acl hashes and NT ACL xattrs depend on it staying the same.
+ */
+
+#include <kunit/test.h>
+
+static const u8 ndr_test_dos_v3_blob[] = {
+	0x30, 0x78, 0x32, 0x30, 0x00, 0x00, 0x03, 0x00,
+	0x03, 0x00, 0x00, 0x00, 0x3f, 0x00, 0x00, 0x00,
+	0x20, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+	0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x00, 0x20, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xbc, 0x9a, 0x78, 0x56, 0x34, 0x12, 0xd7, 0x01,
+	0x54, 0x76, 0x98, 0xba, 0xdc, 0xfe, 0xd7, 0x01,
+};
+
+static const u8 ndr_test_dos_v4_blob[] = {
+	0x00, 0x00, 0x04, 0x00, 0x04, 0x00, 0x00, 0x00,
+	0x51, 0x00, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00,
+	0x88, 0x77, 0x66, 0x55, 0x44, 0x33, 0x22, 0x11,
+	0xbc, 0x9a, 0x78, 0x56, 0x34, 0x12, 0xd8, 0x01,
+};
+
+static const u8 ndr_test_posix_acl_blob[] = {
+	0x00, 0x00, 0x02, 0x00, 0x04, 0x00, 0x02, 0x00,
+	0xe8, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x64, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xed, 0x41, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00,
+	0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x02, 0x00, 0x02, 0x00, 0x06, 0x00, 0x00, 0x00,
+	0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xe9, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x04, 0x00, 0x04, 0x00, 0x04, 0x00, 0x00, 0x00,
+	0x03, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0xea, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x06, 0x00, 0x06, 0x00, 0x06, 0x00, 0x00, 0x00,
+	0x05, 0x00, 0x05, 0x00, 0x04, 0x00, 0x00, 0x00,
+	0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+	0x02, 0x00, 0x02, 0x00, 0x07, 0x00, 0x00, 0x00,
+	0x04, 0x00, 0x04, 0x00, 0x05, 0x00, 0x00, 0x00,
+	0x05, 0x00, 0x05, 0x00, 0x05, 0x00, 0x00, 0x00,
+};
+
+static const u8 ndr_test_v4_ntacl_blob[] = {
+	0x04, 0x00, 0x04, 0x00, 0x00, 0x00, 0x02, 0x00,
+	0x04, 0x00, 0x02, 0x00, 0x01, 0x00, 0x00, 0x01,
+	0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09,
+	0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11,
+	0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19,
+	0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21,
+	0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29,
+	0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31,
+	0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39,
+	0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x70, 0x6f,
+	0x73, 0x69, 0x78, 0x5f, 0x61, 0x63, 0x6c, 0x00,
+	0x08, 0x07, 0x06, 0x05, 0x04, 0x03, 0x02, 0x01,
+	0xff, 0xfe, 0xfd, 0xfc, 0xfb, 0xfa, 0xf9, 0xf8,
+	0xf7, 0xf6, 0xf5, 0xf4, 0xf3, 0xf2, 0xf1, 0xf0,
+	0xef, 0xee, 0xed, 0xec, 0xeb, 0xea, 0xe9, 0xe8,
+	0xe7, 0xe6, 0xe5, 0xe4, 0xe3, 0xe2, 0xe1, 0xe0,
+	0xdf, 0xde, 0xdd, 0xdc, 0xdb, 0xda, 0xd9, 0xd8,
+	0xd7, 0xd6, 0xd5, 0xd4, 0xd3, 0xd2, 0xd1, 0xd0,
+	0xcf, 0xce, 0xcd, 0xcc, 0xcb, 0xca, 0xc9, 0xc8,
+	0xc7, 0xc6, 0xc5, 0xc4, 0xc3, 0xc2, 0xc1, 0xc0,
+	0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7,
+	0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf,
+	0xb0, 0xb1, 0xb2, 0xb3,
+};
+
+
+static void ndr_test_fill_dos_v3(struct xattr_dos_attrib *da)
+{
+	memset(da, 0, sizeof(*da));
+	da->version = 3;
+	da->flags = 0x3f;
+	da->attr = 0x20;
+	da->ea_size = 0x10;
+	da->size = 0x1000;
+	da->alloc_size = 0x2000;
+	da->create_time = 0x01d7123456789abcULL;
+	da->change_time = 0x01d7fedcba987654ULL;
+}
+
+static void ndr_test_fill_dos_v4(struct xattr_dos_attrib *da)
+{
+	memset(da, 0, sizeof(*da));
+	da->version = 4;
+	da->flags = 0x51;
+	da->attr = 0x10;
+	da->itime = 0x1122334455667788ULL;
+	da->create_time = 0x01d8123456789abcULL;
+}
+
+static u8 ndr_test_sd[20];
+
+static void ndr_test_fill_v4_ntacl(struct xattr_ntacl *acl)
+{
+	int i;
+
+	memset(acl, 0, sizeof(*acl));
+	acl->version = 4;
+	acl->hash_type = XATTR_SD_HASH_TYPE_SHA256;
+	for (i = 0; i < XATTR_SD_HASH_SIZE; i++) {
+		acl->hash[i] = i;
+		acl->posix_acl_hash[i] = 0xff - i;
+	}
+	memcpy(acl->desc, "posix_acl", 10);
+	acl->desc_len = 10;
+	acl->current_time = 0x0102030405060708ULL;
+	for (i = 0; i < sizeof(ndr_test_sd); i++)
+		ndr_test_sd[i] = 0xa0 + i;
+	acl->sd_buf = ndr_test_sd;
+	acl->sd_size = sizeof(ndr_test_sd);
+}
+
+static void ndr_test_expect_blob(struct kunit *test, struct ndr *n,
+				 const u8 *expected, int size)
+{
+	KUNIT_ASSERT_EQ(test, n->offset, size);
+	KUNIT_EXPECT_EQ(test, memcmp(n->data, expected, size), 0);
+}
+
+static void ndr_test_dos_attr(struct kunit *test,
+			      void (*fill)(struct xattr_dos_attrib *),
+			      const u8 *expected, int size)
+{
+	struct xattr_dos_attrib da, out;
+	struct ndr n = {0};
+
+	fill(&da);
+	KUNIT_ASSERT_EQ(test, ndr_encode_dos_attr(&n, &da), 0);
+	KUNIT_EXPECT_EQ(test, n.length, size);
+	ndr_test_expect_blob(test, &n, expected, size);
+
+	memset(&out, 0, sizeof(out));
+	KUNIT_EXPECT_EQ(test, ndr_decode_dos_attr(&n, &out), 0);
+	KUNIT_EXPECT_EQ(test, out.version, da.version);
+	KUNIT_EXPECT_EQ(test, out.attr, da.attr);
+	KUNIT_EXPECT_EQ(test, out.create_time, da.create_time);
+	if (da.version == 4)
+		KUNIT_EXPECT_EQ(test, out.itime, da.itime);
+	kfree(n.data);
+}
+
+static void ndr_test_dos_attr_v3(struct kunit *test)
+{
+	ndr_test_dos_attr(test, ndr_test_fill_dos_v3, ndr_test_dos_v3_blob,
+			  sizeof(ndr_test_dos_v3_blob));
+}
+
+static void ndr_test_dos_attr_v4(struct kunit *test)
+{
+	ndr_test_dos_attr(test, ndr_test_fill_dos_v4, ndr_test_dos_v4_blob,
+			  sizeof(ndr_test_dos_v4_blob));
+}
+
+/* Encoding into a caller buffer gives the same bytes as allocating */
+static void ndr_test_dos_attr_init(struct kunit *test)
+{
+	struct xattr_dos_attrib da;
+	char buf[NDR_DOS_ATTR_MAX_SIZE];
+	struct ndr n;
+
+	ndr_test_fill_dos_v3(&da);
+	memset(buf, 0xcc, sizeof(buf));
+	ndr_init(&n, buf, sizeof(buf));
+	KUNIT_ASSERT_EQ(test, ndr_encode_dos_attr(&n, &da), 0);
+	ndr_test_expect_blob(test, &n, ndr_test_dos_v3_blob,
+			     sizeof(ndr_test_dos_v3_blob));
+
+	ndr_test_fill_dos_v4(&da);
+	memset(buf, 0xcc, sizeof(buf));
+	ndr_init(&n, buf, sizeof(buf));
+	KUNIT_ASSERT_EQ(test, ndr_encode_dos_attr(&n, &da), 0);
+	ndr_test_expect_blob(test, &n, ndr_test_dos_v4_blob,
+			     sizeof(ndr_test_dos_v4_blob));
+}
+
+static void ndr_test_posix_acl(struct kunit *test)
+{
+	static const struct xattr_acl_entry entries[] = {
+		{ .type = SMB_ACL_USER_OBJ,	.perm = 6 },
+		{ .type = SMB_ACL_USER,		.uid = 1001,	.perm = 4 },
+		{ .type = SMB_ACL_GROUP_OBJ,	.perm = 4 },
+		{ .type = SMB_ACL_GROUP,	.gid = 1002,	.perm = 6 },
+		{ .type = SMB_ACL_MASK,		.perm = 6 },
+		{ .type = SMB_ACL_OTHER,	.perm = 4 },
+	};
+	static const struct xattr_acl_entry def_entries[] = {
+		{ .type = SMB_ACL_USER_OBJ,	.perm = 7 },
+		{ .type = SMB_ACL_GROUP_OBJ,	.perm = 5 },
+		{ .type = SMB_ACL_OTHER,	.perm = 5 },
+	};
+	struct xattr_smb_acl *acl, *def_acl;
+	struct super_block *sb;
+	struct inode *inode;
+	struct ndr n = {0};
+	char buf[64];
+
+	sb = kunit_kzalloc(test, sizeof(*sb), GFP_KERNEL);
+	inode = kunit_kzalloc(test, sizeof(*inode), GFP_KERNEL);
+	acl = kunit_kzalloc(test, sizeof(*acl) + sizeof(entries), GFP_KERNEL);
+	def_acl = kunit_kzalloc(test, sizeof(*def_acl) + sizeof(def_entries),
+				GFP_KERNEL);
+	KUNIT_ASSERT_TRUE(test, sb && inode && acl && def_acl);
+
+	sb->s_user_ns = &init_user_ns;
+	inode->i_sb = sb;
+	inode->i_uid = KUIDT_INIT(1000);
+	inode->i_gid = KGIDT_INIT(100);
+	inode->i_mode = S_IFDIR | 0755;
+	acl->count = ARRAY_SIZE(entries);
+	memcpy(acl->entries, entries, sizeof(entries));
+	def_acl->count = ARRAY_SIZE(def_entries);
+	memcpy(def_acl->entries, def_entries, sizeof(def_entries));
+
+	KUNIT_ASSERT_EQ(test, ndr_encode_posix_acl(&n, &init_user_ns, inode,
+						   acl, def_acl), 0);
+	KUNIT_EXPECT_EQ(test, n.length, (int)sizeof(ndr_test_posix_acl_blob));
+	ndr_test_expect_blob(test, &n, ndr_test_posix_acl_blob,
+			     sizeof(ndr_test_posix_acl_blob));
+	kfree(n.data);
+
+	ndr_init(&n, buf, sizeof(buf));
+	KUNIT_EXPECT_EQ(test, ndr_encode_posix_acl(&n, &init_user_ns, inode,
+						   acl, def_acl), -ENOSPC);
+}
+
+static void ndr_test_v4_ntacl(struct kunit *test)
+{
+	struct xattr_ntacl acl, out;
+	struct ndr n = {0};
+
+	ndr_test_fill_v4_ntacl(&acl);
+	KUNIT_ASSERT_EQ(test, ndr_encode_v4_ntacl(&n, &acl), 0);
+	KUNIT_EXPECT_EQ(test, n.length, (int)sizeof(ndr_test_v4_ntacl_blob));
+	ndr_test_expect_blob(test, &n, ndr_test_v4_ntacl_blob,
+			     sizeof(ndr_test_v4_ntacl_blob));
+
+	memset(&out, 0, sizeof(out));
+	KUNIT_ASSERT_EQ(test, ndr_decode_v4_ntacl(&n, &out), 0);
+	KUNIT_EXPECT_EQ(test, out.version, acl.version);
+	KUNIT_EXPECT_EQ(test, out.hash_type, acl.hash_type);
+	KUNIT_EXPECT_EQ(test, memcmp(out.hash, acl.hash, XATTR_SD_HASH_SIZE), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out.desc, acl.desc, 10), 0);
+	KUNIT_EXPECT_EQ(test, memcmp(out.posix_acl_hash, acl.posix_acl_hash,
+				     XATTR_SD_HASH_SIZE), 0);
+	KUNIT_ASSERT_EQ(test, out.sd_size, acl.sd_size);
+	KUNIT_EXPECT_EQ(test, memcmp(out.sd_buf, acl.sd_buf, acl.sd_size), 0);
+	/* the descriptor is a view into the blob */
+	KUNIT_EXPECT_PTR_EQ(test, out.sd_buf,
+			    (void *)(n.data + n.length - acl.sd_size));
+	kfree(n.data);
+}
+
+/* A caller buffer one byte short fails without writing past it */
+static void ndr_test_encode_nospc(struct kunit *test)
+{
+	struct xattr_dos_attrib da;
+	struct xattr_ntacl acl;
+	int size = sizeof(ndr_test_v4_ntacl_blob);
+	char *buf;
+	struct ndr n;
+
+	buf = kunit_kzalloc(test, size, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	ndr_test_fill_dos_v3(&da);
+	ndr_init(&n, buf, sizeof(ndr_test_dos_v3_blob) - 1);
+	KUNIT_EXPECT_EQ(test, ndr_encode_dos_attr(&n, &da), -ENOSPC);
+
+	ndr_test_fill_v4_ntacl(&acl);
+	memset(buf, 0xcc, size);
+	ndr_init(&n, buf, size - 1);
+	KUNIT_EXPECT_EQ(test, ndr_encode_v4_ntacl(&n, &acl), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, (int)(u8)buf[size - 1], 0xcc);
+
+	ndr_init(&n, buf, size);
+	KUNIT_EXPECT_EQ(test, ndr_encode_v4_ntacl(&n, &acl), 0);
+	ndr_test_expect_blob(test, &n, ndr_test_v4_ntacl_blob, size);
+}
+
+/* Every truncation of a blob is rejected by its decoder */
+static void ndr_test_decode_short(struct kunit *test)
+{
+	struct xattr_dos_attrib da;
+	struct xattr_ntacl acl;
+	/* everything before the security descriptor */
+	int ntacl_hdr = NDR_NTSD_OFFSETOF;
+	struct ndr n;
+	char *buf;
+	int len;
+
+	buf = kunit_kzalloc(test, sizeof(ndr_test_v4_ntacl_blob), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, buf);
+
+	for (len = 0; len < sizeof(ndr_test_dos_v3_blob); len++) {
+		memcpy(buf, ndr_test_dos_v3_blob, len);
+		ndr_init(&n, buf, len);
+		KUNIT_EXPECT_EQ(test, ndr_decode_dos_attr(&n, &da), -EINVAL);
+	}
+
+	for (len = 0; len < sizeof(ndr_test_dos_v4_blob); len++) {
+		memcpy(buf, ndr_test_dos_v4_blob, len);
+		ndr_init(&n, buf, len);
+		KUNIT_EXPECT_EQ(test, ndr_decode_dos_attr(&n, &da), -EINVAL);
+	}
+
+	for (len = 0; len < ntacl_hdr; len++) {
+		memcpy(buf, ndr_test_v4_ntacl_blob, len);
+		ndr_init(&n, buf, len);
+		KUNIT_EXPECT_EQ(test, ndr_decode_v4_ntacl(&n, &acl), -EINVAL);
+	}
+
+	/* a header alone decodes to an empty descriptor */
+	memcpy(buf, ndr_test_v4_ntacl_blob, ntacl_hdr);
+	ndr_init(&n, buf, ntacl_hdr);
+	KUNIT_EXPECT_EQ(test, ndr_decode_v4_ntacl(&n, &acl), 0);
+	KUNIT_EXPECT_EQ(test, acl.sd_size, 0U);
+}
+
+static void ndr_test_meta(struct kunit *test)
+{
+	struct xattr_dos_attrib da, out;
+	struct ndr dos = {0}, ntacl = {0}, none = {0}, meta = {0};
+	struct ndr dos_view, acl_view;
+	struct xattr_ntacl acl;
+
+	ndr_test_fill_dos_v4(&da);
+	ndr_test_fill_v4_ntacl(&acl);
+	KUNIT_ASSERT_EQ(test, ndr_encode_dos_attr(&dos, &da), 0);
+	KUNIT_ASSERT_EQ(test, ndr_encode_v4_ntacl(&ntacl, &acl), 0);
+	KUNIT_ASSERT_EQ(test, ndr_encode_meta(&meta, &dos, &ntacl), 0);
+
+	KUNIT_ASSERT_EQ(test, ndr_decode_meta(&meta, &dos_view, &acl_view), 0);
+	KUNIT_ASSERT_EQ(test, dos_view.length, dos.offset);
+	KUNIT_EXPECT_EQ(test, memcmp(dos_view.data, dos.data, dos.offset), 0);
+	KUNIT_ASSERT_EQ(test, acl_view.length, ntacl.offset);
+	KUNIT_EXPECT_EQ(test, memcmp(acl_view.data, ntacl.data, ntacl.offset),
+			0);
+	KUNIT_EXPECT_EQ(test, ndr_decode_dos_attr(&dos_view, &out), 0);
+	KUNIT_EXPECT_EQ(test, out.create_time, da.create_time);
+
+	/* a part length running past the blob is rejected */
+	meta.length--;
+	KUNIT_EXPECT_EQ(test, ndr_decode_meta(&meta, &dos_view, &acl_view),
+			-EINVAL);
+	kfree(meta.data);
+
+	memset(&meta, 0, sizeof(meta));
+	KUNIT_ASSERT_EQ(test, ndr_encode_meta(&meta, &dos, &none), 0);
+	KUNIT_ASSERT_EQ(test, ndr_decode_meta(&meta, &dos_view, &acl_view), 0);
+	KUNIT_EXPECT_EQ(test, dos_view.length, dos.offset);
+	KUNIT_EXPECT_PTR_EQ(test, (void *)acl_view.data, NULL);
+
+	kfree(meta.data);
+	kfree(ntacl.data);
+	kfree(dos.data);
+}
+
+static struct kunit_case ndr_test_cases[] = {
+	KUNIT_CASE(ndr_test_dos_attr_v3),
+	KUNIT_CASE(ndr_test_dos_attr_v4),
+	KUNIT_CASE(ndr_test_dos_attr_init),
+	KUNIT_CASE(ndr_test_posix_acl),
+	KUNIT_CASE(ndr_test_v4_ntacl),
+	KUNIT_CASE(ndr_test_encode_nospc),
+	KUNIT_CASE(ndr_test_decode_short),
+	KUNIT_CASE(ndr_test_meta),
+	{}
+};
+
+static struct kunit_suite ndr_test_suite = {
+	.name = "ksmbd-ndr",
+	.test_cases = ndr_test_cases,
+};
+
+kunit_test_suite(ndr_test_suite);
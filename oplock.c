@@ -15,6 +15,7 @@
 #endif
 #include "smbstatus.h"
 #include "connection.h"
+#include "ksmbd_sched.h"
 #include "mgmt/user_session.h"
 #include "mgmt/share_config.h"
 #include "mgmt/tree_connect.h"
@@ -806,6 +807,46 @@ static int smb1_oplock_break_noti(struct oplock_info *opinfo)
 }
 #endif
 
+/**
+ * oplock_break_conn() - pick the channel to send a break notification on
+ * @opinfo:	oplock info object
+ *
+ * Breaks go to the channel the oplock was granted on. If that channel
+ * is going away, any other live channel of the session is used instead.
+ * The channel list is walked under its xarray lock and the chosen
+ * connection's r_count is raised before the lock is dropped, so a
+ * channel torn down concurrently cannot free it under the break.
+ *
+ * Return:	connection to send the break on, with r_count held
+ */
+static struct ksmbd_conn *oplock_break_conn(struct oplock_info *opinfo)
+{
+	struct ksmbd_session *sess = opinfo->sess;
+	struct ksmbd_conn *conn = opinfo->conn;
+	struct channel *chann;
+	unsigned long index;
+
+	if (conn->status != KSMBD_SESS_EXITING || !sess)
+		goto out;
+
+	xa_lock(&sess->ksmbd_chann_list);
+	xa_for_each(&sess->ksmbd_chann_list, index, chann) {
+		if (chann->conn != opinfo->conn &&
+		    chann->conn->status == KSMBD_SESS_GOOD) {
+			ksmbd_debug(OPLOCK,
+				    "sending break on another channel\n");
+			conn = chann->conn;
+			atomic_inc(&conn->r_count);
+			xa_unlock(&sess->ksmbd_chann_list);
+			return conn;
+		}
+	}
+	xa_unlock(&sess->ksmbd_chann_list);
+out:
+	atomic_inc(&conn->r_count);
+	return conn;
+}
+
 /**
  * __smb2_oplock_break_noti() - send smb2 oplock break cmd from conn
  * to client
@@ -894,7 +935,7 @@ out:
  */
 static int smb2_oplock_break_noti(struct oplock_info *opinfo)
 {
-	struct ksmbd_conn *conn = opinfo->conn;
+	struct ksmbd_conn *conn;
 	struct oplock_break_info *br_info;
 	int ret = 0;
 	struct ksmbd_work *work = ksmbd_alloc_work_struct();
@@ -912,11 +953,11 @@ static int smb2_oplock_break_noti(struct oplock_info *opinfo)
 	br_info->fid = opinfo->fid;
 	br_info->open_trunc = opinfo->open_trunc;
 
+	conn = oplock_break_conn(opinfo);
 	work->request_buf = (char *)br_info;
 	work->conn = conn;
 	work->sess = opinfo->sess;
 
-	atomic_inc(&conn->r_count);
 	if (opinfo->op_state == OPLOCK_ACK_WAIT) {
 		INIT_WORK(&work->work, __smb2_oplock_break_noti);
 		ksmbd_queue_work(work);
@@ -1004,7 +1045,7 @@ out:
  */
 static int smb2_lease_break_noti(struct oplock_info *opinfo)
 {
-	struct ksmbd_conn *conn = opinfo->conn;
+	struct ksmbd_conn *conn;
 	struct list_head *tmp, *t;
 	struct ksmbd_work *work;
 	struct lease_break_info *br_info;
@@ -1028,11 +1069,11 @@ static int smb2_lease_break_noti(struct oplock_info *opinfo)
 		br_info->epoch = 0;
 	memcpy(br_info->lease_key, lease->lease_key, SMB2_LEASE_KEY_SIZE);
 
+	conn = oplock_break_conn(opinfo);
 	work->request_buf = (char *)br_info;
 	work->conn = conn;
 	work->sess = opinfo->sess;
 
-	atomic_inc(&conn->r_count);
 	if (opinfo->op_state == OPLOCK_ACK_WAIT) {
 		list_for_each_safe(tmp, t, &opinfo->interim_list) {
 			struct ksmbd_work *in_work;
@@ -1388,6 +1429,8 @@ int smb_grant_oplock(struct ksmbd_work *work, int req_op_level, u64 pid,
 	}
 
 	list_add(&work->interim_entry, &prev_opinfo->interim_list);
+	/* the break is acknowledged by a request which needs a slot */
+	ksmbd_sched_work_done(work);
 	err = oplock_break(prev_opinfo, SMB2_OPLOCK_LEVEL_II);
 	opinfo_put(prev_opinfo);
 	if (err == -ENOENT)
@@ -1458,6 +1501,7 @@ static void smb_break_all_write_oplock(struct ksmbd_work *work,
 
 	brk_opinfo->open_trunc = is_trunc;
 	list_add(&work->interim_entry, &brk_opinfo->interim_list);
+	ksmbd_sched_work_done(work);
 	oplock_break(brk_opinfo, SMB2_OPLOCK_LEVEL_II);
 	opinfo_put(brk_opinfo);
 }
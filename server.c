@@ -18,9 +18,14 @@
 #include "smbstatus.h"
 #include "connection.h"
 #include "transport_ipc.h"
+#include "transport_rdma.h"
+#include "ksmbd_sched.h"
 #include "mgmt/user_session.h"
+#include "mgmt/tree_connect.h"
+#include "mgmt/share_config.h"
 #include "crypto_ctx.h"
 #include "auth.h"
+#include "smbacl.h"
 
 int ksmbd_debug_types;
 
@@ -101,6 +106,22 @@ static inline int check_conn_state(struct ksmbd_work *work)
 	return 0;
 }
 
+/*
+ * Requests to IPC shares wait for the user space daemon and requests to
+ * shares with QoS limits have to go through the request scheduler.
+ */
+static bool ksmbd_inline_share_allowed(struct ksmbd_work *work)
+{
+	struct ksmbd_share_config *share;
+
+	if (!work->tcon)
+		return true;
+
+	share = work->tcon->share_conf;
+	return !test_share_config_flag(share, KSMBD_SHARE_FLAG_PIPE) &&
+		!share->max_iops && !share->max_bandwidth;
+}
+
 #define SERVER_HANDLER_CONTINUE		0
 #define SERVER_HANDLER_ABORT		1
 
@@ -141,7 +162,19 @@ andx_again:
 		}
 	}
 
-	ret = cmds->proc(work);
+	if (work->inline_exec && !ksmbd_inline_share_allowed(work))
+		ret = -EAGAIN;
+	else
+		ret = cmds->proc(work);
+
+	/*
+	 * The command can't complete without blocking the receiving
+	 * thread. Finish it from the work queue like a resumed command.
+	 */
+	if (ret == -EAGAIN && work->inline_exec) {
+		work->resume_fn = cmds->proc;
+		return SERVER_HANDLER_CONTINUE;
+	}
 
 	if (ret < 0)
 		ksmbd_debug(CONN, "Failed to process %u [%d]\n", command, ret);
@@ -157,6 +190,48 @@ andx_again:
 	return SERVER_HANDLER_CONTINUE;
 }
 
+static int __finish_request(struct ksmbd_work *work, struct ksmbd_conn *conn,
+			    u16 command)
+{
+	int rc;
+
+	/*
+	 * Call smb2_set_rsp_credits() function to set number of credits
+	 * granted in hdr of smb2 response.
+	 */
+	if (conn->ops->set_rsp_credits) {
+		spin_lock(&conn->credits_lock);
+		rc = conn->ops->set_rsp_credits(work);
+		spin_unlock(&conn->credits_lock);
+		if (rc < 0) {
+			conn->ops->set_rsp_status(work,
+				STATUS_INVALID_PARAMETER);
+			return rc;
+		}
+	}
+
+	if (work->sess &&
+	    (work->sess->sign || smb3_11_final_sess_setup_resp(work) ||
+	     conn->ops->is_sign_req(work, command)))
+		conn->ops->set_sign_rsp(work);
+	return 0;
+}
+
+static void __send_response(struct ksmbd_work *work, struct ksmbd_conn *conn)
+{
+	int rc;
+
+	smb3_preauth_hash_rsp(work);
+	if (work->sess && work->sess->enc && work->encrypted &&
+	    conn->ops->encrypt_resp) {
+		rc = conn->ops->encrypt_resp(work);
+		if (rc < 0)
+			conn->ops->set_rsp_status(work, STATUS_DATA_ERROR);
+	}
+
+	ksmbd_conn_write(work);
+}
+
 static void __handle_ksmbd_work(struct ksmbd_work *work,
 				struct ksmbd_conn *conn)
 {
@@ -198,6 +273,7 @@ static void __handle_ksmbd_work(struct ksmbd_work *work,
 					STATUS_NETWORK_NAME_DELETED);
 				goto send;
 			}
+			ksmbd_sched_set_share(work);
 		}
 	}
 
@@ -207,56 +283,52 @@ static void __handle_ksmbd_work(struct ksmbd_work *work,
 			break;
 
 		/*
-		 * Call smb2_set_rsp_credits() function to set number of credits
-		 * granted in hdr of smb2 response.
+		 * The response is completed by __resume_ksmbd_work() after
+		 * an RDMA read or when a command executed inline was deferred.
 		 */
-		if (conn->ops->set_rsp_credits) {
-			spin_lock(&conn->credits_lock);
-			rc = conn->ops->set_rsp_credits(work);
-			spin_unlock(&conn->credits_lock);
-			if (rc < 0) {
-				conn->ops->set_rsp_status(work,
-					STATUS_INVALID_PARAMETER);
-				goto send;
-			}
-		}
+		if (work->resume_fn)
+			return;
 
-		if (work->sess &&
-		    (work->sess->sign || smb3_11_final_sess_setup_resp(work) ||
-		     conn->ops->is_sign_req(work, command)))
-			conn->ops->set_sign_rsp(work);
+		if (__finish_request(work, conn, command))
+			goto send;
 	} while (is_chained_smb2_message(work));
 
-	if (work->send_no_response)
+	if (work->send_no_response) {
+		ksmbd_put_compound_fp(work);
 		return;
-
-send:
-	smb3_preauth_hash_rsp(work);
-	if (work->sess && work->sess->enc && work->encrypted &&
-	    conn->ops->encrypt_resp) {
-		rc = conn->ops->encrypt_resp(work);
-		if (rc < 0)
-			conn->ops->set_rsp_status(work, STATUS_DATA_ERROR);
 	}
 
-	ksmbd_conn_write(work);
+send:
+	/* Drop the file kept for related commands while the session is held */
+	ksmbd_put_compound_fp(work);
+	__send_response(work, conn);
 }
 
 /**
- * handle_ksmbd_work() - process pending smb work requests
- * @wk:	smb work containing request command buffer
+ * __resume_ksmbd_work() - finish a command deferred by its handler
+ * @work:	smb work of the deferred command
+ * @conn:	connection instance
  *
- * called by kworker threads to processing remaining smb work requests
+ * Deferred commands are never part of a compound request, so only the
+ * current command needs to be completed before sending the response.
  */
-static void handle_ksmbd_work(struct work_struct *wk)
+static void __resume_ksmbd_work(struct ksmbd_work *work,
+				struct ksmbd_conn *conn)
 {
-	struct ksmbd_work *work = container_of(wk, struct ksmbd_work, work);
-	struct ksmbd_conn *conn = work->conn;
+	int (*fn)(struct ksmbd_work *work) = work->resume_fn;
 
-	atomic64_inc(&conn->stats.request_served);
+	work->resume_fn = NULL;
+	fn(work);
+	ksmbd_put_compound_fp(work);
 
-	__handle_ksmbd_work(work, conn);
+	__finish_request(work, conn, conn->ops->get_cmd_val(work));
+	__send_response(work, conn);
+}
 
+static void __release_ksmbd_work(struct ksmbd_work *work,
+				 struct ksmbd_conn *conn)
+{
+	ksmbd_sched_work_done(work);
 	ksmbd_conn_try_dequeue_request(work);
 	ksmbd_free_work_struct(work);
 	/*
@@ -268,6 +340,35 @@ static void handle_ksmbd_work(struct work_struct *wk)
 		wake_up(&conn->r_count_q);
 }
 
+/**
+ * handle_ksmbd_work() - process pending smb work requests
+ * @wk:	smb work containing request command buffer
+ *
+ * called by kworker threads to processing remaining smb work requests
+ */
+static void handle_ksmbd_work(struct work_struct *wk)
+{
+	struct ksmbd_work *work = container_of(wk, struct ksmbd_work, work);
+	struct ksmbd_conn *conn = work->conn;
+
+	if (work->resume_fn) {
+		__resume_ksmbd_work(work, conn);
+	} else {
+		atomic64_inc(&conn->stats.request_served);
+
+		__handle_ksmbd_work(work, conn);
+		/*
+		 * The handler is waiting for an RDMA read and the work is
+		 * queued again from its completion. The work queue doesn't
+		 * run it before this instance returns.
+		 */
+		if (work->resume_fn)
+			return;
+	}
+
+	__release_ksmbd_work(work, conn);
+}
+
 /**
  * queue_ksmbd_work() - queue a smb request to worker thread queue
  *		for proccessing smb command and sending response
@@ -286,8 +387,10 @@ static int queue_ksmbd_work(struct ksmbd_conn *conn)
 	}
 
 	work->conn = conn;
+	work->recv_node = numa_node_id();
 	work->request_buf = conn->request_buf;
 	conn->request_buf = NULL;
+	ksmbd_work_charge_mem(work, get_rfc1002_len(work->request_buf) + 4);
 
 	if (ksmbd_init_smb_server(work)) {
 		ksmbd_free_work_struct(work);
@@ -299,7 +402,25 @@ static int queue_ksmbd_work(struct ksmbd_conn *conn)
 	/* update activity on connection */
 	conn->last_active = jiffies;
 	INIT_WORK(&work->work, handle_ksmbd_work);
-	ksmbd_queue_work(work);
+
+	/*
+	 * Small requests which are likely served from memory are executed
+	 * right away to save the hand-off to a worker. Their handlers defer
+	 * the request to the work queue if they would block.
+	 */
+	if (conn->ops->is_inline_req && conn->ops->is_inline_req(work)) {
+		atomic64_inc(&conn->stats.request_served);
+
+		work->inline_exec = true;
+		__handle_ksmbd_work(work, conn);
+		work->inline_exec = false;
+		if (!work->resume_fn) {
+			__release_ksmbd_work(work, conn);
+			return 0;
+		}
+	}
+
+	ksmbd_sched_queue_work(work);
 	return 0;
 }
 
@@ -502,14 +623,69 @@ static ssize_t debug_store(struct class *class, struct class_attribute *attr,
 	return len;
 }
 
+static ssize_t mem_budget_show(struct class *class,
+			       struct class_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksmbd_mem_budget());
+}
+
+static ssize_t mem_budget_store(struct class *class,
+				struct class_attribute *attr, const char *buf,
+				size_t len)
+{
+	unsigned long budget;
+	int ret;
+
+	ret = kstrtoul(buf, 0, &budget);
+	if (ret)
+		return ret;
+
+	ksmbd_set_mem_budget(budget);
+	return len;
+}
+
+static ssize_t mem_usage_show(struct class *class,
+			      struct class_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%lu\n", ksmbd_mem_usage());
+}
+
+static ssize_t sched_stats_show(struct class *class,
+				struct class_attribute *attr, char *buf)
+{
+	return ksmbd_sched_stats_show(buf);
+}
+
+static ssize_t rdma_stats_show(struct class *class,
+			       struct class_attribute *attr, char *buf)
+{
+	return ksmbd_rdma_stats_show(buf, 0);
+}
+
+static ssize_t acl_cache_stats_show(struct class *class,
+				    struct class_attribute *attr, char *buf)
+{
+	return ksmbd_acl_cache_stats_show(buf);
+}
+
 static CLASS_ATTR_RO(stats);
 static CLASS_ATTR_WO(kill_server);
 static CLASS_ATTR_RW(debug);
+static CLASS_ATTR_RO(rdma_stats);
+static CLASS_ATTR_RO(sched_stats);
+static CLASS_ATTR_RW(mem_budget);
+static CLASS_ATTR_RO(mem_usage);
+static CLASS_ATTR_RO(acl_cache_stats);
 
 static struct attribute *ksmbd_control_class_attrs[] = {
 	&class_attr_stats.attr,
 	&class_attr_kill_server.attr,
 	&class_attr_debug.attr,
+	&class_attr_rdma_stats.attr,
+	&class_attr_sched_stats.attr,
+	&class_attr_mem_budget.attr,
+	&class_attr_mem_usage.attr,
+	&class_attr_acl_cache_stats.attr,
 	NULL,
 };
 ATTRIBUTE_GROUPS(ksmbd_control_class);
@@ -525,14 +701,17 @@ static int ksmbd_server_shutdown(void)
 	WRITE_ONCE(server_conf.state, SERVER_STATE_SHUTTING_DOWN);
 
 	class_unregister(&ksmbd_control_class);
-	ksmbd_workqueue_destroy();
 	ksmbd_ipc_release();
+	/* connections wait for their works, which need the scheduler */
 	ksmbd_conn_transport_destroy();
+	ksmbd_sched_destroy();
+	ksmbd_workqueue_destroy();
 	ksmbd_crypto_destroy();
 	ksmbd_free_global_file_table();
 	destroy_lease_table(NULL);
 	ksmbd_work_pool_destroy();
 	ksmbd_exit_file_cache();
+	ksmbd_acl_cache_destroy();
 	server_conf_free();
 	return 0;
 }
@@ -573,6 +752,8 @@ static int __init ksmbd_server_init(void)
 	if (ret)
 		goto err_destroy_file_table;
 
+	ksmbd_vfs_meta_xattr_init();
+
 	ret = ksmbd_crypto_create();
 	if (ret)
 		goto err_release_inode_hash;
@@ -580,8 +761,14 @@ static int __init ksmbd_server_init(void)
 	ret = ksmbd_workqueue_init();
 	if (ret)
 		goto err_crypto_destroy;
+
+	ret = ksmbd_sched_init();
+	if (ret)
+		goto err_workqueue_destroy;
 	return 0;
 
+err_workqueue_destroy:
+	ksmbd_workqueue_destroy();
 err_crypto_destroy:
 	ksmbd_crypto_destroy();
 err_release_inode_hash:
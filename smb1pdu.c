@@ -29,6 +29,7 @@
 #include "mgmt/user_session.h"
 #include "ndr.h"
 #include "smberr.h"
+#include "ksmbd_sched.h"
 
 static int smb1_oplock_enable = false;
 
@@ -196,6 +197,7 @@ int smb_allocate_rsp_buf(struct ksmbd_work *work)
 		pr_err("Failed to allocate %zu bytes buffer\n", sz);
 		return -ENOMEM;
 	}
+	ksmbd_work_charge_mem(work, sz);
 
 	return 0;
 }
@@ -322,6 +324,8 @@ int smb_session_disconnect(struct ksmbd_work *work)
 	ksmbd_free_user(sess->user);
 	sess->user = NULL;
 
+	/* the requests waited for may need the slot */
+	ksmbd_sched_work_done(work);
 	ksmbd_conn_wait_idle(conn);
 
 	ksmbd_tree_conn_session_logoff(sess);
@@ -1735,6 +1739,7 @@ int smb_locking_andx(struct ksmbd_work *work)
 							read_unlock(&conn_list_lock);
 							ksmbd_debug(SMB, "waiting error response for timeout : %d\n",
 								timeout);
+							ksmbd_sched_work_done(work);
 							msleep(timeout);
 						}
 						rsp->hdr.Status.CifsError =
@@ -1774,6 +1779,8 @@ retry:
 				      &work->conn->lock_list);
 			spin_unlock(&work->conn->llist_lock);
 			list_add(&smb_lock->llist, &rollback_list);
+			/* the lock may only be released by another request */
+			ksmbd_sched_work_done(work);
 wait:
 			err = ksmbd_vfs_posix_lock_wait_timeout(flock,
 							msecs_to_jiffies(10));
@@ -2912,6 +2919,7 @@ int smb_read_andx(struct ksmbd_work *work)
 		err = -ENOMEM;
 		goto out;
 	}
+	ksmbd_work_charge_mem(work, count);
 
 	nbytes = ksmbd_vfs_read(work, fp, count, &pos);
 	if (nbytes < 0) {
@@ -2934,9 +2942,11 @@ int smb_read_andx(struct ksmbd_work *work)
 
 	rsp->ByteCount = cpu_to_le16(nbytes);
 	inc_rfc1001_len(&rsp->hdr, (rsp->hdr.WordCount * 2));
-	work->resp_hdr_sz = get_rfc1002_len(rsp) + 4;
-	work->aux_payload_sz = nbytes;
-	inc_rfc1001_len(&rsp->hdr, nbytes);
+	err = ksmbd_work_add_payload(work, work->aux_payload_buf, nbytes,
+				     work->aux_payload_buf);
+	if (err)
+		goto out;
+	work->aux_payload_buf = NULL;
 
 	/* this is an ANDx command ? */
 	rsp->AndXReserved = 0;
@@ -4212,7 +4222,7 @@ static int query_path_info(struct ksmbd_work *work)
 		memset(ptr, 0, 4);
 		name_info = (struct file_name_info *)(ptr + 4);
 
-		filename = convert_to_nt_pathname(work->tcon->share_conf, &path);
+		filename = convert_to_nt_pathname(work, &path);
 		if (!filename) {
 			rc = -ENOMEM;
 			goto err_out;
@@ -4221,7 +4231,7 @@ static int query_path_info(struct ksmbd_work *work)
 				(__le16 *)name_info->FileName,
 				filename, PATH_MAX,
 				conn->local_nls, 0);
-		kfree(filename);
+		ksmbd_scratch_free(work, filename);
 		uni_filename_len *= 2;
 		name_info->FileNameLength = cpu_to_le32(uni_filename_len);
 
@@ -4258,7 +4268,7 @@ static int query_path_info(struct ksmbd_work *work)
 		else
 			del_pending = 0;
 
-		filename = convert_to_nt_pathname(work->tcon->share_conf, &path);
+		filename = convert_to_nt_pathname(work, &path);
 		if (!filename) {
 			rc = -ENOMEM;
 			goto err_out;
@@ -4296,7 +4306,7 @@ static int query_path_info(struct ksmbd_work *work)
 				(__le16 *)ainfo->FileName,
 				filename, PATH_MAX,
 				conn->local_nls, 0);
-		kfree(filename);
+		ksmbd_scratch_free(work, filename);
 		uni_filename_len *= 2;
 		ainfo->FileNameLength = cpu_to_le32(uni_filename_len);
 		total_count += uni_filename_len;
@@ -4329,6 +4339,14 @@ static int query_path_info(struct ksmbd_work *work)
 		int filename_len;
 
 		ksmbd_debug(SMB, "SMB_QUERY_ALT_NAME_INFO\n");
+		if (test_share_config_flag(share,
+					   KSMBD_SHARE_FLAG_NO_SHORT_NAMES)) {
+			rsp_hdr->Status.CifsError =
+				STATUS_OBJECT_NAME_NOT_FOUND;
+			rc = -ENODATA;
+			goto err_out;
+		}
+
 		rsp_hdr->WordCount = 10;
 		rsp->t2.TotalParameterCount = cpu_to_le16(2);
 		rsp->t2.Reserved = 0;
@@ -5930,6 +5948,7 @@ static int find_first(struct ksmbd_work *work)
 	int srch_cnt = 0;
 	char *dirpath = NULL;
 	char *srch_ptr = NULL;
+	struct ksmbd_pattern *pattern = NULL;
 	int header_size;
 	int struct_sz;
 
@@ -5950,6 +5969,14 @@ static int find_first(struct ksmbd_work *work)
 		goto err_out;
 	}
 
+	pattern = ksmbd_compile_pattern(srch_ptr, NULL, 0);
+	if (IS_ERR(pattern)) {
+		rsp->hdr.Status.CifsError = STATUS_NO_MEMORY;
+		rc = PTR_ERR(pattern);
+		pattern = NULL;
+		goto err_free_dirpath;
+	}
+
 	ksmbd_debug(SMB, "complete dir path = %s\n",  dirpath);
 	rc = ksmbd_vfs_kern_path(work, dirpath, LOOKUP_NO_SYMLINKS | LOOKUP_DIRECTORY,
 				 &path, 0);
@@ -6041,7 +6068,7 @@ static int find_first(struct ksmbd_work *work)
 				le16_to_cpu(req_params->InformationLevel),
 				dir_fp,
 				&d_info,
-				srch_ptr,
+				pattern,
 				smb_populate_readdir_entry);
 		if (rc)
 			goto err_out;
@@ -6095,32 +6122,35 @@ static int find_first(struct ksmbd_work *work)
 		d_info.smb1_name[de->namelen] = '\0';
 		d_info.name = (const char *)d_info.smb1_name;
 		d_info.name_len = de->namelen;
+
+		if (ksmbd_share_veto_filename(share, d_info.name)) {
+			ksmbd_debug(SMB, "Veto filename %s\n", d_info.name);
+			continue;
+		}
+
+		if (!ksmbd_match_pattern(pattern, d_info.name, d_info.name_len))
+			continue;
+
 		rc = ksmbd_vfs_readdir_name(work,
 					    file_mnt_user_ns(dir_fp->filp),
 					    &ksmbd_kstat,
 					    de->name,
 					    de->namelen,
-					    dirpath);
+					    dir_fp->filp->f_path.dentry);
 		if (rc) {
 			ksmbd_debug(SMB, "Cannot read dirent: %d\n", rc);
+			rc = 0;
 			continue;
 		}
 
-		if (ksmbd_share_veto_filename(share, d_info.name)) {
-			ksmbd_debug(SMB, "Veto filename %s\n", d_info.name);
-			continue;
-		}
-
-		if (match_pattern(d_info.name, d_info.name_len, srch_ptr)) {
-			rc = smb_populate_readdir_entry(conn,
-				le16_to_cpu(req_params->InformationLevel),
-				&d_info,
-				&ksmbd_kstat);
-			if (rc == -ENOSPC)
-				break;
-			else if (rc)
-				goto err_out;
-		}
+		rc = smb_populate_readdir_entry(conn,
+			le16_to_cpu(req_params->InformationLevel),
+			&d_info,
+			&ksmbd_kstat);
+		if (rc == -ENOSPC)
+			break;
+		else if (rc)
+			goto err_out;
 	} while (d_info.out_buf_len >= 0);
 
 	if (!d_info.data_count && *srch_ptr) {
@@ -6173,6 +6203,7 @@ static int find_first(struct ksmbd_work *work)
 	inc_rfc1001_len(rsp_hdr, (10 * 2 + d_info.data_count +
 				params_count + 1 + data_alignment_offset));
 	kfree(srch_ptr);
+	ksmbd_free_pattern(pattern);
 	kfree(d_info.smb1_name);
 	ksmbd_revert_fsids(work);
 	return 0;
@@ -6205,6 +6236,7 @@ err_out:
 	}
 
 	kfree(srch_ptr);
+	ksmbd_free_pattern(pattern);
 	kfree(d_info.smb1_name);
 	ksmbd_revert_fsids(work);
 	return 0;
@@ -6326,24 +6358,25 @@ static int find_next(struct ksmbd_work *work)
 		d_info.smb1_name[de->namelen] = '\0';
 		d_info.name = (const char *)d_info.smb1_name;
 		d_info.name_len = de->namelen;
+
+		if (ksmbd_share_veto_filename(share, d_info.name)) {
+			ksmbd_debug(SMB, "file(%s) is invisible by setting as veto file\n",
+				d_info.name);
+			continue;
+		}
+
 		rc = ksmbd_vfs_readdir_name(work,
 					    file_mnt_user_ns(dir_fp->filp),
 					    &ksmbd_kstat,
 					    de->name,
 					    de->namelen,
-					    dir_fp->filename);
+					    dir_fp->filp->f_path.dentry);
 		if (rc) {
 			ksmbd_debug(SMB, "Err while dirent read rc = %d\n", rc);
 			rc = 0;
 			continue;
 		}
 
-		if (ksmbd_share_veto_filename(share, d_info.name)) {
-			ksmbd_debug(SMB, "file(%s) is invisible by setting as veto file\n",
-				d_info.name);
-			continue;
-		}
-
 		ksmbd_debug(SMB, "filename string = %.*s\n",
 				d_info.name_len, d_info.name);
 		rc = smb_populate_readdir_entry(conn,
@@ -6830,8 +6863,7 @@ static int query_file_info(struct ksmbd_work *work)
 		memset(ptr, 0, 4);
 		name_info = (struct file_name_info *)(ptr + 4);
 
-		filename = convert_to_nt_pathname(work->tcon->share_conf,
-						  &fp->filp->f_path);
+		filename = convert_to_nt_pathname(work, &fp->filp->f_path);
 		if (!filename) {
 			rc = -ENOMEM;
 			goto err_out;
@@ -6840,7 +6872,7 @@ static int query_file_info(struct ksmbd_work *work)
 				(__le16 *)name_info->FileName,
 				filename, PATH_MAX,
 				conn->local_nls, 0);
-		kfree(filename);
+		ksmbd_scratch_free(work, filename);
 		uni_filename_len *= 2;
 		name_info->FileNameLength = cpu_to_le32(uni_filename_len);
 
@@ -8483,29 +8515,34 @@ void smb1_set_sign_rsp(struct ksmbd_work *work)
 {
 	struct smb_hdr *rsp_hdr = (struct smb_hdr *)work->response_buf;
 	char signature[20];
-	struct kvec iov[2];
-	int n_vec = 1;
+	struct kvec iov_inline[3], *iov = iov_inline;
+	int nr_iov = ksmbd_work_nr_rsp_iov(work);
+	int n_vec;
 
 	rsp_hdr->Flags2 |= SMBFLG2_SECURITY_SIGNATURE;
 	rsp_hdr->Signature.Sequence.SequenceNumber =
 		cpu_to_le32(++work->sess->sequence_number);
 	rsp_hdr->Signature.Sequence.Reserved = 0;
 
-	iov[0].iov_base = rsp_hdr->Protocol;
-	iov[0].iov_len = be32_to_cpu(rsp_hdr->smb_buf_length);
-
-	if (work->aux_payload_sz) {
-		iov[0].iov_len -= work->aux_payload_sz;
-
-		iov[1].iov_base = work->aux_payload_buf;
-		iov[1].iov_len = work->aux_payload_sz;
-		n_vec++;
+	if (nr_iov > ARRAY_SIZE(iov_inline)) {
+		iov = kmalloc_array(nr_iov, sizeof(*iov), GFP_KERNEL);
+		if (!iov) {
+			memset(rsp_hdr->Signature.SecuritySignature,
+			       0, CIFS_SMB1_SIGNATURE_SIZE);
+			return;
+		}
 	}
 
+	n_vec = ksmbd_work_rsp_iov(work, 4, get_rfc1002_len(rsp_hdr), iov,
+				   nr_iov);
+
 	if (ksmbd_sign_smb1_pdu(work->sess, iov, n_vec, signature))
 		memset(rsp_hdr->Signature.SecuritySignature,
 				0, CIFS_SMB1_SIGNATURE_SIZE);
 	else
 		memcpy(rsp_hdr->Signature.SecuritySignature,
 				signature, CIFS_SMB1_SIGNATURE_SIZE);
+
+	if (iov != iov_inline)
+		kfree(iov);
 }
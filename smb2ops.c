@@ -156,6 +156,7 @@ static struct smb_version_ops smb2_0_server_ops = {
 	.set_rsp_credits	=	smb2_set_rsp_credits,
 	.check_user_session	=	smb2_check_user_session,
 	.get_ksmbd_tcon		=	smb2_get_ksmbd_tcon,
+	.is_inline_req		=	smb2_is_inline_req,
 	.is_sign_req		=	smb2_is_sign_req,
 	.check_sign_req		=	smb2_check_sign_req,
 	.set_sign_rsp		=	smb2_set_sign_rsp
@@ -169,6 +170,7 @@ static struct smb_version_ops smb3_0_server_ops = {
 	.set_rsp_credits	=	smb2_set_rsp_credits,
 	.check_user_session	=	smb2_check_user_session,
 	.get_ksmbd_tcon		=	smb2_get_ksmbd_tcon,
+	.is_inline_req		=	smb2_is_inline_req,
 	.is_sign_req		=	smb2_is_sign_req,
 	.check_sign_req		=	smb3_check_sign_req,
 	.set_sign_rsp		=	smb3_set_sign_rsp,
@@ -187,6 +189,7 @@ static struct smb_version_ops smb3_11_server_ops = {
 	.set_rsp_credits	=	smb2_set_rsp_credits,
 	.check_user_session	=	smb2_check_user_session,
 	.get_ksmbd_tcon		=	smb2_get_ksmbd_tcon,
+	.is_inline_req		=	smb2_is_inline_req,
 	.is_sign_req		=	smb2_is_sign_req,
 	.check_sign_req		=	smb3_check_sign_req,
 	.set_sign_rsp		=	smb3_set_sign_rsp,
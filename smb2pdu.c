@@ -33,6 +33,7 @@
 #include "smb_common.h"
 #include "smbstatus.h"
 #include "ksmbd_work.h"
+#include "ksmbd_sched.h"
 #include "mgmt/user_config.h"
 #include "mgmt/share_config.h"
 #include "mgmt/tree_connect.h"
@@ -55,20 +56,21 @@ static void __wbuf(struct ksmbd_work *work, void **req, void **rsp)
 
 /**
  * check_session_id() - check for valid session id in smb header
- * @conn:	connection instance
+ * @work:	smb work, its session was validated for the request
  * @id:		session id from smb header
  *
  * Return:      1 if valid session id, otherwise 0
  */
-static inline bool check_session_id(struct ksmbd_conn *conn, u64 id)
+static inline bool check_session_id(struct ksmbd_work *work, u64 id)
 {
-	struct ksmbd_session *sess;
+	struct ksmbd_session *sess = work->sess;
 
 	if (id == 0 || id == -1)
 		return false;
 
-	sess = ksmbd_session_lookup_all(conn, id);
-	if (sess)
+	if (!sess || sess->id != id)
+		sess = ksmbd_session_lookup_all(work->conn, id);
+	if (sess && sess->state == SMB2_SESSION_VALID)
 		return true;
 	pr_err("Invalid user session id: %llu\n", id);
 	return false;
@@ -79,6 +81,19 @@ struct channel *lookup_chann_list(struct ksmbd_session *sess, struct ksmbd_conn
 	return xa_load(&sess->ksmbd_chann_list, (long)conn);
 }
 
+/*
+ * Once a session has more than one channel, give every channel a CPU of
+ * its own so that their receive and request processing run in parallel.
+ */
+static void smb2_set_channel_affinity(struct ksmbd_session *sess)
+{
+	struct channel *chann;
+	unsigned long index;
+
+	xa_for_each(&sess->ksmbd_chann_list, index, chann)
+		ksmbd_conn_set_affinity(chann->conn);
+}
+
 /**
  * smb2_get_ksmbd_tcon() - get tree connection information using a tree id.
  * @work:	smb work
@@ -337,6 +352,19 @@ int smb2_set_rsp_credits(struct ksmbd_work *work)
 		aux_max = conn->vals->max_credits - credit_charge;
 	credits_granted = min_t(unsigned short, credits_requested, aux_max);
 
+	/*
+	 * Over the memory budget, let the credit window of the client
+	 * shrink down to SMB2_MEM_PRESSURE_CREDITS by granting less than
+	 * the request was charged.
+	 */
+	if (ksmbd_mem_over_budget() && hdr->Command != SMB2_NEGOTIATE) {
+		if (conn->total_credits >= SMB2_MEM_PRESSURE_CREDITS)
+			credits_granted = 0;
+		else
+			credits_granted = min_t(unsigned short,
+						credits_granted, 1);
+	}
+
 	if (conn->vals->max_credits - conn->total_credits < credits_granted)
 		credits_granted = conn->vals->max_credits -
 			conn->total_credits;
@@ -366,10 +394,10 @@ static void init_chained_smb2_rsp(struct ksmbd_work *work)
 	struct smb2_hdr *rsp_hdr;
 	struct smb2_hdr *rcv_hdr;
 	int next_hdr_offset = 0;
-	int len, new_len;
+	int len, new_len, aux_len;
 
 	/* Len of this response = updated RFC len - offset of previous cmd
-	 * in the compound rsp
+	 * in the compound rsp, payloads included
 	 */
 
 	/* Storing the current local FID which may be needed by subsequent
@@ -381,7 +409,9 @@ static void init_chained_smb2_rsp(struct ksmbd_work *work)
 		work->compound_sid = le64_to_cpu(rsp->SessionId);
 	}
 
-	len = get_rfc1002_len(work->response_buf) - work->next_smb2_rsp_hdr_off;
+	aux_len = work->aux_payload_sz - work->next_smb2_rsp_aux_off;
+	len = get_rfc1002_len(work->response_buf) -
+		(work->next_smb2_rsp_hdr_off + work->next_smb2_rsp_aux_off);
 	next_hdr_offset = le32_to_cpu(req->NextCommand);
 
 	new_len = ALIGN(len, 8);
@@ -389,8 +419,10 @@ static void init_chained_smb2_rsp(struct ksmbd_work *work)
 			sizeof(struct smb2_hdr) + new_len - len);
 	rsp->NextCommand = cpu_to_le32(new_len);
 
+	/* payloads are not part of the response buffer */
 	work->next_smb2_rcv_hdr_off += next_hdr_offset;
-	work->next_smb2_rsp_hdr_off += new_len;
+	work->next_smb2_rsp_hdr_off += new_len - aux_len;
+	work->next_smb2_rsp_aux_off = work->aux_payload_sz;
 	ksmbd_debug(SMB,
 		    "Compound req new_len = %d rcv off = %d rsp off = %d\n",
 		    new_len, work->next_smb2_rcv_hdr_off,
@@ -403,6 +435,9 @@ static void init_chained_smb2_rsp(struct ksmbd_work *work)
 		ksmbd_debug(SMB, "related flag should be set\n");
 		work->compound_fid = KSMBD_NO_FID;
 		work->compound_pfid = KSMBD_NO_FID;
+		ksmbd_put_compound_fp(work);
+	} else if (!rcv_hdr->NextCommand) {
+		work->compound_fp_last = true;
 	}
 	memset((char *)rsp_hdr, 0, sizeof(struct smb2_hdr) + 2);
 	rsp_hdr->ProtocolId = SMB2_PROTO_NUMBER;
@@ -447,7 +482,8 @@ bool is_chained_smb2_message(struct ksmbd_work *work)
 			return false;
 		}
 
-		if ((u64)get_rfc1002_len(work->response_buf) + MAX_CIFS_SMALL_BUFFER_SIZE >
+		if ((u64)get_rfc1002_len(work->response_buf) -
+		    work->aux_payload_sz + MAX_CIFS_SMALL_BUFFER_SIZE >
 		    work->response_sz) {
 			pr_err("next response offset exceeds response buffer size\n");
 			return false;
@@ -466,8 +502,6 @@ bool is_chained_smb2_message(struct ksmbd_work *work)
 		if (len) {
 			ksmbd_debug(SMB, "padding len %u\n", len);
 			inc_rfc1001_len(work->response_buf, len);
-			if (work->aux_payload_sz)
-				work->aux_payload_sz += len;
 		}
 	}
 	return false;
@@ -549,9 +583,75 @@ int smb2_allocate_rsp_buf(struct ksmbd_work *work)
 		return -ENOMEM;
 
 	work->response_sz = sz;
+	ksmbd_work_charge_mem(work, sz);
 	return 0;
 }
 
+#define SMB2_INLINE_MAX_READ	(64 * 1024)
+
+/**
+ * smb2_is_inline_req() - check whether a request is cheap enough to be
+ *			  handled in the receiving thread
+ * @work:	smb work containing smb request buffer
+ *
+ * Only single, unencrypted and synchronous requests which rarely sleep
+ * are taken: ECHO, CLOSE, small READs and queries of the file
+ * information classes answered from the open file alone. READ returns
+ * -EAGAIN when it finds it would have to block after all and is
+ * finished by a worker.
+ *
+ * Return:      true if the request can be executed inline
+ */
+bool smb2_is_inline_req(struct ksmbd_work *work)
+{
+	struct smb2_hdr *hdr = smb2_get_msg(work->request_buf);
+	unsigned int len = get_rfc1002_len(work->request_buf);
+
+	if (len < sizeof(struct smb2_hdr) ||
+	    hdr->ProtocolId != SMB2_PROTO_NUMBER ||
+	    hdr->NextCommand ||
+	    hdr->Flags & (SMB2_FLAGS_ASYNC_COMMAND |
+			  SMB2_FLAGS_RELATED_OPERATIONS))
+		return false;
+
+	switch (le16_to_cpu(hdr->Command)) {
+	case SMB2_ECHO_HE:
+	case SMB2_CLOSE_HE:
+		return true;
+	case SMB2_READ_HE:
+	{
+		struct smb2_read_req *req = smb2_get_msg(work->request_buf);
+
+		if (len < offsetof(struct smb2_read_req, Buffer))
+			return false;
+		return req->Channel == SMB2_CHANNEL_NONE &&
+			le32_to_cpu(req->Length) <= SMB2_INLINE_MAX_READ;
+	}
+	case SMB2_QUERY_INFO_HE:
+	{
+		struct smb2_query_info_req *req = smb2_get_msg(work->request_buf);
+
+		if (len < offsetof(struct smb2_query_info_req, Buffer) ||
+		    req->InfoType != SMB2_O_INFO_FILE)
+			return false;
+
+		/*
+		 * Classes needing the attributes call vfs_getattr() or read
+		 * the DOS attribute xattr, which may block on the filesystem.
+		 */
+		switch (req->FileInfoClass) {
+		case FILE_ACCESS_INFORMATION:
+		case FILE_ALIGNMENT_INFORMATION:
+		case FILE_POSITION_INFORMATION:
+		case FILE_MODE_INFORMATION:
+			return true;
+		}
+		return false;
+	}
+	}
+	return false;
+}
+
 /**
  * smb2_check_user_session() - check for valid session for a user
  * @work:	smb work containing smb request buffer
@@ -613,27 +713,34 @@ static void destroy_previous_session(struct ksmbd_conn *conn,
 
 /**
  * smb2_get_name() - get filename string from on the wire smb format
- * @share:	ksmbd_share_config pointer
+ * @work:	smb work
  * @src:	source buffer
  * @maxlen:	maxlen of source string
  * @local_nls:	nls_table pointer
  *
+ * The name is converted and normalized in the scratch arena of @work, the
+ * caller releases it with ksmbd_scratch_free().
+ *
  * Return:      matching converted filename on success, otherwise error ptr
  */
 static char *
-smb2_get_name(struct ksmbd_share_config *share, const char *src,
+smb2_get_name(struct ksmbd_work *work, const char *src,
 	      const int maxlen, struct nls_table *local_nls)
 {
 	char *name;
+	int rc;
 
-	name = smb_strndup_from_utf16(src, maxlen, 1, local_nls);
+	name = smb_strndup_from_utf16_scratch(work, src, maxlen, local_nls);
 	if (IS_ERR(name)) {
 		pr_err("failed to get name %ld\n", PTR_ERR(name));
 		return name;
 	}
 
-	ksmbd_conv_path_to_unix(name);
-	ksmbd_strip_last_slash(name);
+	rc = ksmbd_normalize_path(name);
+	if (rc) {
+		ksmbd_scratch_free(work, name);
+		return ERR_PTR(rc);
+	}
 	return name;
 }
 
@@ -668,6 +775,8 @@ int setup_async_work(struct ksmbd_work *work, void (*fn)(void **), void **arg)
 		spin_unlock(&conn->request_lock);
 	}
 
+	/* an async request waits for others, don't let it hold a slot */
+	ksmbd_sched_work_done(work);
 	return 0;
 }
 
@@ -1535,6 +1644,8 @@ binding_session:
 
 			chann->conn = conn;
 			xa_store(&sess->ksmbd_chann_list, (long)conn, chann, GFP_KERNEL);
+			if (conn->binding)
+				smb2_set_channel_affinity(sess);
 		}
 	}
 
@@ -1619,6 +1730,8 @@ static int krb5_authenticate(struct ksmbd_work *work)
 
 			chann->conn = conn;
 			xa_store(&sess->ksmbd_chann_list, (long)conn, chann, GFP_KERNEL);
+			if (conn->binding)
+				smb2_set_channel_affinity(sess);
 		}
 	}
 
@@ -2065,6 +2178,7 @@ int smb2_tree_disconnect(struct ksmbd_work *work)
 		return 0;
 	}
 
+	ksmbd_put_compound_fp(work);
 	ksmbd_close_tree_conn_fds(work);
 	ksmbd_tree_conn_disconnect(sess, tcon);
 	work->tcon = NULL;
@@ -2090,7 +2204,10 @@ int smb2_session_logoff(struct ksmbd_work *work)
 
 	/* setting CifsExiting here may race with start_tcp_sess */
 	ksmbd_conn_set_need_reconnect(work);
+	ksmbd_put_compound_fp(work);
 	ksmbd_close_session_fds(work);
+	/* the requests waited for may need the slot */
+	ksmbd_sched_work_done(work);
 	ksmbd_conn_wait_idle(conn);
 
 	if (ksmbd_tree_conn_session_logoff(sess)) {
@@ -2371,6 +2488,18 @@ static int smb2_create_truncate(const struct path *path)
 	return rc;
 }
 
+static void smb2_init_file_attrs(struct ksmbd_file *fp, struct kstat *stat,
+				 struct smb2_create_req *req)
+{
+	if (stat->result_mask & STATX_BTIME)
+		fp->create_time = ksmbd_UnixTimeToNT(stat->btime);
+	else
+		fp->create_time = ksmbd_UnixTimeToNT(stat->ctime);
+	if (req->FileAttributes || fp->f_ci->m_fattr == 0)
+		fp->f_ci->m_fattr =
+			cpu_to_le32(smb2_get_dos_mode(stat, le32_to_cpu(req->FileAttributes)));
+}
+
 static void smb2_new_xattrs(struct ksmbd_tree_connect *tcon, const struct path *path,
 			    struct ksmbd_file *fp)
 {
@@ -2555,6 +2684,7 @@ int smb2_open(struct ksmbd_work *work)
 	u64 time;
 	umode_t posix_mode = 0;
 	__le32 daccess, maximal_access = 0;
+	struct ksmbd_meta_batch meta_batch = {0};
 
 	WORK_BUFFERS(work, req, rsp);
 
@@ -2579,7 +2709,7 @@ int smb2_open(struct ksmbd_work *work)
 			goto err_out1;
 		}
 
-		name = smb2_get_name(share,
+		name = smb2_get_name(work,
 				     req->Buffer,
 				     le16_to_cpu(req->NameLength),
 				     work->conn->local_nls);
@@ -2614,11 +2744,12 @@ int smb2_open(struct ksmbd_work *work)
 			goto err_out1;
 		}
 	} else {
-		name = kstrdup("", GFP_KERNEL);
+		name = ksmbd_scratch_alloc(work, 1);
 		if (!name) {
 			rc = -ENOMEM;
 			goto err_out1;
 		}
+		name[0] = '\0';
 	}
 
 	req_op_level = req->RequestedOplockLevel;
@@ -2989,6 +3120,10 @@ int smb2_open(struct ksmbd_work *work)
 		int posix_acl_rc;
 		struct inode *inode = d_inode(path.dentry);
 
+		/* store the ntacl and dos attributes with one xattr write */
+		if (test_share_config_flag(share, KSMBD_SHARE_FLAG_META_XATTR))
+			ksmbd_vfs_meta_batch_begin(&meta_batch, path.dentry);
+
 		posix_acl_rc = ksmbd_vfs_inherit_posix_acl(user_ns,
 							   path.dentry,
 							   d_inode(path.dentry->d_parent));
@@ -3053,7 +3188,18 @@ int smb2_open(struct ksmbd_work *work)
 				}
 			}
 		}
-		rc = 0;
+
+		/*
+		 * Store the dos attributes along with the acl and write the
+		 * batch before the open is visible to other openers, which
+		 * would check access against a file without a descriptor.
+		 */
+		rc = ksmbd_vfs_getattr(&path, &stat);
+		if (rc)
+			goto err_out;
+		smb2_init_file_attrs(fp, &stat, req);
+		smb2_new_xattrs(tcon, &path, fp);
+		ksmbd_vfs_meta_batch_end(user_ns, &meta_batch);
 	}
 
 	if (stream_name) {
@@ -3172,18 +3318,10 @@ int smb2_open(struct ksmbd_work *work)
 	if (rc)
 		goto err_out;
 
-	if (stat.result_mask & STATX_BTIME)
-		fp->create_time = ksmbd_UnixTimeToNT(stat.btime);
-	else
-		fp->create_time = ksmbd_UnixTimeToNT(stat.ctime);
-	if (req->FileAttributes || fp->f_ci->m_fattr == 0)
-		fp->f_ci->m_fattr =
-			cpu_to_le32(smb2_get_dos_mode(&stat, le32_to_cpu(req->FileAttributes)));
-
-	if (!created)
+	if (!created) {
+		smb2_init_file_attrs(fp, &stat, req);
 		smb2_update_xattrs(tcon, &path, fp);
-	else
-		smb2_new_xattrs(tcon, &path, fp);
+	}
 
 	memcpy(fp->client_guid, conn->ClientGUID, SMB2_CLIENT_GUID_SIZE);
 
@@ -3294,7 +3432,12 @@ int smb2_open(struct ksmbd_work *work)
 			cpu_to_le32(offsetof(struct smb2_create_rsp, Buffer));
 	}
 
+	/* Save the file table lookups of the related commands that follow */
+	if (req->hdr.NextCommand)
+		ksmbd_set_compound_fp(work, fp);
+
 err_out:
+	ksmbd_vfs_meta_batch_end(user_ns, &meta_batch);
 	if (file_present || created)
 		path_put(&path);
 	ksmbd_revert_fsids(work);
@@ -3331,7 +3474,7 @@ err_out1:
 		ksmbd_debug(SMB, "Error response: %x\n", rsp->hdr.Status);
 	}
 
-	kfree(name);
+	ksmbd_scratch_free(work, name);
 	kfree(lc);
 
 	return 0;
@@ -3639,7 +3782,7 @@ free_conv_name:
 
 struct smb2_query_dir_private {
 	struct ksmbd_work	*work;
-	char			*search_pattern;
+	struct ksmbd_pattern	*search_pattern;
 	struct ksmbd_file	*dir_fp;
 
 	struct ksmbd_dir_info	*d_info;
@@ -3853,7 +3996,7 @@ static int __query_dir(struct dir_context *ctx, const char *name, int namlen,
 #else
 		return 0;
 #endif
-	if (!match_pattern(name, namlen, priv->search_pattern))
+	if (!ksmbd_match_pattern(priv->search_pattern, name, namlen))
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 1, 0)
 		return true;
 #else
@@ -3884,6 +4027,80 @@ static int __query_dir(struct dir_context *ctx, const char *name, int namlen,
 #endif
 }
 
+/*
+ * A single entry query for a name without wildcards is an existence probe.
+ * Resolve it with a lookup of the name rather than a walk of the directory.
+ *
+ * Return:	0 if the lookup answered the query, -EAGAIN if the directory
+ *		has to be walked, otherwise error
+ */
+static int smb2_query_dir_lookup(struct smb2_query_dir_private *priv)
+{
+	struct ksmbd_file *dir_fp = priv->dir_fp;
+	struct ksmbd_pattern *pattern = priv->search_pattern;
+	struct ksmbd_dir_info *d_info = priv->d_info;
+	struct user_namespace *user_ns = file_mnt_user_ns(dir_fp->filp);
+	struct dentry *dir = dir_fp->filp->f_path.dentry;
+	struct ksmbd_kstat ksmbd_kstat;
+	struct kstat kstat;
+	struct dentry *dent;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	struct name_snapshot name;
+	bool casefolded = IS_CASEFOLDED(d_inode(dir));
+#endif
+	int rc;
+
+	if (ksmbd_share_veto_filename(priv->work->tcon->share_conf,
+				      pattern->name))
+		return 0;
+
+	lock_dir(dir_fp);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	dent = lookup_one(user_ns, pattern->name, dir, pattern->len);
+#else
+	dent = lookup_one_len(pattern->name, dir, pattern->len);
+#endif
+	unlock_dir(dir_fp);
+	if (IS_ERR(dent))
+		return -EAGAIN;
+
+	if (d_is_negative(dent)) {
+		dput(dent);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+		/* the lookup of a casefolded directory is already caseless */
+		if (casefolded)
+			return 0;
+#endif
+		return -EAGAIN;
+	}
+
+	ksmbd_kstat.kstat = &kstat;
+	if (priv->info_level != FILE_NAMES_INFORMATION)
+		ksmbd_vfs_fill_dentry_attrs(priv->work, user_ns, dent,
+					    &ksmbd_kstat);
+
+	d_info->name = pattern->name;
+	d_info->name_len = pattern->len;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	/* return the name as stored rather than as it was asked for */
+	if (casefolded) {
+		take_dentry_name_snapshot(&name, dent);
+		d_info->name = name.name.name;
+		d_info->name_len = name.name.len;
+	}
+#endif
+	rc = smb2_populate_readdir_entry(priv->work->conn, priv->info_level,
+					 d_info, &ksmbd_kstat);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 2, 0)
+	if (casefolded)
+		release_dentry_name_snapshot(&name);
+#endif
+	dput(dent);
+	if (!rc)
+		dir_fp->search_done = true;
+	return rc;
+}
+
 static int verify_info_level(int info_level)
 {
 	switch (info_level) {
@@ -3902,12 +4119,59 @@ static int verify_info_level(int info_level)
 	return 0;
 }
 
+/*
+ * The compiled search pattern is cached on the directory handle so that
+ * continuation queries don't convert and compile it again. It is taken off
+ * the handle while in use so that concurrent queries never share the NFA
+ * scratch state of a pattern.
+ */
+static struct ksmbd_pattern *
+smb2_get_search_pattern(struct ksmbd_work *work, struct ksmbd_file *dir_fp,
+			struct smb2_query_directory_req *req)
+{
+	struct ksmbd_pattern *pattern;
+	unsigned int len = le16_to_cpu(req->FileNameLength);
+	char *srch_ptr;
+
+	spin_lock(&dir_fp->f_lock);
+	pattern = dir_fp->search_pattern;
+	dir_fp->search_pattern = NULL;
+	spin_unlock(&dir_fp->f_lock);
+
+	if (ksmbd_pattern_same(pattern, req->Buffer, len))
+		return pattern;
+	ksmbd_free_pattern(pattern);
+	dir_fp->search_done = false;
+
+	srch_ptr = smb_strndup_from_utf16(req->Buffer, len, 1,
+					  work->conn->local_nls);
+	if (IS_ERR(srch_ptr))
+		return ERR_CAST(srch_ptr);
+
+	pattern = ksmbd_compile_pattern(srch_ptr, req->Buffer, len);
+	kfree(srch_ptr);
+	return pattern;
+}
+
+static void smb2_put_search_pattern(struct ksmbd_file *dir_fp,
+				    struct ksmbd_pattern *pattern)
+{
+	spin_lock(&dir_fp->f_lock);
+	if (!dir_fp->search_pattern) {
+		dir_fp->search_pattern = pattern;
+		pattern = NULL;
+	}
+	spin_unlock(&dir_fp->f_lock);
+	ksmbd_free_pattern(pattern);
+}
+
 static int smb2_resp_buf_len(struct ksmbd_work *work, unsigned short hdr2_len)
 {
 	int free_len;
 
 	free_len = (int)(work->response_sz -
-		(get_rfc1002_len(work->response_buf) + 4)) - hdr2_len;
+		(get_rfc1002_len(work->response_buf) - work->aux_payload_sz +
+		 4)) - hdr2_len;
 	return free_len;
 }
 
@@ -3929,14 +4193,13 @@ static int smb2_calc_max_out_buf_len(struct ksmbd_work *work,
 
 int smb2_query_dir(struct ksmbd_work *work)
 {
-	struct ksmbd_conn *conn = work->conn;
 	struct smb2_query_directory_req *req;
 	struct smb2_query_directory_rsp *rsp;
 	struct ksmbd_share_config *share = work->tcon->share_conf;
 	struct ksmbd_file *dir_fp = NULL;
 	struct ksmbd_dir_info d_info;
 	int rc = 0;
-	char *srch_ptr = NULL;
+	struct ksmbd_pattern *srch_ptr = NULL;
 	unsigned char srch_flag;
 	int buffer_sz;
 	struct smb2_query_dir_private query_dir_private = {NULL, };
@@ -3982,20 +4245,20 @@ int smb2_query_dir(struct ksmbd_work *work)
 	}
 
 	srch_flag = req->Flags;
-	srch_ptr = smb_strndup_from_utf16(req->Buffer,
-					  le16_to_cpu(req->FileNameLength), 1,
-					  conn->local_nls);
+	srch_ptr = smb2_get_search_pattern(work, dir_fp, req);
 	if (IS_ERR(srch_ptr)) {
 		ksmbd_debug(SMB, "Search Pattern not found\n");
-		rc = -EINVAL;
+		rc = PTR_ERR(srch_ptr) == -ENOMEM ? -ENOMEM : -EINVAL;
+		srch_ptr = NULL;
 		goto err_out2;
 	} else {
-		ksmbd_debug(SMB, "Search pattern is %s\n", srch_ptr);
+		ksmbd_debug(SMB, "Search pattern is %s\n", srch_ptr->pattern);
 	}
 
 	if (srch_flag & SMB2_REOPEN || srch_flag & SMB2_RESTART_SCANS) {
 		ksmbd_debug(SMB, "Restart directory scan\n");
 		generic_file_llseek(dir_fp->filp, 0, SEEK_SET);
+		dir_fp->search_done = false;
 	}
 
 	memset(&d_info, 0, sizeof(struct ksmbd_dir_info));
@@ -4035,6 +4298,26 @@ int smb2_query_dir(struct ksmbd_work *work)
 	dir_fp->readdir_data.private		= &query_dir_private;
 	set_ctx_actor(&dir_fp->readdir_data.ctx, __query_dir);
 
+	/*
+	 * The only entry matching the literal pattern was returned by a
+	 * lookup which didn't move the directory position, don't iterate
+	 * the directory to return it again.
+	 */
+	if (dir_fp->search_done)
+		goto fill_rsp;
+
+	if (srch_flag & SMB2_RETURN_SINGLE_ENTRY && d_info.out_buf_len > 0 &&
+	    srch_ptr->type == KSMBD_PATTERN_LITERAL &&
+	    strcmp(srch_ptr->name, ".") && strcmp(srch_ptr->name, "..")) {
+		rc = smb2_query_dir_lookup(&query_dir_private);
+		if (rc == -ENOSPC)
+			goto no_buf_len;
+		else if (!rc)
+			goto fill_rsp;
+		else if (rc != -EAGAIN)
+			goto err_out;
+	}
+
 	rc = iterate_dir(dir_fp->filp, &dir_fp->readdir_data.ctx);
 	/*
 	 * req->OutputBufferLength is too small to contain even one entry.
@@ -4053,8 +4336,10 @@ int smb2_query_dir(struct ksmbd_work *work)
 	if (rc)
 		goto err_out;
 
+fill_rsp:
 	if (!d_info.data_count && d_info.out_buf_len >= 0) {
-		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY && !is_asterisk(srch_ptr)) {
+		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY &&
+		    !is_asterisk(srch_ptr->pattern)) {
 			rsp->hdr.Status = STATUS_NO_SUCH_FILE;
 		} else {
 			dir_fp->dot_dotdot[0] = dir_fp->dot_dotdot[1] = 0;
@@ -4079,14 +4364,13 @@ no_buf_len:
 		inc_rfc1001_len(work->response_buf, 8 + d_info.data_count);
 	}
 
-	kfree(srch_ptr);
+	smb2_put_search_pattern(dir_fp, srch_ptr);
 	ksmbd_fd_put(work, dir_fp);
 	ksmbd_revert_fsids(work);
 	return 0;
 
 err_out:
 	pr_err("error while processing smb2 query dir rc = %d\n", rc);
-	kfree(srch_ptr);
 
 err_out2:
 	if (rc == -EINVAL)
@@ -4107,6 +4391,8 @@ err_out2:
 		rsp->hdr.Status = STATUS_UNEXPECTED_IO_ERROR;
 
 	smb2_set_err_rsp(work);
+	if (srch_ptr)
+		smb2_put_search_pattern(dir_fp, srch_ptr);
 	ksmbd_fd_put(work, dir_fp);
 	ksmbd_revert_fsids(work);
 	return 0;
@@ -4228,8 +4514,10 @@ static int smb2_get_ea(struct ksmbd_work *work, struct ksmbd_file *fp,
 		       struct smb2_query_info_rsp *rsp, void *rsp_org)
 {
 	struct smb2_ea_info *eainfo, *prev_eainfo;
-	char *name, *ptr, *xattr_list = NULL, *buf;
-	int rc, name_len, value_len, xattr_list_len, idx;
+	struct ksmbd_xattr_snap *snap;
+	struct ksmbd_xattr_entry *ent;
+	char *name, *ptr, *buf;
+	int rc, name_len, value_len, i;
 	ssize_t buf_free_len, alignment_bytes, next_offset, rsp_data_cnt = 0;
 	struct smb2_ea_info_req *ea_req = NULL;
 	const struct path *path;
@@ -4263,35 +4551,23 @@ static int smb2_get_ea(struct ksmbd_work *work, struct ksmbd_file *fp,
 	if (buf_free_len < 0)
 		return -EINVAL;
 
-	rc = ksmbd_vfs_listxattr(path->dentry, &xattr_list);
-	if (rc < 0) {
+	/* only user.* xattrs other than the DOS attributes are listed */
+	snap = ksmbd_inode_xattrs_get(fp);
+	if (IS_ERR(snap)) {
 		rsp->hdr.Status = STATUS_INVALID_HANDLE;
-		goto out;
-	} else if (!rc) { /* there is no EA in the file */
-		ksmbd_debug(SMB, "no ea data in the file\n");
-		goto done;
+		return PTR_ERR(snap);
 	}
-	xattr_list_len = rc;
 
 	ptr = (char *)rsp->Buffer;
 	eainfo = (struct smb2_ea_info *)ptr;
 	prev_eainfo = eainfo;
-	idx = 0;
 
-	while (idx < xattr_list_len) {
-		name = xattr_list + idx;
+	for (i = 0; i < snap->nr; i++) {
+		ent = &snap->ents[i];
+		name = ent->name;
 		name_len = strlen(name);
 
 		ksmbd_debug(SMB, "%s, len %d\n", name, name_len);
-		idx += name_len + 1;
-
-		/*
-		 * CIFS does not support EA other than user.* namespace,
-		 * still keep the framework generic, to list other attrs
-		 * in future.
-		 */
-		if (strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN))
-			continue;
 
 		if (!strncmp(&name[XATTR_USER_PREFIX_LEN], STREAM_PREFIX,
 			     STREAM_PREFIX_LEN))
@@ -4302,20 +4578,20 @@ static int smb2_get_ea(struct ksmbd_work *work, struct ksmbd_file *fp,
 			    ea_req->EaNameLength))
 			continue;
 
-		if (!strncmp(&name[XATTR_USER_PREFIX_LEN],
-			     DOS_ATTRIBUTE_PREFIX, DOS_ATTRIBUTE_PREFIX_LEN))
-			continue;
-
-		if (!strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN))
-			name_len -= XATTR_USER_PREFIX_LEN;
+		name_len -= XATTR_USER_PREFIX_LEN;
 
 		ptr = (char *)(&eainfo->name + name_len + 1);
 		buf_free_len -= (offsetof(struct smb2_ea_info, name) +
 				name_len + 1);
 		/* bailout if xattr can't fit in buf_free_len */
-		value_len = ksmbd_vfs_getxattr(user_ns, path->dentry,
-					       name, &buf);
+		buf = NULL;
+		if (ent->value)
+			value_len = ent->value_len;
+		else
+			value_len = ksmbd_vfs_getxattr(user_ns, path->dentry,
+						       name, &buf);
 		if (value_len <= 0) {
+			kfree(buf);
 			rc = -ENOENT;
 			rsp->hdr.Status = STATUS_INVALID_HANDLE;
 			goto out;
@@ -4327,19 +4603,13 @@ static int smb2_get_ea(struct ksmbd_work *work, struct ksmbd_file *fp,
 			break;
 		}
 
-		memcpy(ptr, buf, value_len);
+		memcpy(ptr, buf ?: ent->value, value_len);
 		kfree(buf);
 
 		ptr += value_len;
 		eainfo->Flags = 0;
 		eainfo->EaNameLength = name_len;
-
-		if (!strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN))
-			memcpy(eainfo->name, &name[XATTR_USER_PREFIX_LEN],
-			       name_len);
-		else
-			memcpy(eainfo->name, name, name_len);
-
+		memcpy(eainfo->name, &name[XATTR_USER_PREFIX_LEN], name_len);
 		eainfo->name[name_len] = '\0';
 		eainfo->EaValueLength = cpu_to_le16(value_len);
 		next_offset = offsetof(struct smb2_ea_info, name) +
@@ -4366,14 +4636,13 @@ static int smb2_get_ea(struct ksmbd_work *work, struct ksmbd_file *fp,
 
 	/* no more ea entries */
 	prev_eainfo->NextEntryOffset = 0;
-done:
 	rc = 0;
 	if (rsp_data_cnt == 0)
 		rsp->hdr.Status = STATUS_NO_EAS_ON_FILE;
 	rsp->OutputBufferLength = cpu_to_le32(rsp_data_cnt);
 	inc_rfc1001_len(rsp_org, rsp_data_cnt);
 out:
-	kvfree(xattr_list);
+	ksmbd_vfs_put_xattr_snapshot(snap);
 	return rc;
 }
 
@@ -4500,7 +4769,7 @@ static int get_file_all_info(struct ksmbd_work *work,
 		return -EACCES;
 	}
 
-	filename = convert_to_nt_pathname(work->tcon->share_conf, &fp->filp->f_path);
+	filename = convert_to_nt_pathname(work, &fp->filp->f_path);
 	if (IS_ERR(filename))
 		return PTR_ERR(filename);
 
@@ -4544,21 +4813,27 @@ static int get_file_all_info(struct ksmbd_work *work,
 	file_info->FileNameLength = cpu_to_le32(conv_len);
 	rsp->OutputBufferLength =
 		cpu_to_le32(sizeof(struct smb2_file_all_info) + conv_len - 1);
-	kfree(filename);
+	ksmbd_scratch_free(work, filename);
 	inc_rfc1001_len(rsp_org, le32_to_cpu(rsp->OutputBufferLength));
 	return 0;
 }
 
-static void get_file_alternate_info(struct ksmbd_work *work,
-				    struct smb2_query_info_rsp *rsp,
-				    struct ksmbd_file *fp,
-				    void *rsp_org)
+static int get_file_alternate_info(struct ksmbd_work *work,
+				   struct smb2_query_info_rsp *rsp,
+				   struct ksmbd_file *fp,
+				   void *rsp_org)
 {
 	struct ksmbd_conn *conn = work->conn;
 	struct smb2_file_alt_name_info *file_info;
 	struct dentry *dentry = fp->filp->f_path.dentry;
 	int conv_len;
 
+	if (test_share_config_flag(work->tcon->share_conf,
+				   KSMBD_SHARE_FLAG_NO_SHORT_NAMES)) {
+		rsp->hdr.Status = STATUS_OBJECT_NAME_NOT_FOUND;
+		return -ENODATA;
+	}
+
 	spin_lock(&dentry->d_lock);
 	file_info = (struct smb2_file_alt_name_info *)rsp->Buffer;
 	conv_len = ksmbd_extract_shortname(conn,
@@ -4569,6 +4844,7 @@ static void get_file_alternate_info(struct ksmbd_work *work,
 	rsp->OutputBufferLength =
 		cpu_to_le32(sizeof(struct smb2_file_alt_name_info) + conv_len);
 	inc_rfc1001_len(rsp_org, le32_to_cpu(rsp->OutputBufferLength));
+	return 0;
 }
 
 static void get_file_stream_info(struct ksmbd_work *work,
@@ -4578,11 +4854,10 @@ static void get_file_stream_info(struct ksmbd_work *work,
 {
 	struct ksmbd_conn *conn = work->conn;
 	struct smb2_file_stream_info *file_info;
-	char *stream_name, *xattr_list = NULL, *stream_buf;
+	struct ksmbd_xattr_snap *snap = NULL;
+	char *stream_name, *stream_buf;
 	struct kstat stat;
-	const struct path *path = &fp->filp->f_path;
-	ssize_t xattr_list_len;
-	int nbytes = 0, streamlen, stream_name_len, next, idx = 0;
+	int nbytes = 0, streamlen, stream_name_len, next, i;
 	int buf_free_len;
 	struct smb2_query_info_req *req = ksmbd_req_buf_next(work);
 
@@ -4599,18 +4874,15 @@ static void get_file_stream_info(struct ksmbd_work *work,
 	if (buf_free_len < 0)
 		goto out;
 
-	xattr_list_len = ksmbd_vfs_listxattr(path->dentry, &xattr_list);
-	if (xattr_list_len < 0) {
-		goto out;
-	} else if (!xattr_list_len) {
-		ksmbd_debug(SMB, "empty xattr in the file\n");
+	snap = ksmbd_inode_xattrs_get(fp);
+	if (IS_ERR(snap)) {
+		snap = NULL;
 		goto out;
 	}
 
-	while (idx < xattr_list_len) {
-		stream_name = xattr_list + idx;
+	for (i = 0; i < snap->nr; i++) {
+		stream_name = snap->ents[i].name;
 		streamlen = strlen(stream_name);
-		idx += streamlen + 1;
 
 		ksmbd_debug(SMB, "%s, len %d\n", stream_name, streamlen);
 
@@ -4644,8 +4916,9 @@ static void get_file_stream_info(struct ksmbd_work *work,
 		streamlen *= 2;
 		kfree(stream_buf);
 		file_info->StreamNameLength = cpu_to_le32(streamlen);
-		file_info->StreamSize = cpu_to_le64(stream_name_len);
-		file_info->StreamAllocationSize = cpu_to_le64(stream_name_len);
+		file_info->StreamSize = cpu_to_le64(snap->ents[i].value_len);
+		file_info->StreamAllocationSize =
+			cpu_to_le64(snap->ents[i].value_len);
 
 		nbytes += next;
 		buf_free_len -= next;
@@ -4668,7 +4941,7 @@ out:
 
 	/* last entry offset should be 0 */
 	file_info->NextEntryOffset = 0;
-	kvfree(xattr_list);
+	ksmbd_vfs_put_xattr_snapshot(snap);
 
 	rsp->OutputBufferLength = cpu_to_le32(nbytes);
 	inc_rfc1001_len(rsp_org, nbytes);
@@ -4940,7 +5213,7 @@ static int smb2_get_info_file(struct ksmbd_work *work,
 		break;
 
 	case FILE_ALTERNATE_NAME_INFORMATION:
-		get_file_alternate_info(work, rsp, fp, work->response_buf);
+		rc = get_file_alternate_info(work, rsp, fp, work->response_buf);
 		file_infoclass_size = FILE_ALTERNATE_NAME_INFORMATION_SIZE;
 		break;
 
@@ -5411,7 +5684,6 @@ int smb2_close(struct ksmbd_work *work)
 	u64 sess_id;
 	struct smb2_close_req *req;
 	struct smb2_close_rsp *rsp;
-	struct ksmbd_conn *conn = work->conn;
 	struct ksmbd_file *fp;
 	struct inode *inode;
 	u64 time;
@@ -5430,7 +5702,7 @@ int smb2_close(struct ksmbd_work *work)
 		sess_id = work->compound_sid;
 
 	work->compound_sid = 0;
-	if (check_session_id(conn, sess_id)) {
+	if (check_session_id(work, sess_id)) {
 		work->compound_sid = sess_id;
 	} else {
 		rsp->hdr.Status = STATUS_USER_SESSION_DELETED;
@@ -5464,6 +5736,18 @@ int smb2_close(struct ksmbd_work *work)
 	}
 	ksmbd_debug(SMB, "volatile_id = %llu\n", volatile_id);
 
+	if (work->inline_exec) {
+		bool may_block = false;
+
+		fp = ksmbd_lookup_fd_fast(work, volatile_id);
+		if (fp) {
+			may_block = ksmbd_close_fd_may_block(fp);
+			ksmbd_fd_put(work, fp);
+		}
+		if (may_block)
+			return -EAGAIN;
+	}
+
 	rsp->StructureSize = cpu_to_le16(60);
 	rsp->Reserved = 0;
 
@@ -5499,6 +5783,8 @@ int smb2_close(struct ksmbd_work *work)
 		rsp->ChangeTime = 0;
 	}
 
+	if (work->compound_fp && work->compound_fp->volatile_id == volatile_id)
+		ksmbd_put_compound_fp(work);
 	err = ksmbd_close_fd(work, volatile_id);
 out:
 	if (err) {
@@ -5561,7 +5847,7 @@ static int smb2_rename(struct ksmbd_work *work,
 		goto out;
 	}
 
-	new_name = smb2_get_name(share,
+	new_name = smb2_get_name(work,
 				 file_info->FileName,
 				 le32_to_cpu(file_info->FileNameLength),
 				 local_nls);
@@ -5649,7 +5935,7 @@ static int smb2_rename(struct ksmbd_work *work,
 out:
 	kfree(pathname);
 	if (!IS_ERR(new_name))
-		kfree(new_name);
+		ksmbd_scratch_free(work, new_name);
 	return rc;
 }
 
@@ -5673,7 +5959,7 @@ static int smb2_create_link(struct ksmbd_work *work,
 	if (!pathname)
 		return -ENOMEM;
 
-	link_name = smb2_get_name(share,
+	link_name = smb2_get_name(work,
 				  file_info->FileName,
 				  le32_to_cpu(file_info->FileNameLength),
 				  local_nls);
@@ -5722,7 +6008,7 @@ static int smb2_create_link(struct ksmbd_work *work,
 		rc = -EINVAL;
 out:
 	if (!IS_ERR(link_name))
-		kfree(link_name);
+		ksmbd_scratch_free(work, link_name);
 	kfree(pathname);
 	return rc;
 }
@@ -6246,8 +6532,10 @@ static noinline int smb2_read_pipe(struct ksmbd_work *work)
 	int nbytes = 0, err;
 	u64 id;
 	struct ksmbd_rpc_command *rpc_resp;
-	struct smb2_read_req *req = smb2_get_msg(work->request_buf);
-	struct smb2_read_rsp *rsp = smb2_get_msg(work->response_buf);
+	struct smb2_read_req *req;
+	struct smb2_read_rsp *rsp;
+
+	WORK_BUFFERS(work, req, rsp);
 
 	id = req->VolatileFileId;
 
@@ -6259,20 +6547,13 @@ static noinline int smb2_read_pipe(struct ksmbd_work *work)
 			goto out;
 		}
 
-		work->aux_payload_buf =
-			kvmalloc(rpc_resp->payload_sz, GFP_KERNEL | __GFP_ZERO);
-		if (!work->aux_payload_buf) {
+		/* the payload is sent from the ipc response itself */
+		nbytes = rpc_resp->payload_sz;
+		if (ksmbd_work_add_payload(work, rpc_resp->payload, nbytes,
+					   rpc_resp)) {
 			err = -ENOMEM;
 			goto out;
 		}
-
-		memcpy(work->aux_payload_buf, rpc_resp->payload,
-		       rpc_resp->payload_sz);
-
-		nbytes = rpc_resp->payload_sz;
-		work->resp_hdr_sz = get_rfc1002_len(work->response_buf) + 4;
-		work->aux_payload_sz = nbytes;
-		kvfree(rpc_resp);
 	}
 
 	rsp->StructureSize = cpu_to_le16(17);
@@ -6281,7 +6562,6 @@ static noinline int smb2_read_pipe(struct ksmbd_work *work)
 	rsp->DataLength = cpu_to_le32(nbytes);
 	rsp->DataRemaining = 0;
 	rsp->Reserved2 = 0;
-	inc_rfc1001_len(work->response_buf, nbytes);
 	return 0;
 
 out:
@@ -6337,6 +6617,36 @@ static ssize_t smb2_read_rdma_channel(struct ksmbd_work *work,
 	return length;
 }
 
+/*
+ * Buffers pre-mapped by the RDMA transport are accounted by the transport,
+ * only allocated buffers are charged to the memory budget.
+ */
+static void *smb2_get_read_buf(struct ksmbd_work *work, size_t length,
+			       bool is_rdma_channel)
+{
+	void *buf = NULL;
+
+	if (is_rdma_channel) {
+		buf = ksmbd_conn_rdma_buf_alloc(work->conn, length);
+		if (buf)
+			return buf;
+	}
+
+	buf = kvmalloc(length, GFP_KERNEL | __GFP_ZERO);
+	if (buf)
+		ksmbd_work_charge_payload(work, length);
+	return buf;
+}
+
+static void smb2_put_read_buf(struct ksmbd_work *work, bool is_rdma_channel)
+{
+	if (is_rdma_channel)
+		ksmbd_conn_rdma_buf_free(work->conn, work->aux_payload_buf);
+	else
+		kvfree(work->aux_payload_buf);
+	work->aux_payload_buf = NULL;
+}
+
 /**
  * smb2_read() - handler for smb2 read from file
  * @work:	smb work containing read command buffer
@@ -6412,7 +6722,8 @@ int smb2_read(struct ksmbd_work *work)
 	ksmbd_debug(SMB, "filename %pD, offset %lld, len %zu\n",
 		    fp->filp, offset, length);
 
-	work->aux_payload_buf = kvmalloc(length, GFP_KERNEL | __GFP_ZERO);
+	work->aux_payload_buf = smb2_get_read_buf(work, length,
+						  is_rdma_channel);
 	if (!work->aux_payload_buf) {
 		err = -ENOMEM;
 		goto out;
@@ -6420,13 +6731,18 @@ int smb2_read(struct ksmbd_work *work)
 
 	nbytes = ksmbd_vfs_read(work, fp, length, &offset);
 	if (nbytes < 0) {
+		smb2_put_read_buf(work, is_rdma_channel);
 		err = nbytes;
+		/* not in the page cache, read it again from a worker */
+		if (err == -EAGAIN && work->inline_exec) {
+			ksmbd_fd_put(work, fp);
+			return err;
+		}
 		goto out;
 	}
 
 	if ((nbytes == 0 && length != 0) || nbytes < mincount) {
-		kvfree(work->aux_payload_buf);
-		work->aux_payload_buf = NULL;
+		smb2_put_read_buf(work, is_rdma_channel);
 		rsp->hdr.Status = STATUS_END_OF_FILE;
 		smb2_set_err_rsp(work);
 		ksmbd_fd_put(work, fp);
@@ -6441,8 +6757,7 @@ int smb2_read(struct ksmbd_work *work)
 		remain_bytes = smb2_read_rdma_channel(work, req,
 						      work->aux_payload_buf,
 						      nbytes);
-		kvfree(work->aux_payload_buf);
-		work->aux_payload_buf = NULL;
+		smb2_put_read_buf(work, is_rdma_channel);
 
 		nbytes = 0;
 		if (remain_bytes < 0) {
@@ -6458,9 +6773,15 @@ int smb2_read(struct ksmbd_work *work)
 	rsp->DataRemaining = cpu_to_le32(remain_bytes);
 	rsp->Reserved2 = 0;
 	inc_rfc1001_len(work->response_buf, 16);
-	work->resp_hdr_sz = get_rfc1002_len(work->response_buf) + 4;
-	work->aux_payload_sz = nbytes;
-	inc_rfc1001_len(work->response_buf, nbytes);
+	if (nbytes) {
+		err = ksmbd_work_add_payload(work, work->aux_payload_buf,
+					     nbytes, work->aux_payload_buf);
+		if (err) {
+			smb2_put_read_buf(work, is_rdma_channel);
+			goto out;
+		}
+		work->aux_payload_buf = NULL;
+	}
 	ksmbd_fd_put(work, fp);
 	return 0;
 
@@ -6552,6 +6873,83 @@ out:
 	return err;
 }
 
+static void smb2_set_write_rsp(struct ksmbd_work *work,
+			       struct smb2_write_rsp *rsp, ssize_t nbytes)
+{
+	rsp->StructureSize = cpu_to_le16(17);
+	rsp->DataOffset = 0;
+	rsp->Reserved = 0;
+	rsp->DataLength = cpu_to_le32(nbytes);
+	rsp->DataRemaining = 0;
+	rsp->Reserved2 = 0;
+	inc_rfc1001_len(work->response_buf, 16);
+}
+
+static void smb2_set_write_err_rsp(struct ksmbd_work *work,
+				   struct smb2_write_rsp *rsp, int err)
+{
+	if (err == -EAGAIN)
+		rsp->hdr.Status = STATUS_FILE_LOCK_CONFLICT;
+	else if (err == -ENOSPC || err == -EFBIG)
+		rsp->hdr.Status = STATUS_DISK_FULL;
+	else if (err == -ENOENT)
+		rsp->hdr.Status = STATUS_FILE_CLOSED;
+	else if (err == -EACCES)
+		rsp->hdr.Status = STATUS_ACCESS_DENIED;
+	else if (err == -ESHARE)
+		rsp->hdr.Status = STATUS_SHARING_VIOLATION;
+	else if (err == -EINVAL)
+		rsp->hdr.Status = STATUS_INVALID_PARAMETER;
+	else
+		rsp->hdr.Status = STATUS_INVALID_HANDLE;
+
+	smb2_set_err_rsp(work);
+}
+
+/**
+ * smb2_write_rdma_resume() - write the data pulled through RDMA read
+ * @work:	smb work containing write command buffer
+ *
+ * Continuation of smb2_write() once the asynchronous RDMA read has
+ * completed, called from the work queue.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb2_write_rdma_resume(struct ksmbd_work *work)
+{
+	struct smb2_write_req *req = smb2_get_msg(work->request_buf);
+	struct smb2_write_rsp *rsp = smb2_get_msg(work->response_buf);
+	struct ksmbd_file *fp = work->rdma_fp;
+	loff_t offset = le64_to_cpu(req->Offset);
+	size_t length = le32_to_cpu(req->RemainingBytes);
+	bool writethrough = le32_to_cpu(req->Flags) &
+			    SMB2_WRITEFLAG_WRITE_THROUGH;
+	ssize_t nbytes = 0;
+	int err = work->rdma_status;
+
+	if (!err)
+		err = ksmbd_vfs_write(work, fp, work->rdma_buf, length,
+				      &offset, writethrough, &nbytes);
+	ksmbd_conn_rdma_buf_free(work->conn, work->rdma_buf);
+	work->rdma_buf = NULL;
+	work->rdma_fp = NULL;
+
+	if (err < 0)
+		smb2_set_write_err_rsp(work, rsp, err);
+	else
+		smb2_set_write_rsp(work, rsp, nbytes);
+	ksmbd_fd_put(work, fp);
+	return err;
+}
+
+static void smb2_write_rdma_done(void *arg, int status)
+{
+	struct ksmbd_work *work = arg;
+
+	work->rdma_status = status;
+	ksmbd_queue_work(work);
+}
+
 static ssize_t smb2_write_rdma_channel(struct ksmbd_work *work,
 				       struct smb2_write_req *req,
 				       struct ksmbd_file *fp,
@@ -6560,22 +6958,42 @@ static ssize_t smb2_write_rdma_channel(struct ksmbd_work *work,
 	char *data_buf;
 	int ret;
 	ssize_t nbytes;
+	bool async;
 
-	data_buf = kvmalloc(length, GFP_KERNEL | __GFP_ZERO);
+	data_buf = ksmbd_conn_rdma_buf_alloc(work->conn, length);
 	if (!data_buf)
 		return -ENOMEM;
 
+	/*
+	 * Don't hold the worker while the data is pulled from the client
+	 * unless the write is part of a compound request, the rest of
+	 * the write is then done by smb2_write_rdma_resume().
+	 */
+	async = !work->next_smb2_rcv_hdr_off && !req->hdr.NextCommand;
+	if (async) {
+		work->rdma_fp = fp;
+		work->rdma_buf = data_buf;
+		work->resume_fn = smb2_write_rdma_resume;
+	}
+
 	ret = ksmbd_conn_rdma_read(work->conn, data_buf, length,
 				   (struct smb2_buffer_desc_v1 *)
 				   ((char *)req + le16_to_cpu(req->WriteChannelInfoOffset)),
-				   le16_to_cpu(req->WriteChannelInfoLength));
+				   le16_to_cpu(req->WriteChannelInfoLength),
+				   async ? smb2_write_rdma_done : NULL, work);
+	if (ret == -EINPROGRESS)
+		return ret;
+
+	work->resume_fn = NULL;
+	work->rdma_fp = NULL;
+	work->rdma_buf = NULL;
 	if (ret < 0) {
-		kvfree(data_buf);
+		ksmbd_conn_rdma_buf_free(work->conn, data_buf);
 		return ret;
 	}
 
 	ret = ksmbd_vfs_write(work, fp, data_buf, length, &offset, sync, &nbytes);
-	kvfree(data_buf);
+	ksmbd_conn_rdma_buf_free(work->conn, data_buf);
 	if (ret < 0)
 		return ret;
 
@@ -6686,39 +7104,21 @@ int smb2_write(struct ksmbd_work *work)
 		 */
 		nbytes = smb2_write_rdma_channel(work, req, fp, offset, length,
 						 writethrough);
+		/* fp reference is handed over to smb2_write_rdma_resume() */
+		if (nbytes == -EINPROGRESS)
+			return 0;
 		if (nbytes < 0) {
 			err = (int)nbytes;
 			goto out;
 		}
 	}
 
-	rsp->StructureSize = cpu_to_le16(17);
-	rsp->DataOffset = 0;
-	rsp->Reserved = 0;
-	rsp->DataLength = cpu_to_le32(nbytes);
-	rsp->DataRemaining = 0;
-	rsp->Reserved2 = 0;
-	inc_rfc1001_len(work->response_buf, 16);
+	smb2_set_write_rsp(work, rsp, nbytes);
 	ksmbd_fd_put(work, fp);
 	return 0;
 
 out:
-	if (err == -EAGAIN)
-		rsp->hdr.Status = STATUS_FILE_LOCK_CONFLICT;
-	else if (err == -ENOSPC || err == -EFBIG)
-		rsp->hdr.Status = STATUS_DISK_FULL;
-	else if (err == -ENOENT)
-		rsp->hdr.Status = STATUS_FILE_CLOSED;
-	else if (err == -EACCES)
-		rsp->hdr.Status = STATUS_ACCESS_DENIED;
-	else if (err == -ESHARE)
-		rsp->hdr.Status = STATUS_SHARING_VIOLATION;
-	else if (err == -EINVAL)
-		rsp->hdr.Status = STATUS_INVALID_PARAMETER;
-	else
-		rsp->hdr.Status = STATUS_INVALID_HANDLE;
-
-	smb2_set_err_rsp(work);
+	smb2_set_write_err_rsp(work, rsp, err);
 	ksmbd_fd_put(work, fp);
 	return err;
 }
@@ -7406,120 +7806,153 @@ out:
 	return ret;
 }
 
-static __be32 idev_ipv4_address(struct in_device *idev)
+static unsigned long long iface_link_speed(struct net_device *netdev)
 {
-	__be32 addr = 0;
+	struct ethtool_link_ksettings cmd;
 
-	struct in_ifaddr *ifa;
+	if (!netdev->ethtool_ops->get_link_ksettings ||
+	    __ethtool_get_link_ksettings(netdev, &cmd) ||
+	    cmd.base.speed == 0 || cmd.base.speed == SPEED_UNKNOWN) {
+		ksmbd_debug(SMB, "%s %s\n", netdev->name,
+			    "speed is unknown, defaulting to 1Gb/sec");
+		return SPEED_1000 * 1000000ULL;
+	}
+	return cmd.base.speed * 1000000ULL;
+}
 
-	rcu_read_lock();
-	in_dev_for_each_ifa_rcu(ifa, idev) {
-		if (ifa->ifa_flags & IFA_F_SECONDARY)
-			continue;
+static struct network_interface_info_ioctl_rsp *
+iface_info_entry(struct smb2_ioctl_rsp *rsp, unsigned int out_buf_len,
+		 int nbytes, struct net_device *netdev, __le32 capability,
+		 __le64 speed)
+{
+	struct network_interface_info_ioctl_rsp *nii_rsp;
 
-		addr = ifa->ifa_address;
-		break;
-	}
-	rcu_read_unlock();
-	return addr;
+	if (out_buf_len <
+	    nbytes + sizeof(struct network_interface_info_ioctl_rsp))
+		return ERR_PTR(-ENOSPC);
+
+	nii_rsp = (struct network_interface_info_ioctl_rsp *)
+			&rsp->Buffer[nbytes];
+	nii_rsp->Next =
+		cpu_to_le32(sizeof(struct network_interface_info_ioctl_rsp));
+	nii_rsp->IfIndex = cpu_to_le32(netdev->ifindex);
+	nii_rsp->Capability = capability;
+	nii_rsp->Reserved = 0;
+	nii_rsp->LinkSpeed = speed;
+	memset(nii_rsp->SockAddr_Storage, 0, 128);
+	return nii_rsp;
 }
 
+static bool conn_peer_is_loopback(struct ksmbd_conn *conn)
+{
+	struct sockaddr *sa = KSMBD_TCP_PEER_SOCKADDR(conn);
+
+	if (sa->sa_family == AF_INET)
+		return ipv4_is_loopback(((struct sockaddr_in *)sa)->sin_addr.s_addr);
+	if (sa->sa_family == AF_INET6)
+		return ipv6_addr_loopback(&((struct sockaddr_in6 *)sa)->sin6_addr);
+	return false;
+}
+
+/*
+ * Every usable address of a running interface is reported as its own
+ * entry, so that clients can open a channel per address. Loopback is
+ * only reported to clients which are connected over loopback.
+ */
 static int fsctl_query_iface_info_ioctl(struct ksmbd_conn *conn,
 					struct smb2_ioctl_rsp *rsp,
 					unsigned int out_buf_len)
 {
-	struct network_interface_info_ioctl_rsp *nii_rsp = NULL;
+	struct network_interface_info_ioctl_rsp *nii_rsp = NULL, *entry;
 	int nbytes = 0;
 	struct net_device *netdev;
 	struct sockaddr_storage_rsp *sockaddr_storage;
 	unsigned int flags;
-	unsigned long long speed;
+	bool peer_loopback = conn_peer_is_loopback(conn);
+	__le32 capability;
+	__le64 speed;
 
 	rtnl_lock();
 	for_each_netdev(&init_net, netdev) {
-		bool ipv4_set = false;
+		struct in_device *idev;
+		struct in_ifaddr *ifa;
+		struct inet6_dev *idev6;
+		struct inet6_ifaddr *ifa6;
 
-		if (netdev->type == ARPHRD_LOOPBACK)
+		if (netdev->type == ARPHRD_LOOPBACK && !peer_loopback)
 			continue;
 
 		flags = dev_get_flags(netdev);
 		if (!(flags & IFF_RUNNING))
 			continue;
-ipv6_retry:
-		if (out_buf_len <
-		    nbytes + sizeof(struct network_interface_info_ioctl_rsp)) {
-			rtnl_unlock();
-			return -ENOSPC;
-		}
-
-		nii_rsp = (struct network_interface_info_ioctl_rsp *)
-				&rsp->Buffer[nbytes];
-		nii_rsp->IfIndex = cpu_to_le32(netdev->ifindex);
 
-		nii_rsp->Capability = 0;
+		capability = 0;
 		if (netdev->real_num_tx_queues > 1)
-			nii_rsp->Capability |= cpu_to_le32(RSS_CAPABLE);
+			capability |= cpu_to_le32(RSS_CAPABLE);
 		if (ksmbd_rdma_capable_netdev(netdev))
-			nii_rsp->Capability |= cpu_to_le32(RDMA_CAPABLE);
-
-		nii_rsp->Next = cpu_to_le32(152);
-		nii_rsp->Reserved = 0;
-
-		if (netdev->ethtool_ops->get_link_ksettings) {
-			struct ethtool_link_ksettings cmd;
+			capability |= cpu_to_le32(RDMA_CAPABLE);
+		speed = cpu_to_le64(iface_link_speed(netdev));
+
+		idev = __in_dev_get_rtnl(netdev);
+		if (idev) {
+			rcu_read_lock();
+			in_dev_for_each_ifa_rcu(ifa, idev) {
+				entry = iface_info_entry(rsp, out_buf_len,
+							 nbytes, netdev,
+							 capability, speed);
+				if (IS_ERR(entry)) {
+					rcu_read_unlock();
+					rtnl_unlock();
+					return PTR_ERR(entry);
+				}
 
-			netdev->ethtool_ops->get_link_ksettings(netdev, &cmd);
-			speed = cmd.base.speed;
-		} else {
-			ksmbd_debug(SMB, "%s %s\n", netdev->name,
-				    "speed is unknown, defaulting to 1Gb/sec");
-			speed = SPEED_1000;
+				sockaddr_storage = (struct sockaddr_storage_rsp *)
+							entry->SockAddr_Storage;
+				sockaddr_storage->Family =
+					cpu_to_le16(INTERNETWORK);
+				sockaddr_storage->addr4.Port = 0;
+				sockaddr_storage->addr4.IPv4address =
+					ifa->ifa_address;
+				nbytes += sizeof(struct network_interface_info_ioctl_rsp);
+				nii_rsp = entry;
+			}
+			rcu_read_unlock();
 		}
 
-		speed *= 1000000;
-		nii_rsp->LinkSpeed = cpu_to_le64(speed);
-
-		sockaddr_storage = (struct sockaddr_storage_rsp *)
-					nii_rsp->SockAddr_Storage;
-		memset(sockaddr_storage, 0, 128);
-
-		if (!ipv4_set) {
-			struct in_device *idev;
-
-			sockaddr_storage->Family = cpu_to_le16(INTERNETWORK);
-			sockaddr_storage->addr4.Port = 0;
+		idev6 = __in6_dev_get(netdev);
+		if (!idev6)
+			continue;
 
-			idev = __in_dev_get_rtnl(netdev);
-			if (!idev)
+		read_lock_bh(&idev6->lock);
+		list_for_each_entry(ifa6, &idev6->addr_list, if_list) {
+			if (ifa6->flags & (IFA_F_TENTATIVE |
+					   IFA_F_DEPRECATED))
 				continue;
-			sockaddr_storage->addr4.IPv4address =
-						idev_ipv4_address(idev);
-			nbytes += sizeof(struct network_interface_info_ioctl_rsp);
-			ipv4_set = true;
-			goto ipv6_retry;
-		} else {
-			struct inet6_dev *idev6;
-			struct inet6_ifaddr *ifa;
-			__u8 *ipv6_addr = sockaddr_storage->addr6.IPv6address;
+			/* link-local addresses need a scope id */
+			if (ipv6_addr_type(&ifa6->addr) &
+			    IPV6_ADDR_LINKLOCAL)
+				continue;
+
+			entry = iface_info_entry(rsp, out_buf_len, nbytes,
+						 netdev, capability, speed);
+			if (IS_ERR(entry)) {
+				read_unlock_bh(&idev6->lock);
+				rtnl_unlock();
+				return PTR_ERR(entry);
+			}
 
+			sockaddr_storage = (struct sockaddr_storage_rsp *)
+						entry->SockAddr_Storage;
 			sockaddr_storage->Family = cpu_to_le16(INTERNETWORKV6);
 			sockaddr_storage->addr6.Port = 0;
 			sockaddr_storage->addr6.FlowInfo = 0;
-
-			idev6 = __in6_dev_get(netdev);
-			if (!idev6)
-				continue;
-
-			list_for_each_entry(ifa, &idev6->addr_list, if_list) {
-				if (ifa->flags & (IFA_F_TENTATIVE |
-							IFA_F_DEPRECATED))
-					continue;
-				memcpy(ipv6_addr, ifa->addr.s6_addr, 16);
-				break;
-			}
+			memcpy(sockaddr_storage->addr6.IPv6address,
+			       ifa6->addr.s6_addr, 16);
 			sockaddr_storage->addr6.ScopeId = 0;
 			nbytes += sizeof(struct network_interface_info_ioctl_rsp);
+			nii_rsp = entry;
 		}
+		read_unlock_bh(&idev6->lock);
 	}
 	rtnl_unlock();
 
@@ -8457,9 +8890,11 @@ void smb2_set_sign_rsp(struct ksmbd_work *work)
 	struct smb2_hdr *hdr;
 	struct smb2_hdr *req_hdr;
 	char signature[SMB2_HMACSHA256_SIZE];
-	struct kvec iov[2];
+	struct kvec iov_inline[3], *iov = iov_inline;
+	int nr_iov = ksmbd_work_nr_rsp_iov(work);
+	unsigned int off;
 	size_t len;
-	int n_vec = 1;
+	int n_vec;
 
 	hdr = smb2_get_msg(work->response_buf);
 	if (work->next_smb2_rsp_hdr_off)
@@ -8467,15 +8902,10 @@ void smb2_set_sign_rsp(struct ksmbd_work *work)
 
 	req_hdr = ksmbd_req_buf_next(work);
 
-	if (!work->next_smb2_rsp_hdr_off) {
-		len = get_rfc1002_len(work->response_buf);
-		if (req_hdr->NextCommand)
-			len = ALIGN(len, 8);
-	} else {
-		len = get_rfc1002_len(work->response_buf) -
-			work->next_smb2_rsp_hdr_off;
+	off = work->next_smb2_rsp_hdr_off + work->next_smb2_rsp_aux_off;
+	len = get_rfc1002_len(work->response_buf) - off;
+	if (work->next_smb2_rsp_hdr_off || req_hdr->NextCommand)
 		len = ALIGN(len, 8);
-	}
 
 	if (req_hdr->NextCommand)
 		hdr->NextCommand = cpu_to_le32(len);
@@ -8483,20 +8913,19 @@ void smb2_set_sign_rsp(struct ksmbd_work *work)
 	hdr->Flags |= SMB2_FLAGS_SIGNED;
 	memset(hdr->Signature, 0, SMB2_SIGNATURE_SIZE);
 
-	iov[0].iov_base = (char *)&hdr->ProtocolId;
-	iov[0].iov_len = len;
-
-	if (work->aux_payload_sz) {
-		iov[0].iov_len -= work->aux_payload_sz;
-
-		iov[1].iov_base = work->aux_payload_buf;
-		iov[1].iov_len = work->aux_payload_sz;
-		n_vec++;
+	if (nr_iov > ARRAY_SIZE(iov_inline)) {
+		iov = kmalloc_array(nr_iov, sizeof(*iov), GFP_KERNEL);
+		if (!iov)
+			return;
 	}
 
+	n_vec = ksmbd_work_rsp_iov(work, off + 4, len, iov, nr_iov);
 	if (!ksmbd_sign_smb2_pdu(work->conn, work->sess->sess_key, iov, n_vec,
 				 signature))
 		memcpy(hdr->Signature, signature, SMB2_SIGNATURE_SIZE);
+
+	if (iov != iov_inline)
+		kfree(iov);
 }
 
 /**
@@ -8570,8 +8999,10 @@ void smb3_set_sign_rsp(struct ksmbd_work *work)
 	struct smb2_hdr *req_hdr, *hdr;
 	struct channel *chann;
 	char signature[SMB2_CMACAES_SIZE];
-	struct kvec iov[2];
-	int n_vec = 1;
+	struct kvec iov_inline[3], *iov = iov_inline;
+	int nr_iov = ksmbd_work_nr_rsp_iov(work);
+	int n_vec;
+	unsigned int off;
 	size_t len;
 	char *signing_key;
 
@@ -8581,15 +9012,10 @@ void smb3_set_sign_rsp(struct ksmbd_work *work)
 
 	req_hdr = ksmbd_req_buf_next(work);
 
-	if (!work->next_smb2_rsp_hdr_off) {
-		len = get_rfc1002_len(work->response_buf);
-		if (req_hdr->NextCommand)
-			len = ALIGN(len, 8);
-	} else {
-		len = get_rfc1002_len(work->response_buf) -
-			work->next_smb2_rsp_hdr_off;
+	off = work->next_smb2_rsp_hdr_off + work->next_smb2_rsp_aux_off;
+	len = get_rfc1002_len(work->response_buf) - off;
+	if (work->next_smb2_rsp_hdr_off || req_hdr->NextCommand)
 		len = ALIGN(len, 8);
-	}
 
 	if (conn->binding == false &&
 	    le16_to_cpu(hdr->Command) == SMB2_SESSION_SETUP_HE) {
@@ -8610,17 +9036,19 @@ void smb3_set_sign_rsp(struct ksmbd_work *work)
 
 	hdr->Flags |= SMB2_FLAGS_SIGNED;
 	memset(hdr->Signature, 0, SMB2_SIGNATURE_SIZE);
-	iov[0].iov_base = (char *)&hdr->ProtocolId;
-	iov[0].iov_len = len;
-	if (work->aux_payload_sz) {
-		iov[0].iov_len -= work->aux_payload_sz;
-		iov[1].iov_base = work->aux_payload_buf;
-		iov[1].iov_len = work->aux_payload_sz;
-		n_vec++;
+
+	if (nr_iov > ARRAY_SIZE(iov_inline)) {
+		iov = kmalloc_array(nr_iov, sizeof(*iov), GFP_KERNEL);
+		if (!iov)
+			return;
 	}
 
+	n_vec = ksmbd_work_rsp_iov(work, off + 4, len, iov, nr_iov);
 	if (!ksmbd_sign_smb3_pdu(conn, signing_key, iov, n_vec, signature))
 		memcpy(hdr->Signature, signature, SMB2_SIGNATURE_SIZE);
+
+	if (iov != iov_inline)
+		kfree(iov);
 }
 
 /**
@@ -8687,43 +9115,34 @@ static void fill_transform_hdr(void *tr_buf, char *old_buf, __le16 cipher_type)
 int smb3_encrypt_resp(struct ksmbd_work *work)
 {
 	char *buf = work->response_buf;
-	struct kvec iov[3];
+	struct kvec iov_inline[4], *iov = iov_inline;
+	int nr_iov = ksmbd_work_nr_rsp_iov(work) + 1;
 	int rc = -ENOMEM;
-	int buf_size = 0, rq_nvec = 2 + (work->aux_payload_sz ? 1 : 0);
+	int rq_nvec;
 
-	if (ARRAY_SIZE(iov) < rq_nvec)
-		return -ENOMEM;
+	if (nr_iov > ARRAY_SIZE(iov_inline)) {
+		iov = kmalloc_array(nr_iov, sizeof(*iov), GFP_KERNEL);
+		if (!iov)
+			return rc;
+	}
 
 	work->tr_buf = kzalloc(sizeof(struct smb2_transform_hdr) + 4, GFP_KERNEL);
 	if (!work->tr_buf)
-		return rc;
+		goto out;
 
 	/* fill transform header */
 	fill_transform_hdr(work->tr_buf, buf, work->conn->cipher_type);
 
+	/* the message, payloads included, is encrypted in place */
 	iov[0].iov_base = work->tr_buf;
 	iov[0].iov_len = sizeof(struct smb2_transform_hdr) + 4;
-	buf_size += iov[0].iov_len - 4;
-
-	iov[1].iov_base = buf + 4;
-	iov[1].iov_len = get_rfc1002_len(buf);
-	if (work->aux_payload_sz) {
-		iov[1].iov_len = work->resp_hdr_sz - 4;
-
-		iov[2].iov_base = work->aux_payload_buf;
-		iov[2].iov_len = work->aux_payload_sz;
-		buf_size += iov[2].iov_len;
-	}
-	buf_size += iov[1].iov_len;
-	work->resp_hdr_sz = iov[1].iov_len;
+	rq_nvec = 1 + ksmbd_work_rsp_iov(work, 4, get_rfc1002_len(buf),
+					 &iov[1], nr_iov - 1);
 
 	rc = ksmbd_crypt_message(work, iov, rq_nvec, 1);
-	if (rc)
-		return rc;
-
-	memmove(buf, iov[1].iov_base, iov[1].iov_len);
-	*(__be32 *)work->tr_buf = cpu_to_be32(buf_size);
-
+out:
+	if (iov != iov_inline)
+		kfree(iov);
 	return rc;
 }
 
@@ -8770,8 +9189,13 @@ int smb3_decrypt_req(struct ksmbd_work *work)
 	if (rc)
 		return rc;
 
-	memmove(buf + 4, iov[1].iov_base, buf_data_size);
-	*(__be32 *)buf = cpu_to_be32(buf_data_size);
+	/*
+	 * Leave the plaintext where it is. The request now starts at the
+	 * tail of the transform header, which takes the RFC1002 length.
+	 */
+	work->request_alloc = buf;
+	work->request_buf = buf + sizeof(struct smb2_transform_hdr);
+	*(__be32 *)work->request_buf = cpu_to_be32(buf_data_size);
 
 	return rc;
 }
@@ -95,6 +95,8 @@
 
 /* SMB2 Max Credits */
 #define SMB2_MAX_CREDITS		8192
+/* Credits a client is left with while over the memory budget */
+#define SMB2_MEM_PRESSURE_CREDITS	16
 
 #define SMB2_CLIENT_GUID_SIZE		16
 #define SMB2_CREATE_GUID_SIZE		16
@@ -1652,6 +1654,7 @@ int smb2_allocate_rsp_buf(struct ksmbd_work *work);
 bool is_chained_smb2_message(struct ksmbd_work *work);
 int init_smb2_neg_rsp(struct ksmbd_work *work);
 void smb2_set_err_rsp(struct ksmbd_work *work);
+bool smb2_is_inline_req(struct ksmbd_work *work);
 int smb2_check_user_session(struct ksmbd_work *work);
 int smb2_get_ksmbd_tcon(struct ksmbd_work *work);
 bool smb2_is_sign_req(struct ksmbd_work *work, unsigned int command);
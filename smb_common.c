@@ -5,6 +5,7 @@
  */
 
 #include <linux/user_namespace.h>
+#include <asm/unaligned.h>
 
 #include "smb_common.h"
 #ifdef CONFIG_SMB_INSECURE_SERVER
@@ -356,7 +357,7 @@ bool ksmbd_pdu_size_has_room(unsigned int pdu)
 int ksmbd_populate_dot_dotdot_entries(struct ksmbd_work *work, int info_level,
 				      struct ksmbd_file *dir,
 				      struct ksmbd_dir_info *d_info,
-				      char *search_pattern,
+				      struct ksmbd_pattern *search_pattern,
 				      int (*fn)(struct ksmbd_conn *, int,
 						struct ksmbd_dir_info *,
 						struct ksmbd_kstat *))
@@ -381,8 +382,8 @@ int ksmbd_populate_dot_dotdot_entries(struct ksmbd_work *work, int info_level,
 				dentry = dir->filp->f_path.dentry->d_parent;
 			}
 
-			if (!match_pattern(d_info->name, d_info->name_len,
-					   search_pattern)) {
+			if (!ksmbd_match_pattern(search_pattern, d_info->name,
+						 d_info->name_len)) {
 				dir->dot_dotdot[i] = 1;
 				continue;
 			}
@@ -409,83 +410,83 @@ int ksmbd_populate_dot_dotdot_entries(struct ksmbd_work *work, int info_level,
 	return rc;
 }
 
+/*
+ * shortname_char() - map a long name byte to an 8.3 name character
+ *
+ * Upper cases ASCII letters and replaces anything that is not a valid
+ * OEM character of an 8.3 name with '_', the way Windows does.
+ */
+static inline char shortname_char(unsigned char c)
+{
+	if (c >= 0x80 || c <= 0x20 || strchr("\"*+,/:;<=>?[\\]|", c))
+		return '_';
+	return toupper(c);
+}
+
+static inline void put_shortname_char(char *shortname, int pos, char c)
+{
+	put_unaligned_le16(c, shortname + pos * 2);
+}
+
 /**
  * ksmbd_extract_shortname() - get shortname from long filename
  * @conn:	connection instance
  * @longname:	source long filename
- * @shortname:	destination short filename
+ * @shortname:	destination short filename, UTF-16LE
  *
- * Return:	shortname length or 0 when source long name is '.' or '..'
- * TODO: Though this function comforms the restriction of 8.3 Filename spec,
- * but the result is different with Windows 7's one. need to check.
+ * Builds the mangled name in a single pass over @longname and writes it
+ * as UTF-16 straight into @shortname. Every character of an 8.3 name is
+ * ASCII so no codepage conversion is needed. @shortname must have room
+ * for 12 UTF-16 characters.
+ *
+ * Return:	shortname length in bytes or 0 when source long name
+ *		starts with a dot
  */
 int ksmbd_extract_shortname(struct ksmbd_conn *conn, const char *longname,
 			    char *shortname)
 {
-	const char *p;
-	char base[9], extension[4];
-	char out[13] = {0};
-	int baselen = 0;
-	int extlen = 0, len = 0;
+	const unsigned char *p = (const unsigned char *)longname;
+	const unsigned char *ext = NULL;
 	unsigned int csum = 0;
-	const unsigned char *ptr;
-	bool dot_present = true;
+	int len = 0, baselen = 0, i;
 
-	p = longname;
-	if ((*p == '.') || (!(strcmp(p, "..")))) {
+	if (*p == '.') {
 		/*no mangling required */
 		return 0;
 	}
 
-	p = strrchr(longname, '.');
-	if (p == longname) { /*name starts with a dot*/
-		strscpy(extension, "___", strlen("___"));
-	} else {
-		if (p) {
-			p++;
-			while (*p && extlen < 3) {
-				if (*p != '.')
-					extension[extlen++] = toupper(*p);
-				p++;
-			}
-			extension[extlen] = '\0';
-		} else {
-			dot_present = false;
+	/*
+	 * The base is taken from the part before the last dot; characters
+	 * emitted past a dot are dropped again once a later dot shows up.
+	 */
+	for (; *p; p++) {
+		csum += *p;
+		if (*p == '.') {
+			ext = p + 1;
+			baselen = len;
+			continue;
 		}
+		if (len < 5)
+			put_shortname_char(shortname, len++,
+					   shortname_char(*p));
 	}
 
-	p = longname;
-	if (*p == '.') {
-		p++;
-		longname++;
-	}
-	while (*p && (baselen < 5)) {
-		if (*p != '.')
-			base[baselen++] = toupper(*p);
-		p++;
-	}
-
-	base[baselen] = MAGIC_CHAR;
-	memcpy(out, base, baselen + 1);
-
-	ptr = longname;
-	len = strlen(longname);
-	for (; len > 0; len--, ptr++)
-		csum += *ptr;
+	if (ext)
+		len = baselen;
 
 	csum = csum % (MANGLE_BASE * MANGLE_BASE);
-	out[baselen + 1] = mangle(csum / MANGLE_BASE);
-	out[baselen + 2] = mangle(csum);
-	out[baselen + 3] = PERIOD;
+	put_shortname_char(shortname, len++, MAGIC_CHAR);
+	put_shortname_char(shortname, len++, mangle(csum / MANGLE_BASE));
+	put_shortname_char(shortname, len++, mangle(csum));
+
+	if (ext && *ext) {
+		put_shortname_char(shortname, len++, PERIOD);
+		for (i = 0; ext[i] && i < 3; i++)
+			put_shortname_char(shortname, len++,
+					   shortname_char(ext[i]));
+	}
 
-	if (dot_present)
-		memcpy(&out[baselen + 4], extension, 4);
-	else
-		out[baselen + 4] = '\0';
-	smbConvertToUTF16((__le16 *)shortname, out, PATH_MAX,
-			  conn->local_nls, 0);
-	len = strlen(out) * 2;
-	return len;
+	return len * 2;
 }
 
 static int __smb2_negotiate(struct ksmbd_conn *conn)
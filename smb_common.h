@@ -467,6 +467,7 @@ struct smb_version_ops {
 	int (*set_rsp_credits)(struct ksmbd_work *work);
 	int (*check_user_session)(struct ksmbd_work *work);
 	int (*get_ksmbd_tcon)(struct ksmbd_work *work);
+	bool (*is_inline_req)(struct ksmbd_work *work);
 	bool (*is_sign_req)(struct ksmbd_work *work, unsigned int command);
 	int (*check_sign_req)(struct ksmbd_work *work);
 	void (*set_sign_rsp)(struct ksmbd_work *work);
@@ -496,11 +497,12 @@ int ksmbd_init_smb_server(struct ksmbd_work *work);
 bool ksmbd_pdu_size_has_room(unsigned int pdu);
 
 struct ksmbd_kstat;
+struct ksmbd_pattern;
 int ksmbd_populate_dot_dotdot_entries(struct ksmbd_work *work,
 				      int info_level,
 				      struct ksmbd_file *dir,
 				      struct ksmbd_dir_info *d_info,
-				      char *search_pattern,
+				      struct ksmbd_pattern *search_pattern,
 				      int (*fn)(struct ksmbd_conn *,
 						int,
 						struct ksmbd_dir_info *,
@@ -10,6 +10,10 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/hash.h>
+#include <linux/iversion.h>
+#include <linux/refcount.h>
+#include <linux/sysfs.h>
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 17, 0)
 #include <linux/mnt_idmapping.h>
 #endif
@@ -1034,26 +1038,196 @@ static void smb_set_ace(struct smb_ace *ace, const struct smb_sid *sid, u8 type,
 	ace->size = cpu_to_le16(1 + 1 + 2 + 4 + 1 + 1 + 6 + (sid->num_subauth * 4));
 }
 
-int smb_inherit_dacl(struct ksmbd_conn *conn,
-		     const struct path *path,
-		     unsigned int uid, unsigned int gid)
+/*
+ * Cache of the security descriptors inherited from a directory. Building
+ * one needs the decoded and verified descriptor of the parent, which is
+ * the expensive part of creating a file on a share with acls. The result
+ * only depends on the parent descriptor, on whether a file or a directory
+ * is created and, if the parent has CREATOR OWNER or CREATOR GROUP ACEs,
+ * on the owner and group of the new object.
+ *
+ * Descriptor changes made by ksmbd drop the entries of the directory and
+ * bump the generation, so that a descriptor built from the old one while
+ * the change was made is not stored. The change time of a directory
+ * can't be used to detect changes made by other programs, since it
+ * moves with every create. Entries expire after a few seconds instead.
+ * A descriptor built in the same tick as the last change of the directory
+ * is not stored, as a change made by another program in that tick may not
+ * have been seen by the build.
+ */
+#define INHERIT_CACHE_BITS	8
+#define INHERIT_CACHE_TTL	(5 * HZ)
+
+struct ksmbd_inherit_sd {
+	refcount_t		refcount;
+	int			rc;
+	int			size;
+	char			sd[];
+};
+
+struct ksmbd_inherit_entry {
+	struct vfsmount		*mnt;
+	struct inode		*dir;
+	unsigned long		ino;
+	bool			is_dir;
+	bool			per_owner;
+	unsigned int		uid;
+	unsigned int		gid;
+	unsigned long		stamp;
+	struct ksmbd_inherit_sd	*isd;
+};
+
+static struct ksmbd_inherit_entry inherit_cache[1 << INHERIT_CACHE_BITS];
+static DEFINE_SPINLOCK(inherit_cache_lock);
+/* bumped by every invalidation, protected by inherit_cache_lock */
+static unsigned long inherit_cache_gen;
+
+static struct {
+	atomic64_t	hits;
+	atomic64_t	misses;
+} inherit_cache_stats;
+
+static void inherit_sd_put(struct ksmbd_inherit_sd *isd)
+{
+	if (isd && refcount_dec_and_test(&isd->refcount))
+		kfree(isd);
+}
+
+static struct ksmbd_inherit_entry *inherit_cache_slot(struct inode *dir,
+						      bool is_dir)
+{
+	return &inherit_cache[hash_long((unsigned long)dir + is_dir,
+					INHERIT_CACHE_BITS)];
+}
+
+/*
+ * On a miss, *pgen is set to the generation the descriptor about to be
+ * built must be stored with.
+ */
+static struct ksmbd_inherit_sd *inherit_cache_lookup(const struct path *parent,
+						     bool is_dir,
+						     unsigned int uid,
+						     unsigned int gid,
+						     unsigned long *pgen)
+{
+	struct inode *dir = d_inode(parent->dentry);
+	struct ksmbd_inherit_entry *e = inherit_cache_slot(dir, is_dir);
+	struct ksmbd_inherit_sd *isd = NULL;
+
+	spin_lock(&inherit_cache_lock);
+	*pgen = inherit_cache_gen;
+	if (e->isd && e->dir == dir && e->mnt == parent->mnt &&
+	    e->ino == dir->i_ino && e->is_dir == is_dir &&
+	    (!e->per_owner || (e->uid == uid && e->gid == gid)) &&
+	    time_before(jiffies, e->stamp + INHERIT_CACHE_TTL)) {
+		isd = e->isd;
+		refcount_inc(&isd->refcount);
+	}
+	spin_unlock(&inherit_cache_lock);
+
+	if (isd)
+		atomic64_inc(&inherit_cache_stats.hits);
+	else
+		atomic64_inc(&inherit_cache_stats.misses);
+	return isd;
+}
+
+static void inherit_cache_store(const struct path *parent, bool is_dir,
+				unsigned int uid, unsigned int gid,
+				bool per_owner, struct ksmbd_inherit_sd *isd,
+				unsigned long gen)
+{
+	struct inode *dir = d_inode(parent->dentry);
+	struct ksmbd_inherit_entry *e = inherit_cache_slot(dir, is_dir);
+	struct ksmbd_inherit_sd *old;
+
+	spin_lock(&inherit_cache_lock);
+	if (gen != inherit_cache_gen) {
+		/* a descriptor changed while this one was built */
+		spin_unlock(&inherit_cache_lock);
+		return;
+	}
+	refcount_inc(&isd->refcount);
+	old = e->isd;
+	e->mnt = parent->mnt;
+	e->dir = dir;
+	e->ino = dir->i_ino;
+	e->is_dir = is_dir;
+	e->per_owner = per_owner;
+	e->uid = uid;
+	e->gid = gid;
+	e->stamp = jiffies;
+	e->isd = isd;
+	spin_unlock(&inherit_cache_lock);
+	inherit_sd_put(old);
+}
+
+static void inherit_cache_invalidate(struct inode *inode)
+{
+	struct ksmbd_inherit_sd *isd;
+	int i;
+
+	spin_lock(&inherit_cache_lock);
+	inherit_cache_gen++;
+	spin_unlock(&inherit_cache_lock);
+
+	for (i = 0; i < ARRAY_SIZE(inherit_cache); i++) {
+		spin_lock(&inherit_cache_lock);
+		isd = NULL;
+		if (inherit_cache[i].dir == inode) {
+			isd = inherit_cache[i].isd;
+			inherit_cache[i].isd = NULL;
+			inherit_cache[i].dir = NULL;
+		}
+		spin_unlock(&inherit_cache_lock);
+		inherit_sd_put(isd);
+	}
+}
+
+void ksmbd_acl_cache_destroy(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(inherit_cache); i++) {
+		inherit_sd_put(inherit_cache[i].isd);
+		inherit_cache[i].isd = NULL;
+		inherit_cache[i].dir = NULL;
+	}
+}
+
+/*
+ * Build the descriptor a new object inherits from its parent directory.
+ * *pper_owner is set if it depends on @uid and @gid.
+ */
+static struct ksmbd_inherit_sd *smb_build_inherited_sd(struct ksmbd_conn *conn,
+						       struct user_namespace *user_ns,
+						       struct dentry *parent,
+						       bool is_dir,
+						       unsigned int uid,
+						       unsigned int gid,
+						       bool *pper_owner)
 {
 	const struct smb_sid *psid, *creator = NULL;
 	struct smb_ace *parent_aces, *aces;
 	struct smb_acl *parent_pdacl;
 	struct smb_ntsd *parent_pntsd = NULL;
 	struct smb_sid owner_sid, group_sid;
-	struct dentry *parent = path->dentry->d_parent;
-	struct user_namespace *user_ns = mnt_user_ns(path->mnt);
+	struct ksmbd_inherit_sd *isd = NULL;
 	int inherited_flags = 0, flags = 0, i, ace_cnt = 0, nt_size = 0, pdacl_size;
 	int rc = 0, num_aces, dacloffset, pntsd_type, pntsd_size, acl_len, aces_size;
 	char *aces_base;
-	bool is_dir = S_ISDIR(d_inode(path->dentry)->i_mode);
 
+	*pper_owner = false;
 	pntsd_size = ksmbd_vfs_get_sd_xattr(conn, user_ns,
 					    parent, &parent_pntsd);
-	if (pntsd_size <= 0)
-		return -ENOENT;
+	if (pntsd_size <= 0) {
+		/* other errors may be transient and are not cached */
+		if (!pntsd_size || pntsd_size == -ENODATA)
+			rc = -ENOENT;
+		else
+			rc = pntsd_size;
+		goto out;
+	}
 	dacloffset = le32_to_cpu(parent_pntsd->dacloffset);
 	if (!dacloffset || (dacloffset + sizeof(struct smb_acl) > pntsd_size)) {
 		rc = -EINVAL;
@@ -1114,10 +1288,12 @@ int smb_inherit_dacl(struct ksmbd_conn *conn,
 			creator = &creator_owner;
 			id_to_sid(uid, SIDOWNER, &owner_sid);
 			psid = &owner_sid;
+			*pper_owner = true;
 		} else if (!compare_sids(&creator_group, &parent_aces->sid)) {
 			creator = &creator_group;
 			id_to_sid(gid, SIDUNIX_GROUP, &group_sid);
 			psid = &group_sid;
+			*pper_owner = true;
 		} else {
 			creator = NULL;
 			psid = &parent_aces->sid;
@@ -1161,13 +1337,15 @@ pass:
 			pgroup_sid_size = 1 + 1 + 6 + (pgroup_sid->num_subauth * 4);
 		}
 
-		pntsd = kzalloc(sizeof(struct smb_ntsd) + powner_sid_size +
-				pgroup_sid_size + sizeof(struct smb_acl) +
-				nt_size, GFP_KERNEL);
-		if (!pntsd) {
+		isd = kzalloc(sizeof(struct ksmbd_inherit_sd) +
+			      sizeof(struct smb_ntsd) + powner_sid_size +
+			      pgroup_sid_size + sizeof(struct smb_acl) +
+			      nt_size, GFP_KERNEL);
+		if (!isd) {
 			rc = -ENOMEM;
 			goto free_aces_base;
 		}
+		pntsd = (struct smb_ntsd *)isd->sd;
 
 		pntsd->revision = cpu_to_le16(1);
 		pntsd->type = cpu_to_le16(SELF_RELATIVE | DACL_PRESENT);
@@ -1203,16 +1381,69 @@ pass:
 			memcpy(pace, aces_base, nt_size);
 			pntsd_size += sizeof(struct smb_acl) + nt_size;
 		}
-
-		ksmbd_vfs_set_sd_xattr(conn, user_ns,
-				       path->dentry, pntsd, pntsd_size);
-		kfree(pntsd);
+		isd->size = pntsd_size;
 	}
 
 free_aces_base:
 	kfree(aces_base);
 free_parent_pntsd:
 	kfree(parent_pntsd);
+out:
+	if (rc == -ENOMEM)
+		return ERR_PTR(rc);
+	if (!isd) {
+		/* nothing inheritable or no valid parent descriptor */
+		isd = kzalloc(sizeof(struct ksmbd_inherit_sd), GFP_KERNEL);
+		if (!isd)
+			return ERR_PTR(-ENOMEM);
+	}
+	refcount_set(&isd->refcount, 1);
+	isd->rc = rc;
+	return isd;
+}
+
+int smb_inherit_dacl(struct ksmbd_conn *conn,
+		     const struct path *path,
+		     unsigned int uid, unsigned int gid)
+{
+	struct dentry *parent = path->dentry->d_parent;
+	struct user_namespace *user_ns = mnt_user_ns(path->mnt);
+	struct path parent_path = { .mnt = path->mnt, .dentry = parent };
+	bool is_dir = S_ISDIR(d_inode(path->dentry)->i_mode);
+	struct ksmbd_inherit_sd *isd;
+	struct smb_ntsd *pntsd;
+	struct timespec64 ctime, now;
+	unsigned long gen;
+	bool per_owner;
+	int rc;
+
+	isd = inherit_cache_lookup(&parent_path, is_dir, uid, gid, &gen);
+	if (!isd) {
+		ctime = d_inode(parent)->i_ctime;
+		isd = smb_build_inherited_sd(conn, user_ns, parent, is_dir,
+					     uid, gid, &per_owner);
+		if (IS_ERR(isd))
+			return PTR_ERR(isd);
+		now = current_time(d_inode(parent));
+		if ((!isd->rc || isd->rc == -ENOENT) &&
+		    !timespec64_equal(&ctime, &now))
+			inherit_cache_store(&parent_path, is_dir, uid, gid,
+					    per_owner, isd, gen);
+	}
+
+	rc = isd->rc;
+	if (!rc && isd->size) {
+		/* ksmbd_vfs_set_sd_xattr() rewrites the offsets in place */
+		pntsd = kmemdup(isd->sd, isd->size, GFP_KERNEL);
+		if (pntsd) {
+			ksmbd_vfs_set_sd_xattr(conn, user_ns,
+					       path->dentry, pntsd, isd->size);
+			kfree(pntsd);
+		} else {
+			rc = -ENOMEM;
+		}
+	}
+	inherit_sd_put(isd);
 	return rc;
 }
 
@@ -1229,8 +1460,115 @@ bool smb_inherit_flags(int flags, bool is_dir)
 	return false;
 }
 
-int smb_check_perm_dacl(struct ksmbd_conn *conn, const struct path *path,
-			__le32 *pdaccess, int uid)
+/*
+ * Cache of access check results. Opening the same files again and again
+ * is common, so the result of smb_check_perm_dacl() is remembered for
+ * (inode, user, desired access). An entry is valid as long as the change
+ * time and, where the filesystem maintains it, the i_version of the inode
+ * are unchanged, which covers updates of the security descriptor and of
+ * the posix acls done by other programs. Without i_version, a result
+ * computed in the same tick as the last change is not stored, as a later
+ * change in that tick would not move the change time. ksmbd also drops
+ * the entries of an inode whenever it stores a new descriptor.
+ */
+#define ACCESS_CACHE_BITS	10
+
+struct ksmbd_access_entry {
+	struct vfsmount		*mnt;
+	struct inode		*inode;
+	unsigned long		ino;
+	struct timespec64	ctime;
+	u64			iversion;
+	int			uid;
+	__le32			daccess;
+	__le32			granted;
+	int			rc;
+};
+
+static struct ksmbd_access_entry access_cache[1 << ACCESS_CACHE_BITS];
+static DEFINE_SPINLOCK(access_cache_lock);
+
+static struct {
+	atomic64_t	hits;
+	atomic64_t	misses;
+	atomic64_t	invalidations;
+} access_cache_stats;
+
+static struct ksmbd_access_entry *access_cache_slot(const struct path *path,
+						    int uid, __le32 daccess)
+{
+	unsigned long key;
+
+	key = (unsigned long)d_inode(path->dentry) ^ (unsigned long)path->mnt;
+	key ^= hash_32(uid ^ le32_to_cpu(daccess), 32);
+	return &access_cache[hash_long(key, ACCESS_CACHE_BITS)];
+}
+
+static bool access_cache_lookup(const struct path *path, int uid,
+				__le32 *pdaccess, int *rc)
+{
+	struct inode *inode = d_inode(path->dentry);
+	struct ksmbd_access_entry *e;
+	bool hit;
+
+	e = access_cache_slot(path, uid, *pdaccess);
+	spin_lock(&access_cache_lock);
+	hit = e->inode == inode && e->mnt == path->mnt &&
+		e->ino == inode->i_ino && e->uid == uid &&
+		e->daccess == *pdaccess &&
+		timespec64_equal(&e->ctime, &inode->i_ctime) &&
+		(!IS_I_VERSION(inode) ||
+		 e->iversion == inode_query_iversion(inode));
+	if (hit) {
+		*pdaccess = e->granted;
+		*rc = e->rc;
+	}
+	spin_unlock(&access_cache_lock);
+
+	if (hit)
+		atomic64_inc(&access_cache_stats.hits);
+	else
+		atomic64_inc(&access_cache_stats.misses);
+	return hit;
+}
+
+static void access_cache_store(const struct path *path, int uid,
+			       __le32 daccess, __le32 granted, int rc,
+			       struct timespec64 *ctime, u64 iversion)
+{
+	struct inode *inode = d_inode(path->dentry);
+	struct ksmbd_access_entry *e;
+
+	e = access_cache_slot(path, uid, daccess);
+	spin_lock(&access_cache_lock);
+	e->mnt = path->mnt;
+	e->inode = inode;
+	e->ino = inode->i_ino;
+	e->ctime = *ctime;
+	e->iversion = iversion;
+	e->uid = uid;
+	e->daccess = daccess;
+	e->granted = granted;
+	e->rc = rc;
+	spin_unlock(&access_cache_lock);
+}
+
+static void access_cache_invalidate(struct inode *inode)
+{
+	int i;
+
+	spin_lock(&access_cache_lock);
+	for (i = 0; i < ARRAY_SIZE(access_cache); i++) {
+		if (access_cache[i].inode == inode)
+			access_cache[i].inode = NULL;
+	}
+	spin_unlock(&access_cache_lock);
+	atomic64_inc(&access_cache_stats.invalidations);
+}
+
+static int __smb_check_perm_dacl(struct ksmbd_conn *conn,
+				 const struct path *path,
+				 __le32 *pdaccess, int uid)
 {
 	struct user_namespace *user_ns = mnt_user_ns(path->mnt);
 	struct smb_ntsd *pntsd = NULL;
@@ -1399,6 +1737,55 @@ err_out:
 	return rc;
 }
 
+/**
+ * ksmbd_acl_cache_invalidate() - forget cached acl decisions of an inode
+ * @inode:	inode whose security descriptor changed
+ */
+void ksmbd_acl_cache_invalidate(struct inode *inode)
+{
+	access_cache_invalidate(inode);
+	if (S_ISDIR(inode->i_mode))
+		inherit_cache_invalidate(inode);
+}
+
+int ksmbd_acl_cache_stats_show(char *buf)
+{
+	return sysfs_emit(buf,
+			  "access hits: %lld misses: %lld invalidations: %lld\n"
+			  "inherit hits: %lld misses: %lld\n",
+			  atomic64_read(&access_cache_stats.hits),
+			  atomic64_read(&access_cache_stats.misses),
+			  atomic64_read(&access_cache_stats.invalidations),
+			  atomic64_read(&inherit_cache_stats.hits),
+			  atomic64_read(&inherit_cache_stats.misses));
+}
+
+int smb_check_perm_dacl(struct ksmbd_conn *conn, const struct path *path,
+			__le32 *pdaccess, int uid)
+{
+	struct inode *inode = d_inode(path->dentry);
+	struct timespec64 ctime = inode->i_ctime, now;
+	__le32 daccess = *pdaccess;
+	u64 iversion = 0;
+	int rc;
+
+	if (access_cache_lookup(path, uid, pdaccess, &rc))
+		return rc;
+
+	if (IS_I_VERSION(inode))
+		iversion = inode_query_iversion(inode);
+	rc = __smb_check_perm_dacl(conn, path, pdaccess, uid);
+	/* errors other than a denial may be transient */
+	if (rc && rc != -EACCES)
+		return rc;
+
+	now = current_time(inode);
+	if (IS_I_VERSION(inode) || !timespec64_equal(&ctime, &now))
+		access_cache_store(path, uid, daccess, *pdaccess, rc, &ctime,
+				   iversion);
+	return rc;
+}
+
 int set_info_sec(struct ksmbd_conn *conn, struct ksmbd_tree_connect *tcon,
 		 const struct path *path, struct smb_ntsd *pntsd, int ntsd_len,
 		 bool type_check)
@@ -1486,6 +1873,7 @@ int set_info_sec(struct ksmbd_conn *conn, struct ksmbd_tree_connect *tcon,
 		ksmbd_vfs_remove_sd_xattrs(user_ns, path->dentry);
 		ksmbd_vfs_set_sd_xattr(conn, user_ns,
 				       path->dentry, pntsd, ntsd_len);
+		ksmbd_acl_cache_invalidate(inode);
 	}
 
 out:
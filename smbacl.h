@@ -208,6 +208,9 @@ int smb_inherit_dacl(struct ksmbd_conn *conn, const struct path *path,
 		     unsigned int uid, unsigned int gid);
 int smb_check_perm_dacl(struct ksmbd_conn *conn, const struct path *path,
 			__le32 *pdaccess, int uid);
+void ksmbd_acl_cache_invalidate(struct inode *inode);
+int ksmbd_acl_cache_stats_show(char *buf);
+void ksmbd_acl_cache_destroy(void);
 int set_info_sec(struct ksmbd_conn *conn, struct ksmbd_tree_connect *tcon,
 		 const struct path *path, struct smb_ntsd *pntsd, int ntsd_len,
 		 bool type_check);
@@ -14,6 +14,8 @@
 #include <linux/mempool.h>
 #include <linux/highmem.h>
 #include <linux/scatterlist.h>
+#include <linux/xarray.h>
+#include <linux/sysfs.h>
 #include <rdma/ib_verbs.h>
 #include <rdma/rdma_cm.h>
 #include <rdma/rw.h>
@@ -32,15 +34,26 @@
 /* SMB_DIRECT negotiation timeout in seconds */
 #define SMB_DIRECT_NEGOTIATE_TIMEOUT		120
 
-#define SMB_DIRECT_MAX_SEND_SGES		6
+#define SMB_DIRECT_MAX_SEND_SGES		16
 #define SMB_DIRECT_MAX_RECV_SGES		1
 
+/* Number of messages between two adjustments of the credit targets */
+#define SMB_DIRECT_CREDIT_TUNE_INTERVAL		64
+/* Lower bound of the auto-tuned credit targets */
+#define SMB_DIRECT_MIN_CREDIT_TARGET		16
+
 /*
  * Default maximum number of RDMA read/write outstanding on this connection
  * This value is possibly decreased during QP creation on hardware limit
  */
 #define SMB_DIRECT_CM_INITIATOR_DEPTH		8
 
+/*
+ * Maximum number of buffer descriptors which can be served from
+ * a pre-mapped buffer. Larger lists use the rdma_rw_ctx path.
+ */
+#define SMB_DIRECT_RDMA_BUF_MAX_DESCS		16
+
 /* Maximum number of retries on data transfer operations */
 #define SMB_DIRECT_CM_RETRY			6
 /* No need to retry on Receiver Not Ready since SMB_DIRECT manages credits */
@@ -61,17 +74,37 @@ static int smb_direct_receive_credit_max = 255;
 /* The remote peer's credit request of local peer */
 static int smb_direct_send_credit_target = 255;
 
-/* The maximum single message size can be sent to remote peer */
-static int smb_direct_max_send_size = 1364;
+/*
+ * The maximum single message size can be sent to remote peer.
+ * It is lowered to what the device can gather in one send.
+ */
+static int smb_direct_max_send_size = 8192;
 
 /*  The maximum fragmented upper-layer payload receive size supported */
 static int smb_direct_max_fragmented_recv_size = 1024 * 1024;
 
 /*  The maximum single-message size which can be received */
-static int smb_direct_max_receive_size = 1364;
+static int smb_direct_max_receive_size = 8192;
 
 static int smb_direct_max_read_write_size = SMBD_DEFAULT_IOSIZE;
 
+/*
+ * The maximum number of pre-mapped RDMA read/write buffers kept per
+ * connection. Buffers are created on demand and recycled afterwards.
+ */
+static int smb_direct_rdma_buf_count = 4;
+
+static struct smb_direct_stats {
+	/* upper layer messages sent in more than one data transfer */
+	atomic64_t	send_fragmented;
+	/* upper layer messages received in more than one data transfer */
+	atomic64_t	recv_fragmented;
+	/* sends which had to wait for the peer to grant credits */
+	atomic64_t	send_credit_starved;
+	/* data transfers which used the last receive credit of the peer */
+	atomic64_t	recv_credit_starved;
+} smb_direct_stats;
+
 static LIST_HEAD(smb_direct_device_list);
 static DEFINE_RWLOCK(smb_direct_device_lock);
 
@@ -108,6 +141,8 @@ struct smb_direct_transport {
 
 	int			max_send_size;
 	int			max_recv_size;
+	int			max_send_sges;
+	int			recv_buf_size;
 	int			max_fragmented_send_size;
 	int			max_fragmented_recv_size;
 	int			max_rdma_rw_size;
@@ -124,6 +159,9 @@ struct smb_direct_transport {
 	int			count_avail_recvmsg;
 	int			recv_credit_max;
 	int			recv_credit_target;
+	int			recv_credit_boost;
+	int			recv_tune_count;
+	bool			recv_starved;
 
 	spinlock_t		recvmsg_queue_lock;
 	struct list_head	recvmsg_queue;
@@ -133,6 +171,10 @@ struct smb_direct_transport {
 
 	int			send_credit_target;
 	atomic_t		send_credits;
+	spinlock_t		send_tune_lock;
+	int			send_tune_count;
+	int			send_credits_min;
+	bool			send_starved;
 	spinlock_t		lock_new_recv_credits;
 	int			new_recv_credits;
 	int			max_rw_credits;
@@ -150,6 +192,18 @@ struct smb_direct_transport {
 	wait_queue_head_t	wait_send_pending;
 	atomic_t		send_pending;
 
+	spinlock_t		rdma_buf_lock;
+	struct list_head	rdma_buf_list;
+	struct list_head	rdma_buf_free;
+	/* pooled buffers indexed by the address of each of their pages */
+	struct xarray		rdma_buf_pages;
+	int			rdma_buf_count;
+	bool			rdma_buf_disabled;
+
+	spinlock_t		rw_msg_lock;
+	struct list_head	rw_msg_free;
+	int			rw_msg_free_count;
+
 	struct delayed_work	post_recv_credits_work;
 	struct work_struct	send_immediate_work;
 	struct work_struct	disconnect_work;
@@ -187,10 +241,11 @@ struct smb_direct_recvmsg {
 	struct smb_direct_transport	*transport;
 	struct list_head	list;
 	int			type;
+	/* mapped once for the lifetime of the recvmsg */
 	struct ib_sge		sge;
 	struct ib_cqe		cqe;
 	bool			first_segment;
-	u8			packet[];
+	u8			*packet;
 };
 
 struct smb_direct_rdma_rw_msg {
@@ -204,6 +259,41 @@ struct smb_direct_rdma_rw_msg {
 	struct scatterlist	sg_list[0];
 };
 
+/*
+ * A page-backed buffer which is DMA mapped once at creation, so SMB2
+ * READ/WRITE over RDMA can build work requests from it directly. It is
+ * only accessed through the local DMA lkey, the peer never gets a key
+ * for it.
+ */
+struct smb_direct_rdma_buf {
+	struct smb_direct_transport	*t;
+	/* List head at t->rdma_buf_list */
+	struct list_head	list;
+	/* List head at t->rdma_buf_free */
+	struct list_head	free_list;
+	void			*addr;
+	int			npages;
+	struct page		**pages;
+	u64			*dma_addrs;
+	int			max_wrs;
+	struct ib_sge		*sges;
+	struct ib_rdma_wr	*wrs;
+	struct ib_cqe		cqe;
+	int			status;
+	/* set for a synchronous transfer, NULL otherwise */
+	struct completion	*completion;
+
+	/* state of an asynchronous transfer, protected by rdma_buf_lock */
+	bool			in_flight;
+	bool			released;
+	bool			is_read;
+	unsigned int		offset;
+	unsigned int		len;
+	int			credits;
+	void			(*done)(void *arg, int status);
+	void			*arg;
+};
+
 void init_smbd_max_io_size(unsigned int sz)
 {
 	sz = clamp_val(sz, SMBD_MIN_IOSIZE, SMBD_MAX_IOSIZE);
@@ -222,6 +312,7 @@ static inline int get_buf_page_count(void *buf, int size)
 }
 
 static void smb_direct_destroy_pools(struct smb_direct_transport *transport);
+static void smb_direct_destroy_rdma_bufs(struct smb_direct_transport *t);
 static void smb_direct_post_recv_credits(struct work_struct *work);
 static int smb_direct_post_send_data(struct smb_direct_transport *t,
 				     struct smb_direct_send_ctx *send_ctx,
@@ -266,9 +357,6 @@ smb_direct_recvmsg *get_free_recvmsg(struct smb_direct_transport *t)
 static void put_recvmsg(struct smb_direct_transport *t,
 			struct smb_direct_recvmsg *recvmsg)
 {
-	ib_dma_unmap_single(t->cm_id->device, recvmsg->sge.addr,
-			    recvmsg->sge.length, DMA_FROM_DEVICE);
-
 	spin_lock(&t->recvmsg_queue_lock);
 	list_add(&recvmsg->list, &t->recvmsg_queue);
 	spin_unlock(&t->recvmsg_queue_lock);
@@ -292,9 +380,6 @@ smb_direct_recvmsg *get_empty_recvmsg(struct smb_direct_transport *t)
 static void put_empty_recvmsg(struct smb_direct_transport *t,
 			      struct smb_direct_recvmsg *recvmsg)
 {
-	ib_dma_unmap_single(t->cm_id->device, recvmsg->sge.addr,
-			    recvmsg->sge.length, DMA_FROM_DEVICE);
-
 	spin_lock(&t->empty_recvmsg_queue_lock);
 	list_add_tail(&recvmsg->list, &t->empty_recvmsg_queue);
 	spin_unlock(&t->empty_recvmsg_queue_lock);
@@ -390,7 +475,16 @@ static struct smb_direct_transport *alloc_transport(struct rdma_cm_id *cm_id)
 	init_waitqueue_head(&t->wait_send_pending);
 	atomic_set(&t->send_pending, 0);
 
+	spin_lock_init(&t->rdma_buf_lock);
+	INIT_LIST_HEAD(&t->rdma_buf_list);
+	INIT_LIST_HEAD(&t->rdma_buf_free);
+	xa_init(&t->rdma_buf_pages);
+
+	spin_lock_init(&t->rw_msg_lock);
+	INIT_LIST_HEAD(&t->rw_msg_free);
+
 	spin_lock_init(&t->lock_new_recv_credits);
+	spin_lock_init(&t->send_tune_lock);
 
 	INIT_DELAYED_WORK(&t->post_recv_credits_work,
 			  smb_direct_post_recv_credits);
@@ -428,6 +522,7 @@ static void free_transport(struct smb_direct_transport *t)
 		ib_mr_pool_destroy(t->qp, &t->qp->rdma_mrs);
 		ib_destroy_qp(t->qp);
 	}
+	smb_direct_destroy_rdma_bufs(t);
 
 	ksmbd_debug(RDMA, "drain the reassembly queue\n");
 	do {
@@ -532,6 +627,36 @@ static int smb_direct_check_recvmsg(struct smb_direct_recvmsg *recvmsg)
 	return 0;
 }
 
+/*
+ * Grant the peer more receive credits than it asks for while it keeps
+ * running out of them, and fall back to its request once it doesn't.
+ * Called with receive_credit_lock held.
+ */
+static void smb_direct_tune_recv_credit_target(struct smb_direct_transport *t,
+					       int receive_credits,
+					       int credits_requested)
+{
+	if (receive_credits <= 0) {
+		t->recv_starved = true;
+		atomic64_inc(&smb_direct_stats.recv_credit_starved);
+	}
+
+	if (++t->recv_tune_count >= SMB_DIRECT_CREDIT_TUNE_INTERVAL) {
+		if (t->recv_starved)
+			t->recv_credit_boost =
+				min_t(int, t->recv_credit_max,
+				      max_t(int, t->recv_credit_boost * 2,
+					    SMB_DIRECT_MIN_CREDIT_TARGET));
+		else
+			t->recv_credit_boost /= 2;
+		t->recv_tune_count = 0;
+		t->recv_starved = false;
+	}
+
+	t->recv_credit_target = min_t(int, t->recv_credit_max,
+				      credits_requested + t->recv_credit_boost);
+}
+
 static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 {
 	struct smb_direct_recvmsg *recvmsg;
@@ -575,6 +700,8 @@ static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 			(struct smb_direct_data_transfer *)recvmsg->packet;
 		unsigned int data_length;
 		int avail_recvmsg_count, receive_credits;
+		int credits_requested =
+			le16_to_cpu(data_transfer->credits_requested);
 
 		if (wc->byte_len <
 		    offsetof(struct smb_direct_data_transfer, padding)) {
@@ -590,8 +717,11 @@ static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 				return;
 			}
 
-			if (t->full_packet_received)
+			if (t->full_packet_received) {
 				recvmsg->first_segment = true;
+				if (le32_to_cpu(data_transfer->remaining_data_length))
+					atomic64_inc(&smb_direct_stats.recv_fragmented);
+			}
 
 			if (le32_to_cpu(data_transfer->remaining_data_length))
 				t->full_packet_received = false;
@@ -604,6 +734,8 @@ static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 			spin_lock(&t->receive_credit_lock);
 			receive_credits = --(t->recv_credits);
 			avail_recvmsg_count = t->count_avail_recvmsg;
+			smb_direct_tune_recv_credit_target(t, receive_credits,
+							   credits_requested);
 			spin_unlock(&t->receive_credit_lock);
 		} else {
 			put_empty_recvmsg(t, recvmsg);
@@ -611,11 +743,11 @@ static void recv_done(struct ib_cq *cq, struct ib_wc *wc)
 			spin_lock(&t->receive_credit_lock);
 			receive_credits = --(t->recv_credits);
 			avail_recvmsg_count = ++(t->count_avail_recvmsg);
+			smb_direct_tune_recv_credit_target(t, receive_credits,
+							   credits_requested);
 			spin_unlock(&t->receive_credit_lock);
 		}
 
-		t->recv_credit_target =
-				le16_to_cpu(data_transfer->credits_requested);
 		atomic_add(le16_to_cpu(data_transfer->credits_granted),
 			   &t->send_credits);
 
@@ -642,12 +774,8 @@ static int smb_direct_post_recv(struct smb_direct_transport *t,
 	struct ib_recv_wr wr;
 	int ret;
 
-	recvmsg->sge.addr = ib_dma_map_single(t->cm_id->device,
-					      recvmsg->packet, t->max_recv_size,
-					      DMA_FROM_DEVICE);
-	ret = ib_dma_mapping_error(t->cm_id->device, recvmsg->sge.addr);
-	if (ret)
-		return ret;
+	ib_dma_sync_single_for_device(t->cm_id->device, recvmsg->sge.addr,
+				      t->max_recv_size, DMA_FROM_DEVICE);
 	recvmsg->sge.length = t->max_recv_size;
 	recvmsg->sge.lkey = t->pd->local_dma_lkey;
 	recvmsg->cqe.done = recv_done;
@@ -660,9 +788,6 @@ static int smb_direct_post_recv(struct smb_direct_transport *t,
 	ret = ib_post_recv(t->qp, &wr, NULL);
 	if (ret) {
 		pr_err("Can't post recv: %d\n", ret);
-		ib_dma_unmap_single(t->cm_id->device,
-				    recvmsg->sge.addr, recvmsg->sge.length,
-				    DMA_FROM_DEVICE);
 		smb_direct_disconnect_rdma_connection(t);
 		return ret;
 	}
@@ -988,6 +1113,39 @@ static int wait_for_credits(struct smb_direct_transport *t,
 	} while (true);
 }
 
+/*
+ * Ask the peer for more credits while sends have to wait for them, and
+ * for fewer while a large part of the granted credits is left unused.
+ */
+static void smb_direct_tune_send_credit_target(struct smb_direct_transport *t)
+{
+	int avail = atomic_read(&t->send_credits);
+	int target;
+
+	spin_lock(&t->send_tune_lock);
+	if (avail <= 0) {
+		t->send_starved = true;
+		atomic64_inc(&smb_direct_stats.send_credit_starved);
+	}
+	t->send_credits_min = min(t->send_credits_min, avail);
+
+	if (++t->send_tune_count >= SMB_DIRECT_CREDIT_TUNE_INTERVAL) {
+		target = t->send_credit_target;
+		if (t->send_starved)
+			target += target / 2;
+		else if (t->send_credits_min > target / 2)
+			target -= target / 4;
+		t->send_credit_target = clamp_t(int, target,
+						SMB_DIRECT_MIN_CREDIT_TARGET,
+						smb_direct_send_credit_target);
+
+		t->send_tune_count = 0;
+		t->send_credits_min = INT_MAX;
+		t->send_starved = false;
+	}
+	spin_unlock(&t->send_tune_lock);
+}
+
 static int wait_for_send_credits(struct smb_direct_transport *t,
 				 struct smb_direct_send_ctx *send_ctx)
 {
@@ -1000,6 +1158,7 @@ static int wait_for_send_credits(struct smb_direct_transport *t,
 			return ret;
 	}
 
+	smb_direct_tune_send_credit_target(t);
 	return wait_for_credits(t, &t->wait_send_credits, &t->send_credits, 1);
 }
 
@@ -1187,16 +1346,16 @@ static int smb_direct_post_send_data(struct smb_direct_transport *t,
 		struct ib_sge *sge;
 		int sg_cnt;
 
-		sg_init_table(sg, SMB_DIRECT_MAX_SEND_SGES - 1);
+		sg_init_table(sg, t->max_send_sges - 1);
 		sg_cnt = get_mapped_sg_list(t->cm_id->device,
 					    iov[i].iov_base, iov[i].iov_len,
-					    sg, SMB_DIRECT_MAX_SEND_SGES - 1,
+					    sg, t->max_send_sges - 1,
 					    DMA_TO_DEVICE);
 		if (sg_cnt <= 0) {
 			pr_err("failed to map buffer\n");
 			ret = -ENOMEM;
 			goto err;
-		} else if (sg_cnt + msg->num_sge > SMB_DIRECT_MAX_SEND_SGES) {
+		} else if (sg_cnt + msg->num_sge > t->max_send_sges) {
 			pr_err("buffer not fitted into sges\n");
 			ret = -E2BIG;
 			ib_dma_unmap_sg(t->cm_id->device, sg, sg_cnt,
@@ -1247,6 +1406,9 @@ static int smb_direct_writev(struct ksmbd_transport *t,
 	remaining_data_length = buflen;
 	ksmbd_debug(RDMA, "Sending smb (RDMA): smb_len=%u\n", buflen);
 
+	if (buflen > max_iov_size)
+		atomic64_inc(&smb_direct_stats.send_fragmented);
+
 	smb_direct_send_ctx_init(st, &send_ctx, need_invalidate, remote_key);
 	start = i = 0;
 	buflen = 0;
@@ -1315,6 +1477,47 @@ done:
 	return ret;
 }
 
+static struct smb_direct_rdma_rw_msg *
+smb_direct_get_rdma_rw_msg(struct smb_direct_transport *t)
+{
+	struct smb_direct_rdma_rw_msg *msg;
+
+	spin_lock(&t->rw_msg_lock);
+	msg = list_first_entry_or_null(&t->rw_msg_free,
+				       struct smb_direct_rdma_rw_msg, list);
+	if (msg) {
+		list_del(&msg->list);
+		t->rw_msg_free_count--;
+	}
+	spin_unlock(&t->rw_msg_lock);
+
+	if (!msg) {
+		msg = kzalloc(offsetof(struct smb_direct_rdma_rw_msg, sg_list) +
+			      sizeof(struct scatterlist) * SG_CHUNK_SIZE,
+			      GFP_KERNEL);
+		if (!msg)
+			return NULL;
+	}
+
+	msg->t = t;
+	msg->status = 0;
+	return msg;
+}
+
+static void smb_direct_put_rdma_rw_msg(struct smb_direct_transport *t,
+				       struct smb_direct_rdma_rw_msg *msg)
+{
+	spin_lock(&t->rw_msg_lock);
+	if (t->rw_msg_free_count < t->max_rw_credits) {
+		list_add(&msg->list, &t->rw_msg_free);
+		t->rw_msg_free_count++;
+		msg = NULL;
+	}
+	spin_unlock(&t->rw_msg_lock);
+
+	kfree(msg);
+}
+
 static void smb_direct_free_rdma_rw_msg(struct smb_direct_transport *t,
 					struct smb_direct_rdma_rw_msg *msg,
 					enum dma_data_direction dir)
@@ -1322,7 +1525,7 @@ static void smb_direct_free_rdma_rw_msg(struct smb_direct_transport *t,
 	rdma_rw_ctx_destroy(&msg->rw_ctx, t->qp, t->qp->port,
 			    msg->sgt.sgl, msg->sgt.nents, dir);
 	sg_free_table_chained(&msg->sgt, SG_CHUNK_SIZE);
-	kfree(msg);
+	smb_direct_put_rdma_rw_msg(t, msg);
 }
 
 static void read_write_done(struct ib_cq *cq, struct ib_wc *wc,
@@ -1353,51 +1556,369 @@ static void write_done(struct ib_cq *cq, struct ib_wc *wc)
 	read_write_done(cq, wc, DMA_TO_DEVICE);
 }
 
-static int smb_direct_rdma_xmit(struct smb_direct_transport *t,
-				void *buf, int buf_len,
-				struct smb2_buffer_desc_v1 *desc,
-				unsigned int desc_len,
-				bool is_read)
+static void smb_direct_rdma_buf_sync(struct smb_direct_transport *t,
+				     struct smb_direct_rdma_buf *rbuf,
+				     unsigned int offset, unsigned int len,
+				     bool for_cpu)
 {
+	int i, first = offset >> PAGE_SHIFT;
+	int last = (offset + len - 1) >> PAGE_SHIFT;
+
+	for (i = first; i <= last; i++) {
+		if (for_cpu)
+			ib_dma_sync_single_for_cpu(t->cm_id->device,
+						   rbuf->dma_addrs[i], PAGE_SIZE,
+						   DMA_BIDIRECTIONAL);
+		else
+			ib_dma_sync_single_for_device(t->cm_id->device,
+						      rbuf->dma_addrs[i],
+						      PAGE_SIZE,
+						      DMA_BIDIRECTIONAL);
+	}
+}
+
+/*
+ * Finish an asynchronous transfer from the CQ context: give back the
+ * R/W credits, recycle the buffer if its owner has already released it
+ * and notify the owner.
+ */
+static void smb_direct_rdma_buf_complete(struct smb_direct_transport *t,
+					 struct smb_direct_rdma_buf *rbuf)
+{
+	void (*done)(void *arg, int status) = rbuf->done;
+	void *arg = rbuf->arg;
+	int status = rbuf->status;
+
+	if (rbuf->is_read)
+		smb_direct_rdma_buf_sync(t, rbuf, rbuf->offset, rbuf->len,
+					 true);
+
+	atomic_add(rbuf->credits, &t->rw_credits);
+	wake_up(&t->wait_rw_credits);
+
+	spin_lock(&t->rdma_buf_lock);
+	rbuf->in_flight = false;
+	if (rbuf->released) {
+		rbuf->released = false;
+		list_add(&rbuf->free_list, &t->rdma_buf_free);
+	}
+	spin_unlock(&t->rdma_buf_lock);
+
+	if (done)
+		done(arg, status);
+}
+
+static void rdma_buf_done(struct ib_cq *cq, struct ib_wc *wc)
+{
+	struct smb_direct_rdma_buf *rbuf = container_of(wc->wr_cqe,
+							struct smb_direct_rdma_buf, cqe);
+	struct smb_direct_transport *t = rbuf->t;
+
+	if (wc->status != IB_WC_SUCCESS) {
+		rbuf->status = -EIO;
+		pr_err("read/write error. opcode = %d, status = %s(%d)\n",
+		       wc->opcode, ib_wc_status_msg(wc->status), wc->status);
+		if (wc->status != IB_WC_WR_FLUSH_ERR)
+			smb_direct_disconnect_rdma_connection(t);
+	}
+
+	if (rbuf->completion) {
+		complete(rbuf->completion);
+		return;
+	}
+
+	smb_direct_rdma_buf_complete(t, rbuf);
+}
+
+static void smb_direct_destroy_rdma_buf(struct smb_direct_transport *t,
+					struct smb_direct_rdma_buf *rbuf)
+{
+	int i;
+
+	if (rbuf->addr) {
+		for (i = 0; i < rbuf->npages; i++)
+			xa_erase(&t->rdma_buf_pages,
+				 ((unsigned long)rbuf->addr >> PAGE_SHIFT) + i);
+		vunmap(rbuf->addr);
+	}
+
+	if (rbuf->pages) {
+		for (i = 0; i < rbuf->npages; i++) {
+			if (!rbuf->pages[i])
+				break;
+			ib_dma_unmap_page(t->cm_id->device, rbuf->dma_addrs[i],
+					  PAGE_SIZE, DMA_BIDIRECTIONAL);
+			__free_page(rbuf->pages[i]);
+		}
+	}
+
+	kvfree(rbuf->wrs);
+	kvfree(rbuf->sges);
+	kvfree(rbuf->dma_addrs);
+	kvfree(rbuf->pages);
+	kfree(rbuf);
+}
+
+static struct smb_direct_rdma_buf *
+smb_direct_create_rdma_buf(struct smb_direct_transport *t)
+{
+	struct ib_device *device = t->cm_id->device;
+	struct smb_direct_rdma_buf *rbuf;
+	int i;
+
+	rbuf = kzalloc(sizeof(*rbuf), GFP_KERNEL);
+	if (!rbuf)
+		return NULL;
+
+	rbuf->t = t;
+	INIT_LIST_HEAD(&rbuf->list);
+	INIT_LIST_HEAD(&rbuf->free_list);
+	rbuf->npages = DIV_ROUND_UP(t->max_rdma_rw_size, PAGE_SIZE);
+	rbuf->max_wrs = rbuf->npages + SMB_DIRECT_RDMA_BUF_MAX_DESCS;
+
+	rbuf->pages = kvcalloc(rbuf->npages, sizeof(struct page *), GFP_KERNEL);
+	rbuf->dma_addrs = kvcalloc(rbuf->npages, sizeof(u64), GFP_KERNEL);
+	rbuf->sges = kvcalloc(rbuf->max_wrs, sizeof(struct ib_sge), GFP_KERNEL);
+	rbuf->wrs = kvcalloc(rbuf->max_wrs, sizeof(struct ib_rdma_wr),
+			     GFP_KERNEL);
+	if (!rbuf->pages || !rbuf->dma_addrs || !rbuf->sges || !rbuf->wrs)
+		goto err;
+
+	for (i = 0; i < rbuf->npages; i++) {
+		rbuf->pages[i] = alloc_page(GFP_KERNEL);
+		if (!rbuf->pages[i])
+			goto err;
+
+		rbuf->dma_addrs[i] = ib_dma_map_page(device, rbuf->pages[i], 0,
+						     PAGE_SIZE,
+						     DMA_BIDIRECTIONAL);
+		if (ib_dma_mapping_error(device, rbuf->dma_addrs[i])) {
+			__free_page(rbuf->pages[i]);
+			rbuf->pages[i] = NULL;
+			goto err;
+		}
+	}
+
+	rbuf->addr = vmap(rbuf->pages, rbuf->npages, VM_MAP, PAGE_KERNEL);
+	if (!rbuf->addr)
+		goto err;
+
+	for (i = 0; i < rbuf->npages; i++) {
+		if (xa_err(xa_store(&t->rdma_buf_pages,
+				    ((unsigned long)rbuf->addr >> PAGE_SHIFT) + i,
+				    rbuf, GFP_KERNEL)))
+			goto err;
+	}
+
+	return rbuf;
+err:
+	smb_direct_destroy_rdma_buf(t, rbuf);
+	return NULL;
+}
+
+static void smb_direct_destroy_rdma_bufs(struct smb_direct_transport *t)
+{
+	struct smb_direct_rdma_buf *rbuf, *tmp;
 	struct smb_direct_rdma_rw_msg *msg, *next_msg;
-	int i, ret;
-	DECLARE_COMPLETION_ONSTACK(completion);
-	struct ib_send_wr *first_wr;
-	LIST_HEAD(msg_list);
-	char *desc_buf;
-	int credits_needed;
-	unsigned int desc_buf_len;
-	size_t total_length = 0;
 
-	if (t->status != SMB_DIRECT_CS_CONNECTED)
-		return -ENOTCONN;
+	list_for_each_entry_safe(rbuf, tmp, &t->rdma_buf_list, list) {
+		list_del(&rbuf->list);
+		smb_direct_destroy_rdma_buf(t, rbuf);
+	}
+	xa_destroy(&t->rdma_buf_pages);
+	INIT_LIST_HEAD(&t->rdma_buf_free);
+	t->rdma_buf_count = 0;
 
-	/* calculate needed credits */
-	credits_needed = 0;
-	desc_buf = buf;
-	for (i = 0; i < desc_len / sizeof(*desc); i++) {
-		desc_buf_len = le32_to_cpu(desc[i].length);
+	list_for_each_entry_safe(msg, next_msg, &t->rw_msg_free, list) {
+		list_del(&msg->list);
+		kfree(msg);
+	}
+	t->rw_msg_free_count = 0;
+}
 
-		credits_needed += calc_rw_credits(t, desc_buf, desc_buf_len);
-		desc_buf += desc_buf_len;
-		total_length += desc_buf_len;
-		if (desc_buf_len == 0 || total_length > buf_len ||
-		    total_length > t->max_rdma_rw_size)
-			return -EINVAL;
+static struct smb_direct_rdma_buf *
+smb_direct_lookup_rdma_buf(struct smb_direct_transport *t, void *buf,
+			   unsigned int len)
+{
+	struct smb_direct_rdma_buf *rbuf;
+
+	if (!is_vmalloc_addr(buf))
+		return NULL;
+
+	rbuf = xa_load(&t->rdma_buf_pages, (unsigned long)buf >> PAGE_SHIFT);
+	if (rbuf && buf + len <= rbuf->addr +
+	    ((size_t)rbuf->npages << PAGE_SHIFT))
+		return rbuf;
+	return NULL;
+}
+
+static void smb_direct_rdma_buf_seg(struct smb_direct_transport *t,
+				    struct smb_direct_rdma_buf *rbuf,
+				    int page_idx, u64 *addr, u32 *lkey)
+{
+	*addr = rbuf->dma_addrs[page_idx];
+	*lkey = t->pd->local_dma_lkey;
+}
+
+/*
+ * Build a chain of RDMA read/write work requests for the descriptors
+ * directly from the pre-mapped pages of @rbuf, merging physically
+ * contiguous pages into a single sge.
+ */
+static int smb_direct_rdma_buf_build_wrs(struct smb_direct_transport *t,
+					 struct smb_direct_rdma_buf *rbuf,
+					 unsigned int offset,
+					 struct smb2_buffer_desc_v1 *desc,
+					 int ndesc, bool is_read)
+{
+	struct ib_rdma_wr *wr;
+	struct ib_sge *sge = rbuf->sges, *last_sge = NULL;
+	int max_sge = is_read ? t->qp->max_read_sge : t->qp->max_write_sge;
+	int i, nr_wrs = 0;
+
+	for (i = 0; i < ndesc; i++) {
+		unsigned int len = le32_to_cpu(desc[i].length);
+		u64 remote_addr = le64_to_cpu(desc[i].offset);
+		u32 rkey = le32_to_cpu(desc[i].token);
+
+		wr = NULL;
+		while (len) {
+			unsigned int page_off = offset & ~PAGE_MASK;
+			unsigned int seg = min_t(unsigned int, len,
+						 PAGE_SIZE - page_off);
+			u64 addr;
+			u32 lkey;
+
+			smb_direct_rdma_buf_seg(t, rbuf, offset >> PAGE_SHIFT,
+						&addr, &lkey);
+			addr += page_off;
+
+			if (wr && last_sge->lkey == lkey &&
+			    last_sge->addr + last_sge->length == addr) {
+				last_sge->length += seg;
+			} else {
+				if (sge - rbuf->sges == rbuf->max_wrs)
+					return -E2BIG;
+
+				if (!wr || wr->wr.num_sge == max_sge) {
+					wr = &rbuf->wrs[nr_wrs];
+					memset(wr, 0, sizeof(*wr));
+					wr->wr.opcode = is_read ?
+						IB_WR_RDMA_READ :
+						IB_WR_RDMA_WRITE;
+					wr->wr.sg_list = sge;
+					wr->remote_addr = remote_addr;
+					wr->rkey = rkey;
+					if (nr_wrs)
+						rbuf->wrs[nr_wrs - 1].wr.next =
+							&wr->wr;
+					nr_wrs++;
+				}
+
+				sge->addr = addr;
+				sge->length = seg;
+				sge->lkey = lkey;
+				wr->wr.num_sge++;
+				last_sge = sge++;
+			}
+
+			offset += seg;
+			remote_addr += seg;
+			len -= seg;
+		}
 	}
 
-	ksmbd_debug(RDMA, "RDMA %s, len %#x, needed credits %#x\n",
-		    is_read ? "read" : "write", buf_len, credits_needed);
+	if (!nr_wrs)
+		return -EINVAL;
 
-	ret = wait_for_rw_credits(t, credits_needed);
+	wr = &rbuf->wrs[nr_wrs - 1];
+	wr->wr.send_flags = IB_SEND_SIGNALED;
+	wr->wr.wr_cqe = &rbuf->cqe;
+	return nr_wrs;
+}
+
+/*
+ * An RDMA write is always completed asynchronously: it is ordered before
+ * the SEND carrying the response on the same RC QP, so only the buffer
+ * and the R/W credits need to outlive the call. An RDMA read completes
+ * asynchronously when the caller supplies @done.
+ *
+ * Return: -EINPROGRESS when the transfer will complete asynchronously,
+ * otherwise the result of the transfer.
+ */
+static int smb_direct_rdma_buf_xmit(struct smb_direct_transport *t,
+				    struct smb_direct_rdma_buf *rbuf,
+				    void *buf, unsigned int len,
+				    struct smb2_buffer_desc_v1 *desc,
+				    int ndesc, bool is_read, int credits,
+				    void (*done)(void *arg, int status),
+				    void *arg)
+{
+	DECLARE_COMPLETION_ONSTACK(completion);
+	unsigned int offset = buf - rbuf->addr;
+	bool async = !is_read || done;
+	int ret;
+
+	ret = smb_direct_rdma_buf_build_wrs(t, rbuf, offset, desc, ndesc,
+					    is_read);
 	if (ret < 0)
 		return ret;
 
+	rbuf->cqe.done = rdma_buf_done;
+	rbuf->status = 0;
+	rbuf->is_read = is_read;
+	rbuf->offset = offset;
+	rbuf->len = len;
+	if (async) {
+		rbuf->completion = NULL;
+		rbuf->credits = credits;
+		rbuf->done = done;
+		rbuf->arg = arg;
+
+		spin_lock(&t->rdma_buf_lock);
+		rbuf->in_flight = true;
+		spin_unlock(&t->rdma_buf_lock);
+	} else {
+		rbuf->completion = &completion;
+	}
+
+	smb_direct_rdma_buf_sync(t, rbuf, offset, len, false);
+	ret = ib_post_send(t->qp, &rbuf->wrs[0].wr, NULL);
+	if (ret) {
+		pr_err("failed to post send wr for RDMA R/W: %d\n", ret);
+		if (async) {
+			spin_lock(&t->rdma_buf_lock);
+			rbuf->in_flight = false;
+			spin_unlock(&t->rdma_buf_lock);
+		}
+		return ret;
+	}
+
+	if (async)
+		return -EINPROGRESS;
+
+	wait_for_completion(&completion);
+	if (is_read)
+		smb_direct_rdma_buf_sync(t, rbuf, offset, len, true);
+	return rbuf->status;
+}
+
+static int smb_direct_rdma_msg_xmit(struct smb_direct_transport *t,
+				    void *buf, struct smb2_buffer_desc_v1 *desc,
+				    int ndesc, bool is_read)
+{
+	struct smb_direct_rdma_rw_msg *msg, *next_msg;
+	int i, ret;
+	DECLARE_COMPLETION_ONSTACK(completion);
+	struct ib_send_wr *first_wr;
+	LIST_HEAD(msg_list);
+	char *desc_buf;
+	unsigned int desc_buf_len;
+
 	/* build rdma_rw_ctx for each descriptor */
 	desc_buf = buf;
-	for (i = 0; i < desc_len / sizeof(*desc); i++) {
-		msg = kzalloc(offsetof(struct smb_direct_rdma_rw_msg, sg_list) +
-			      sizeof(struct scatterlist) * SG_CHUNK_SIZE, GFP_KERNEL);
+	for (i = 0; i < ndesc; i++) {
+		msg = smb_direct_get_rdma_rw_msg(t);
 		if (!msg) {
 			ret = -ENOMEM;
 			goto out;
@@ -1405,7 +1926,6 @@ static int smb_direct_rdma_xmit(struct smb_direct_transport *t,
 
 		desc_buf_len = le32_to_cpu(desc[i].length);
 
-		msg->t = t;
 		msg->cqe.done = is_read ? read_done : write_done;
 		msg->completion = &completion;
 
@@ -1414,7 +1934,7 @@ static int smb_direct_rdma_xmit(struct smb_direct_transport *t,
 					     get_buf_page_count(desc_buf, desc_buf_len),
 					     msg->sg_list, SG_CHUNK_SIZE);
 		if (ret) {
-			kfree(msg);
+			smb_direct_put_rdma_rw_msg(t, msg);
 			ret = -ENOMEM;
 			goto out;
 		}
@@ -1423,7 +1943,7 @@ static int smb_direct_rdma_xmit(struct smb_direct_transport *t,
 				  msg->sgt.sgl, msg->sgt.orig_nents);
 		if (ret < 0) {
 			sg_free_table_chained(&msg->sgt, SG_CHUNK_SIZE);
-			kfree(msg);
+			smb_direct_put_rdma_rw_msg(t, msg);
 			goto out;
 		}
 
@@ -1437,7 +1957,7 @@ static int smb_direct_rdma_xmit(struct smb_direct_transport *t,
 		if (ret < 0) {
 			pr_err("failed to init rdma_rw_ctx: %d\n", ret);
 			sg_free_table_chained(&msg->sgt, SG_CHUNK_SIZE);
-			kfree(msg);
+			smb_direct_put_rdma_rw_msg(t, msg);
 			goto out;
 		}
 
@@ -1467,27 +1987,145 @@ out:
 		smb_direct_free_rdma_rw_msg(t, msg,
 					    is_read ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
 	}
+	return ret;
+}
+
+static int smb_direct_rdma_xmit(struct smb_direct_transport *t,
+				void *buf, int buf_len,
+				struct smb2_buffer_desc_v1 *desc,
+				unsigned int desc_len,
+				bool is_read,
+				void (*done)(void *arg, int status),
+				void *arg)
+{
+	struct smb_direct_rdma_buf *rbuf;
+	int i, ret, ndesc;
+	char *desc_buf;
+	int credits_needed;
+	unsigned int desc_buf_len;
+	size_t total_length = 0;
+
+	if (t->status != SMB_DIRECT_CS_CONNECTED)
+		return -ENOTCONN;
+
+	/* calculate needed credits */
+	credits_needed = 0;
+	desc_buf = buf;
+	ndesc = desc_len / sizeof(*desc);
+	for (i = 0; i < ndesc; i++) {
+		desc_buf_len = le32_to_cpu(desc[i].length);
+
+		credits_needed += calc_rw_credits(t, desc_buf, desc_buf_len);
+		desc_buf += desc_buf_len;
+		total_length += desc_buf_len;
+		if (desc_buf_len == 0 || total_length > buf_len ||
+		    total_length > t->max_rdma_rw_size)
+			return -EINVAL;
+	}
+
+	ksmbd_debug(RDMA, "RDMA %s, len %#x, needed credits %#x\n",
+		    is_read ? "read" : "write", buf_len, credits_needed);
+
+	ret = wait_for_rw_credits(t, credits_needed);
+	if (ret < 0)
+		return ret;
+
+	rbuf = smb_direct_lookup_rdma_buf(t, buf, buf_len);
+	if (rbuf && ndesc <= SMB_DIRECT_RDMA_BUF_MAX_DESCS) {
+		/*
+		 * Pooled buffers are recycled without being cleared, don't
+		 * leave stale data behind the part the peer has written.
+		 */
+		if (is_read && total_length < buf_len)
+			memset(buf + total_length, 0, buf_len - total_length);
+		ret = smb_direct_rdma_buf_xmit(t, rbuf, buf, total_length,
+					       desc, ndesc, is_read,
+					       credits_needed, done, arg);
+		/* R/W credits are given back by the completion handler */
+		if (ret == -EINPROGRESS)
+			return is_read ? ret : 0;
+	} else {
+		ret = smb_direct_rdma_msg_xmit(t, buf, desc, ndesc, is_read);
+	}
+
 	atomic_add(credits_needed, &t->rw_credits);
 	wake_up(&t->wait_rw_credits);
 	return ret;
 }
 
+static void *smb_direct_alloc_rdma_buf(struct ksmbd_transport *t,
+				       unsigned int len)
+{
+	struct smb_direct_transport *st = smb_trans_direct_transfort(t);
+	struct smb_direct_rdma_buf *rbuf;
+	bool create = false;
+
+	if (st->status != SMB_DIRECT_CS_CONNECTED ||
+	    st->rdma_buf_disabled || len > st->max_rdma_rw_size)
+		return NULL;
+
+	spin_lock(&st->rdma_buf_lock);
+	rbuf = list_first_entry_or_null(&st->rdma_buf_free,
+					struct smb_direct_rdma_buf, free_list);
+	if (rbuf) {
+		list_del_init(&rbuf->free_list);
+	} else if (st->rdma_buf_count < smb_direct_rdma_buf_count) {
+		st->rdma_buf_count++;
+		create = true;
+	}
+	spin_unlock(&st->rdma_buf_lock);
+
+	if (create) {
+		rbuf = smb_direct_create_rdma_buf(st);
+
+		spin_lock(&st->rdma_buf_lock);
+		if (rbuf)
+			list_add_tail(&rbuf->list, &st->rdma_buf_list);
+		else
+			st->rdma_buf_count--;
+		spin_unlock(&st->rdma_buf_lock);
+	}
+
+	return rbuf ? rbuf->addr : NULL;
+}
+
+static bool smb_direct_free_rdma_buf(struct ksmbd_transport *t, void *buf)
+{
+	struct smb_direct_transport *st = smb_trans_direct_transfort(t);
+	struct smb_direct_rdma_buf *rbuf;
+
+	rbuf = smb_direct_lookup_rdma_buf(st, buf, 0);
+	if (!rbuf || rbuf->addr != buf)
+		return false;
+
+	spin_lock(&st->rdma_buf_lock);
+	/* recycled by the completion handler if in flight */
+	if (rbuf->in_flight)
+		rbuf->released = true;
+	else
+		list_add(&rbuf->free_list, &st->rdma_buf_free);
+	spin_unlock(&st->rdma_buf_lock);
+	return true;
+}
+
 static int smb_direct_rdma_write(struct ksmbd_transport *t,
 				 void *buf, unsigned int buflen,
 				 struct smb2_buffer_desc_v1 *desc,
 				 unsigned int desc_len)
 {
 	return smb_direct_rdma_xmit(smb_trans_direct_transfort(t), buf, buflen,
-				    desc, desc_len, false);
+				    desc, desc_len, false, NULL, NULL);
 }
 
 static int smb_direct_rdma_read(struct ksmbd_transport *t,
 				void *buf, unsigned int buflen,
 				struct smb2_buffer_desc_v1 *desc,
-				unsigned int desc_len)
+				unsigned int desc_len,
+				void (*done)(void *arg, int status),
+				void *arg)
 {
 	return smb_direct_rdma_xmit(smb_trans_direct_transfort(t), buf, buflen,
-				    desc, desc_len, true);
+				    desc, desc_len, true, done, arg);
 }
 
 static void smb_direct_disconnect(struct ksmbd_transport *t)
@@ -1706,9 +2344,17 @@ static int smb_direct_init_params(struct smb_direct_transport *t,
 	/* need 2 more sge. because a SMB_DIRECT header will be mapped,
 	 * and maybe a send buffer could be not page aligned.
 	 */
-	t->max_send_size = smb_direct_max_send_size;
+	t->max_send_sges = min_t(int, device->attrs.max_send_sge,
+				 SMB_DIRECT_MAX_SEND_SGES);
+	if (t->max_send_sges < 3) {
+		pr_err("warning: device max_send_sge = %d too small\n",
+		       device->attrs.max_send_sge);
+		return -EINVAL;
+	}
+	t->max_send_size = min_t(int, smb_direct_max_send_size,
+				 (t->max_send_sges - 2) * PAGE_SIZE);
 	max_send_sges = DIV_ROUND_UP(t->max_send_size, PAGE_SIZE) + 2;
-	if (max_send_sges > SMB_DIRECT_MAX_SEND_SGES) {
+	if (max_send_sges > t->max_send_sges) {
 		pr_err("max_send_size %d is too large\n", t->max_send_size);
 		return -EINVAL;
 	}
@@ -1733,6 +2379,13 @@ static int smb_direct_init_params(struct smb_direct_transport *t,
 					    max_sge_per_wr) + 1);
 	max_rw_wrs = t->max_rw_credits * wrs_per_credit;
 
+	/*
+	 * The sink of a RDMA read must be a MR with remote write access on
+	 * iWARP. Such a MR has to be invalidated after each I/O, which the
+	 * rdma_rw_ctx path does, so buffers are not pooled there.
+	 */
+	t->rdma_buf_disabled = rdma_protocol_iwarp(device, t->cm_id->port_num);
+
 	max_send_wrs = smb_direct_send_credit_target + max_rw_wrs;
 	if (max_send_wrs > device->attrs.max_cqe ||
 	    max_send_wrs > device->attrs.max_qp_wr) {
@@ -1752,11 +2405,6 @@ static int smb_direct_init_params(struct smb_direct_transport *t,
 		return -EINVAL;
 	}
 
-	if (device->attrs.max_send_sge < SMB_DIRECT_MAX_SEND_SGES) {
-		pr_err("warning: device max_send_sge = %d too small\n",
-		       device->attrs.max_send_sge);
-		return -EINVAL;
-	}
 	if (device->attrs.max_recv_sge < SMB_DIRECT_MAX_RECV_SGES) {
 		pr_err("warning: device max_recv_sge = %d too small\n",
 		       device->attrs.max_recv_sge);
@@ -1768,33 +2416,73 @@ static int smb_direct_init_params(struct smb_direct_transport *t,
 
 	t->recv_credit_max = smb_direct_receive_credit_max;
 	t->recv_credit_target = 10;
+	t->recv_credit_boost = 0;
+	t->recv_tune_count = 0;
 	t->new_recv_credits = 0;
 
 	t->send_credit_target = smb_direct_send_credit_target;
+	t->send_tune_count = 0;
+	t->send_credits_min = INT_MAX;
 	atomic_set(&t->send_credits, 0);
 	atomic_set(&t->rw_credits, t->max_rw_credits);
 
-	t->max_send_size = smb_direct_max_send_size;
 	t->max_recv_size = smb_direct_max_receive_size;
 	t->max_fragmented_recv_size = smb_direct_max_fragmented_recv_size;
 
 	cap->max_send_wr = max_send_wrs;
 	cap->max_recv_wr = t->recv_credit_max;
-	cap->max_send_sge = max_sge_per_wr;
+	cap->max_send_sge = max_t(unsigned int, max_sge_per_wr,
+				  t->max_send_sges);
 	cap->max_recv_sge = SMB_DIRECT_MAX_RECV_SGES;
 	cap->max_inline_data = 0;
 	cap->max_rdma_ctxs = t->max_rw_credits;
 	return 0;
 }
 
+/*
+ * Receive buffers are page backed and stay DMA mapped until the
+ * transport is destroyed, posting one only needs a sync to the device.
+ */
+static int smb_direct_alloc_recvmsg_buf(struct smb_direct_transport *t,
+					struct smb_direct_recvmsg *recvmsg)
+{
+	struct page *page;
+
+	page = alloc_pages(GFP_KERNEL, get_order(t->recv_buf_size));
+	if (!page)
+		return -ENOMEM;
+
+	recvmsg->packet = page_address(page);
+	recvmsg->sge.addr = ib_dma_map_single(t->cm_id->device,
+					      recvmsg->packet,
+					      t->recv_buf_size,
+					      DMA_FROM_DEVICE);
+	if (ib_dma_mapping_error(t->cm_id->device, recvmsg->sge.addr)) {
+		__free_pages(page, get_order(t->recv_buf_size));
+		recvmsg->packet = NULL;
+		return -ENOMEM;
+	}
+	return 0;
+}
+
+static void smb_direct_free_recvmsg(struct smb_direct_transport *t,
+				    struct smb_direct_recvmsg *recvmsg)
+{
+	ib_dma_unmap_single(t->cm_id->device, recvmsg->sge.addr,
+			    t->recv_buf_size, DMA_FROM_DEVICE);
+	free_pages((unsigned long)recvmsg->packet,
+		   get_order(t->recv_buf_size));
+	mempool_free(recvmsg, t->recvmsg_mempool);
+}
+
 static void smb_direct_destroy_pools(struct smb_direct_transport *t)
 {
 	struct smb_direct_recvmsg *recvmsg;
 
 	while ((recvmsg = get_free_recvmsg(t)))
-		mempool_free(recvmsg, t->recvmsg_mempool);
+		smb_direct_free_recvmsg(t, recvmsg);
 	while ((recvmsg = get_empty_recvmsg(t)))
-		mempool_free(recvmsg, t->recvmsg_mempool);
+		smb_direct_free_recvmsg(t, recvmsg);
 
 	mempool_destroy(t->recvmsg_mempool);
 	t->recvmsg_mempool = NULL;
@@ -1831,8 +2519,7 @@ static int smb_direct_create_pools(struct smb_direct_transport *t)
 
 	snprintf(name, sizeof(name), "smb_direct_resp_%p", t);
 	t->recvmsg_cache = kmem_cache_create(name,
-					     sizeof(struct smb_direct_recvmsg) +
-					      t->max_recv_size,
+					     sizeof(struct smb_direct_recvmsg),
 					     0, SLAB_HWCACHE_ALIGN, NULL);
 	if (!t->recvmsg_cache)
 		goto err;
@@ -1845,11 +2532,16 @@ static int smb_direct_create_pools(struct smb_direct_transport *t)
 
 	INIT_LIST_HEAD(&t->recvmsg_queue);
 
+	t->recv_buf_size = t->max_recv_size;
 	for (i = 0; i < t->recv_credit_max; i++) {
 		recvmsg = mempool_alloc(t->recvmsg_mempool, GFP_KERNEL);
 		if (!recvmsg)
 			goto err;
 		recvmsg->transport = t;
+		if (smb_direct_alloc_recvmsg_buf(t, recvmsg)) {
+			mempool_free(recvmsg, t->recvmsg_mempool);
+			goto err;
+		}
 		list_add(&recvmsg->list, &t->recvmsg_queue);
 	}
 	t->count_avail_recvmsg = t->recv_credit_max;
@@ -2245,6 +2937,19 @@ void ksmbd_rdma_destroy(void)
 	}
 }
 
+int ksmbd_rdma_stats_show(char *buf, int offset)
+{
+	return sysfs_emit_at(buf, offset,
+			     "send_fragmented: %lld\n"
+			     "recv_fragmented: %lld\n"
+			     "send_credit_starved: %lld\n"
+			     "recv_credit_starved: %lld\n",
+			     atomic64_read(&smb_direct_stats.send_fragmented),
+			     atomic64_read(&smb_direct_stats.recv_fragmented),
+			     atomic64_read(&smb_direct_stats.send_credit_starved),
+			     atomic64_read(&smb_direct_stats.recv_credit_starved));
+}
+
 bool ksmbd_rdma_capable_netdev(struct net_device *netdev)
 {
 	struct smb_direct_device *smb_dev;
@@ -2294,4 +2999,6 @@ static struct ksmbd_transport_ops ksmbd_smb_direct_transport_ops = {
 	.read		= smb_direct_read,
 	.rdma_read	= smb_direct_rdma_read,
 	.rdma_write	= smb_direct_rdma_write,
+	.alloc_rdma_buf	= smb_direct_alloc_rdma_buf,
+	.free_rdma_buf	= smb_direct_free_rdma_buf,
 };
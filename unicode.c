@@ -13,6 +13,7 @@
 #include "unicode.h"
 #include "uniupr.h"
 #include "smb_common.h"
+#include "ksmbd_work.h"
 
 #ifdef CONFIG_SMB_INSECURE_SERVER
 int smb1_utf16_name_length(const __le16 *from, int maxbytes)
@@ -32,6 +33,131 @@ int smb1_utf16_name_length(const __le16 *from, int maxbytes)
 }
 #endif
 
+/*
+ * Word-at-a-time masks used by the ASCII fast paths below. Every NLS table
+ * shipped with the kernel maps 0x01-0x7f to the identical code point, so a
+ * run of ASCII can be widened or narrowed without consulting the codepage.
+ */
+#define SMB_UTF16_NONASCII4	0xff80ff80ff80ff80ULL
+#define SMB_UTF16_ONES4		0x0001000100010001ULL
+#define SMB_UTF16_HIGHS4	0x8000800080008000ULL
+#define SMB_ASCII_ONES8		0x0101010101010101ULL
+#define SMB_ASCII_HIGHS8	0x8080808080808080ULL
+
+/*
+ * smb_utf16_ascii_run() - narrow the leading ASCII run of a utf16le string
+ * @to:		destination buffer, or NULL to only measure the run
+ * @from:	source buffer
+ * @maxwords:	don't walk past this many code units of the source
+ *
+ * Four code units are checked per iteration; the run stops at the first
+ * null or non-ASCII unit, which is left for the NLS conversion.
+ *
+ * Return:	number of code units (and bytes) in the ASCII run
+ */
+static int smb_utf16_ascii_run(char *to, const __le16 *from, int maxwords)
+{
+	int i;
+	u64 v;
+	u16 c;
+
+	for (i = 0; i + 4 <= maxwords; i += 4) {
+		v = get_unaligned_le64(&from[i]);
+		if ((v & SMB_UTF16_NONASCII4) ||
+		    ((v - SMB_UTF16_ONES4) & SMB_UTF16_HIGHS4))
+			break;
+		if (to) {
+			to[i] = v;
+			to[i + 1] = v >> 16;
+			to[i + 2] = v >> 32;
+			to[i + 3] = v >> 48;
+		}
+	}
+
+	for (; i < maxwords; i++) {
+		c = get_unaligned_le16(&from[i]);
+		if (c == 0 || c >= 0x80)
+			break;
+		if (to)
+			to[i] = c;
+	}
+
+	return i;
+}
+
+/*
+ * smb_map_ascii() - remap a reserved ASCII character for the mapchars option
+ * @c:		ASCII character
+ *
+ * Return:	utf16 code unit to put on the wire
+ */
+static inline u16 smb_map_ascii(char c)
+{
+	switch (c) {
+	case ':':
+		return UNI_COLON;
+	case '*':
+		return UNI_ASTERISK;
+	case '?':
+		return UNI_QUESTION;
+	case '<':
+		return UNI_LESSTHAN;
+	case '>':
+		return UNI_GRTRTHAN;
+	case '|':
+		return UNI_PIPE;
+	default:
+		return c;
+	}
+}
+
+/*
+ * smb_ascii_to_utf16_run() - widen the leading ASCII run of a string
+ * @to:		destination buffer
+ * @from:	source buffer
+ * @len:	don't walk past this many bytes of the source
+ * @mapchar:	should characters be remapped according to the mapchars option?
+ *
+ * Eight bytes are checked per iteration; the run stops at the first null or
+ * non-ASCII byte, which is left for the NLS conversion.
+ *
+ * Return:	number of bytes (and code units) in the ASCII run
+ */
+static int smb_ascii_to_utf16_run(__le16 *to, const char *from, int len,
+				  bool mapchar)
+{
+	int i, k;
+	u64 v;
+
+	for (i = 0; i + 8 <= len; i += 8) {
+		v = get_unaligned_le64(from + i);
+		if ((v | (v - SMB_ASCII_ONES8)) & SMB_ASCII_HIGHS8)
+			break;
+		if (mapchar) {
+			for (k = 0; k < 8; k++)
+				put_unaligned_le16(smb_map_ascii(from[i + k]),
+						   &to[i + k]);
+			continue;
+		}
+		put_unaligned_le64((v & 0xff) | (v & 0xff00) << 8 |
+				   (v & 0xff0000) << 16 |
+				   (v & 0xff000000) << 24, &to[i]);
+		v >>= 32;
+		put_unaligned_le64((v & 0xff) | (v & 0xff00) << 8 |
+				   (v & 0xff0000) << 16 |
+				   (v & 0xff000000) << 24, &to[i + 4]);
+	}
+
+	for (; i < len; i++) {
+		if (from[i] == 0 || from[i] & 0x80)
+			break;
+		put_unaligned_le16(mapchar ? smb_map_ascii(from[i]) : from[i],
+				   &to[i]);
+	}
+
+	return i;
+}
+
 /*
  * smb_utf16_bytes() - how long will a string be after conversion?
  * @from:	pointer to input string
@@ -53,7 +179,10 @@ static int smb_utf16_bytes(const __le16 *from, int maxbytes,
 	char tmp[NLS_MAX_CHARSET_SIZE];
 	__u16 ftmp;
 
-	for (i = 0; i < maxwords; i++) {
+	i = smb_utf16_ascii_run(NULL, from, maxwords);
+	outlen = i;
+
+	for (; i < maxwords; i++) {
 		ftmp = get_unaligned_le16(&from[i]);
 		if (ftmp == 0)
 			break;
@@ -191,7 +320,11 @@ static int smb_from_utf16(char *to, const __le16 *from, int tolen, int fromlen,
 	 */
 	safelen = tolen - (NLS_MAX_CHARSET_SIZE + nullsize);
 
-	for (i = 0; i < fromwords; i++) {
+	/* ASCII narrows to exactly one byte per code unit */
+	outlen = smb_utf16_ascii_run(to, from,
+				     max(0, min(fromwords, tolen - nullsize)));
+
+	for (i = outlen; i < fromwords; i++) {
 		ftmp = get_unaligned_le16(&from[i]);
 		if (ftmp == 0)
 			break;
@@ -232,8 +365,18 @@ int smb_strtoUTF16(__le16 *to, const char *from, int len,
 {
 	int charlen;
 	int i;
+	int ascii;
 	wchar_t wchar_to; /* needed to quiet sparse */
 
+	ascii = smb_ascii_to_utf16_run(to, from, len, false);
+	to += ascii;
+	from += ascii;
+	len -= ascii;
+	if (!len || !*from) {
+		i = 0;
+		goto success;
+	}
+
 	/* special case for utf8 to handle no plane0 chars */
 	if (!strcmp(codepage->charset, "utf8")) {
 		/*
@@ -267,7 +410,7 @@ int smb_strtoUTF16(__le16 *to, const char *from, int len,
 
 success:
 	put_unaligned_le16(0, &to[i]);
-	return i;
+	return ascii + i;
 }
 
 /*
@@ -315,6 +458,35 @@ char *smb_strndup_from_utf16(const char *src, const int maxlen,
 	return dst;
 }
 
+/*
+ * smb_strndup_from_utf16_scratch() - copy a utf16 string from wire format to
+ *		the local codepage in the scratch arena of a work
+ * @work:	smb work
+ * @src:	source string
+ * @maxlen:	don't walk past this many bytes in the source string
+ * @codepage:	destination codepage
+ *
+ * Like smb_strndup_from_utf16(), but the result is released with
+ * ksmbd_scratch_free().
+ *
+ * Return:	destination string buffer or error ptr
+ */
+char *smb_strndup_from_utf16_scratch(struct ksmbd_work *work, const char *src,
+				     const int maxlen,
+				     const struct nls_table *codepage)
+{
+	int len;
+	char *dst;
+
+	len = smb_utf16_bytes((__le16 *)src, maxlen, codepage);
+	len += nls_nullsize(codepage);
+	dst = ksmbd_scratch_alloc(work, len);
+	if (!dst)
+		return ERR_PTR(-ENOMEM);
+	smb_from_utf16(dst, (__le16 *)src, len, maxlen, codepage, false);
+	return dst;
+}
+
 /*
  * Convert 16 bit Unicode pathname to wire format from string in current code
  * page. Conversion may involve remapping up the six characters that are
@@ -347,7 +519,8 @@ int smbConvertToUTF16(__le16 *target, const char *source, int srclen,
 	if (!mapchars)
 		return smb_strtoUTF16(target, source, srclen, cp);
 
-	for (i = 0, j = 0; i < srclen; j++) {
+	i = smb_ascii_to_utf16_run(target, source, srclen, true);
+	for (j = i; i < srclen; j++) {
 		src_char = source[i];
 		charlen = 1;
 		switch (src_char) {
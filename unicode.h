@@ -71,6 +71,10 @@ int smb_strtoUTF16(__le16 *to, const char *from, int len,
 char *smb_strndup_from_utf16(const char *src, const int maxlen,
 			     const bool is_unicode,
 			     const struct nls_table *codepage);
+struct ksmbd_work;
+char *smb_strndup_from_utf16_scratch(struct ksmbd_work *work, const char *src,
+				     const int maxlen,
+				     const struct nls_table *codepage);
 int smbConvertToUTF16(__le16 *target, const char *source, int srclen,
 		      const struct nls_table *cp, int mapchars);
 char *ksmbd_extract_sharename(struct unicode_map *um, const char *treename);
@@ -20,6 +20,7 @@
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/crc32c.h>
+#include <linux/hash.h>
 #include <linux/sched/xacct.h>
 
 #include "glob.h"
@@ -396,6 +397,41 @@ out:
 	return error;
 }
 
+/*
+ * Read from the page cache without waiting for I/O. A short read that
+ * doesn't reach EOF means part of the range isn't cached yet.
+ */
+static ssize_t ksmbd_vfs_read_nowait(struct file *filp, char *buf,
+				     size_t count, loff_t *pos)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	struct kvec iov = { .iov_base = buf, .iov_len = count };
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	ssize_t nbytes;
+
+	if (!(filp->f_mode & FMODE_NOWAIT))
+		return -EAGAIN;
+
+	init_sync_kiocb(&kiocb, filp);
+	kiocb.ki_flags |= IOCB_NOWAIT;
+	kiocb.ki_pos = *pos;
+	iov_iter_kvec(&iter, READ, &iov, 1, count);
+
+	nbytes = vfs_iocb_iter_read(filp, &kiocb, &iter);
+	if (nbytes < 0)
+		return -EAGAIN;
+	if (nbytes < count &&
+	    kiocb.ki_pos < i_size_read(file_inode(filp)))
+		return -EAGAIN;
+
+	*pos = kiocb.ki_pos;
+	return nbytes;
+#else
+	return -EAGAIN;
+#endif
+}
+
 /**
  * ksmbd_vfs_read() - vfs helper for smb file read
  * @work:	smb work
@@ -403,6 +439,9 @@ out:
  * @count:	read byte count
  * @pos:	file pos
  *
+ * When executed in the receiving thread, the read is only served from the
+ * page cache and -EAGAIN is returned if it would block.
+ *
  * Return:	number of read bytes on success, otherwise error
  */
 int ksmbd_vfs_read(struct ksmbd_work *work, struct ksmbd_file *fp, size_t count,
@@ -439,7 +478,13 @@ int ksmbd_vfs_read(struct ksmbd_work *work, struct ksmbd_file *fp, size_t count,
 		}
 	}
 
-	nbytes = kernel_read(filp, rbuf, count, pos);
+	if (work->inline_exec) {
+		nbytes = ksmbd_vfs_read_nowait(filp, rbuf, count, pos);
+		if (nbytes < 0)
+			return nbytes;
+	} else {
+		nbytes = kernel_read(filp, rbuf, count, pos);
+	}
 	if (nbytes < 0) {
 		pr_err("smb read failed, err = %zd\n", nbytes);
 		return nbytes;
@@ -822,38 +867,49 @@ int ksmbd_vfs_readlink(struct path *path, char *buf, int lenp)
 #endif
 }
 
+/**
+ * ksmbd_vfs_readdir_name() - get attributes of a directory entry
+ * @work:	smb work
+ * @user_ns:	user namespace of the directory mount
+ * @ksmbd_kstat:	ksmbd kstat wrapper to fill
+ * @de_name:	entry name returned by iterate_dir()
+ * @de_name_len:	length of @de_name
+ * @dir:	dentry of the directory being enumerated
+ *
+ * The name comes straight from the directory, so it is looked up in the
+ * directory itself rather than by walking the full path from the share
+ * root again.
+ *
+ * Return:	0 on success, otherwise error
+ */
 int ksmbd_vfs_readdir_name(struct ksmbd_work *work,
 			   struct user_namespace *user_ns,
 			   struct ksmbd_kstat *ksmbd_kstat,
 			   const char *de_name, int de_name_len,
-			   const char *dir_path)
+			   struct dentry *dir)
 {
-	struct path path;
-	int rc, file_pathlen, dir_pathlen;
-	char *name;
-
-	dir_pathlen = strlen(dir_path);
-	/* 1 for '/'*/
-	file_pathlen = dir_pathlen +  de_name_len + 1;
-	name = kmalloc(file_pathlen + 1, GFP_KERNEL);
-	if (!name)
-		return -ENOMEM;
+	struct dentry *dent;
 
-	memcpy(name, dir_path, dir_pathlen);
-	memset(name + dir_pathlen, '/', 1);
-	memcpy(name + dir_pathlen + 1, de_name, de_name_len);
-	name[file_pathlen] = '\0';
+	inode_lock_nested(d_inode(dir), I_MUTEX_PARENT);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 15, 0)
+	dent = lookup_one(user_ns, de_name, dir, de_name_len);
+#else
+	dent = lookup_one_len(de_name, dir, de_name_len);
+#endif
+	inode_unlock(d_inode(dir));
+	if (IS_ERR(dent)) {
+		ksmbd_debug(VFS, "lookup failed: %.*s [%ld]\n",
+			    de_name_len, de_name, PTR_ERR(dent));
+		return PTR_ERR(dent);
+	}
 
-	rc = ksmbd_vfs_kern_path(work, name, LOOKUP_NO_SYMLINKS, &path, 1);
-	if (rc) {
-		pr_err("lookup failed: %s [%d]\n", name, rc);
-		kfree(name);
-		return -ENOMEM;
+	if (d_is_negative(dent)) {
+		dput(dent);
+		return -ENOENT;
 	}
 
-	ksmbd_vfs_fill_dentry_attrs(work, user_ns, path.dentry, ksmbd_kstat);
-	path_put(&path);
-	kfree(name);
+	ksmbd_vfs_fill_dentry_attrs(work, user_ns, dent, ksmbd_kstat);
+	dput(dent);
 	return 0;
 }
 #endif
@@ -1006,7 +1062,8 @@ out1:
 	return err;
 }
 
-static int ksmbd_validate_entry_in_use(struct dentry *src_dent)
+static int ksmbd_validate_entry_in_use(struct ksmbd_work *work,
+				       struct dentry *src_dent)
 {
 	struct dentry *dst_dent;
 
@@ -1020,6 +1077,7 @@ static int ksmbd_validate_entry_in_use(struct dentry *src_dent)
 		child_fp = ksmbd_lookup_fd_inode(d_inode(dst_dent));
 		if (child_fp) {
 			spin_unlock(&src_dent->d_lock);
+			ksmbd_fd_put(work, child_fp);
 			ksmbd_debug(VFS, "Forbid rename, sub file/dir is in use\n");
 			return -EACCES;
 		}
@@ -1041,8 +1099,17 @@ static int __ksmbd_vfs_rename(struct ksmbd_work *work,
 	struct dentry *dst_dent;
 	int err;
 
-	if (!work->tcon->posix_extensions) {
-		err = ksmbd_validate_entry_in_use(src_dent);
+	/*
+	 * Files opened through the directory spare the walk. Without any,
+	 * files may still have been moved into it by other programs.
+	 */
+	if (!work->tcon->posix_extensions &&
+	    d_really_is_positive(src_dent)) {
+		if (ksmbd_dir_has_open_children(d_inode(src_dent))) {
+			ksmbd_debug(VFS, "Forbid rename, sub file/dir is in use\n");
+			return -EACCES;
+		}
+		err = ksmbd_validate_entry_in_use(work, src_dent);
 		if (err)
 			return err;
 	}
@@ -1165,6 +1232,8 @@ out_lock:
 	dput(src_dent);
 	dput(dst_dent_parent);
 	unlock_rename(src_dent_parent, dst_dent_parent);
+	if (!err && src_dent_parent != dst_dent_parent)
+		ksmbd_fd_set_parent(fp, d_inode(dst_dent_parent));
 	path_put(&dst_path);
 out:
 	dput(src_dent_parent);
@@ -1297,6 +1366,113 @@ ssize_t ksmbd_vfs_getxattr(struct user_namespace *user_ns,
 	return xattr_len;
 }
 
+/* the user.* xattrs other than the DOS attributes are streams and EAs */
+static bool ksmbd_vfs_xattr_exposed(const char *name)
+{
+	return !strncmp(name, XATTR_USER_PREFIX, XATTR_USER_PREFIX_LEN) &&
+		strncmp(&name[XATTR_USER_PREFIX_LEN], DOS_ATTRIBUTE_PREFIX,
+			DOS_ATTRIBUTE_PREFIX_LEN);
+}
+
+/**
+ * ksmbd_vfs_xattr_snapshot() - read the xattrs exposed as streams and EAs
+ * @user_ns:	user namespace
+ * @dentry:	dentry of file
+ *
+ * Collects the names and value lengths of the exposed xattrs of @dentry,
+ * along with the values of up to KSMBD_XATTR_INLINE_MAX bytes. The
+ * snapshot is released with ksmbd_vfs_put_xattr_snapshot().
+ *
+ * Return:	snapshot on success, otherwise error pointer
+ */
+struct ksmbd_xattr_snap *ksmbd_vfs_xattr_snapshot(struct user_namespace *user_ns,
+						 struct dentry *dentry)
+{
+	struct ksmbd_xattr_snap *snap, *tmp;
+	struct ksmbd_xattr_entry *ent;
+	char *name, *p, *xattr_list = NULL;
+	ssize_t xattr_list_len, len;
+	size_t size, name_len;
+	int i, nr = 0;
+
+	xattr_list_len = ksmbd_vfs_listxattr(dentry, &xattr_list);
+	if (xattr_list_len < 0)
+		return ERR_PTR(xattr_list_len);
+
+	size = 0;
+	for (name = xattr_list; name - xattr_list < xattr_list_len;
+	     name += strlen(name) + 1) {
+		if (!ksmbd_vfs_xattr_exposed(name))
+			continue;
+		size += strlen(name) + 1 + KSMBD_XATTR_INLINE_MAX;
+		nr++;
+	}
+
+	/* small values are read straight into their room */
+	tmp = kvmalloc(struct_size(tmp, ents, nr) + size, GFP_KERNEL);
+	if (!tmp) {
+		kvfree(xattr_list);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	p = (char *)&tmp->ents[nr];
+	ent = tmp->ents;
+	for (name = xattr_list; name - xattr_list < xattr_list_len;
+	     name += strlen(name) + 1) {
+		if (!ksmbd_vfs_xattr_exposed(name))
+			continue;
+
+		name_len = strlen(name) + 1;
+		ent->name = memcpy(p, name, name_len);
+		p += name_len;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
+		len = vfs_getxattr(user_ns, dentry, name, p,
+				   KSMBD_XATTR_INLINE_MAX);
+#else
+		len = vfs_getxattr(dentry, name, p, KSMBD_XATTR_INLINE_MAX);
+#endif
+		if (len >= 0) {
+			ent->value = p;
+			p += len;
+		} else if (len == -ERANGE) {
+			ent->value = NULL;
+			len = ksmbd_vfs_xattr_len(user_ns, dentry, name);
+		}
+		if (len < 0) {
+			/* removed since listed */
+			p = ent->name;
+			continue;
+		}
+		ent->value_len = len;
+		ent++;
+	}
+	kvfree(xattr_list);
+
+	tmp->nr = ent - tmp->ents;
+	tmp->size = p - (char *)tmp;
+	refcount_set(&tmp->refcount, 1);
+
+	/* keep only the room actually used */
+	snap = kvmalloc(tmp->size, GFP_KERNEL);
+	if (!snap)
+		return tmp;
+	memcpy(snap, tmp, tmp->size);
+	for (i = 0; i < snap->nr; i++) {
+		ent = &snap->ents[i];
+		ent->name = (char *)snap + (ent->name - (char *)tmp);
+		if (ent->value)
+			ent->value = (char *)snap + (ent->value - (char *)tmp);
+	}
+	kvfree(tmp);
+	return snap;
+}
+
+void ksmbd_vfs_put_xattr_snapshot(struct ksmbd_xattr_snap *snap)
+{
+	if (snap && refcount_dec_and_test(&snap->refcount))
+		kvfree(snap);
+}
+
 /**
  * ksmbd_vfs_setxattr() - vfs helper for smb set extended attributes value
  * @user_ns:	user namespace
@@ -1330,6 +1506,8 @@ int ksmbd_vfs_setxattr(struct user_namespace *user_ns,
 			   flags);
 	if (err)
 		ksmbd_debug(VFS, "setxattr failed, err %d\n", err);
+	if (ksmbd_vfs_xattr_exposed(attr_name))
+		ksmbd_inode_xattrs_changed(d_inode(dentry));
 	return err;
 }
 
@@ -1363,6 +1541,8 @@ int ksmbd_vfs_fsetxattr(struct ksmbd_work *work, const char *filename,
 			   flags);
 	if (err)
 		ksmbd_debug(VFS, "setxattr failed, err %d\n", err);
+	if (ksmbd_vfs_xattr_exposed(attr_name))
+		ksmbd_inode_xattrs_changed(d_inode(path.dentry));
 	path_put(&path);
 	ksmbd_revert_fsids(work);
 	return err;
@@ -1380,6 +1560,8 @@ struct dentry *ksmbd_vfs_kern_path_create(struct ksmbd_work *work,
 	abs_name = convert_to_unix_name(work->tcon->share_conf, name);
 	if (!abs_name)
 		return ERR_PTR(-ENOMEM);
+	if (IS_ERR(abs_name))
+		return ERR_CAST(abs_name);
 
 	dent = kern_path_create(AT_FDCWD, abs_name, path, flags);
 	kfree(abs_name);
@@ -1424,6 +1606,286 @@ out:
 	return err;
 }
 
+/*
+ * Consolidated metadata xattr, see XATTR_NAME_META. It is only looked for
+ * on the filesystems of shares using it, so that other shares don't pay
+ * for an extra xattr lookup. Files of such a filesystem may have a record
+ * whichever share they are reached through.
+ */
+struct ksmbd_meta_sb {
+	struct list_head	list;
+	struct super_block	*sb;
+	unsigned int		nr_shares;
+};
+
+static LIST_HEAD(meta_xattr_sbs);
+static DEFINE_SPINLOCK(meta_xattr_sbs_lock);
+static unsigned int nr_meta_xattr_sbs;
+
+/*
+ * Serialize read-modify-write updates of the record of an inode. The
+ * inode lock can't be used, vfs_setxattr() takes it.
+ */
+#define META_XATTR_LOCK_BITS	6
+static struct mutex meta_xattr_locks[1 << META_XATTR_LOCK_BITS];
+
+/* metadata of files being created, written by ksmbd_vfs_meta_batch_end() */
+static LIST_HEAD(meta_batch_list);
+static DEFINE_SPINLOCK(meta_batch_lock);
+
+void ksmbd_vfs_meta_xattr_init(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(meta_xattr_locks); i++)
+		mutex_init(&meta_xattr_locks[i]);
+}
+
+static struct mutex *meta_xattr_lock(struct dentry *dentry)
+{
+	return &meta_xattr_locks[hash_ptr(d_inode(dentry),
+					  META_XATTR_LOCK_BITS)];
+}
+
+static struct ksmbd_meta_sb *__meta_xattr_sb(struct super_block *sb)
+{
+	struct ksmbd_meta_sb *msb;
+
+	list_for_each_entry(msb, &meta_xattr_sbs, list) {
+		if (msb->sb == sb)
+			return msb;
+	}
+	return NULL;
+}
+
+/**
+ * ksmbd_vfs_enable_meta_xattr() - look for metadata records on a filesystem
+ * @sb:		superblock of the path of a share using them
+ *
+ * Return:	0 on success, otherwise error
+ */
+int ksmbd_vfs_enable_meta_xattr(struct super_block *sb)
+{
+	struct ksmbd_meta_sb *msb, *new;
+
+	new = kzalloc(sizeof(struct ksmbd_meta_sb), GFP_KERNEL);
+	if (!new)
+		return -ENOMEM;
+
+	spin_lock(&meta_xattr_sbs_lock);
+	msb = __meta_xattr_sb(sb);
+	if (!msb) {
+		msb = new;
+		new = NULL;
+		msb->sb = sb;
+		list_add(&msb->list, &meta_xattr_sbs);
+		WRITE_ONCE(nr_meta_xattr_sbs, nr_meta_xattr_sbs + 1);
+	}
+	msb->nr_shares++;
+	spin_unlock(&meta_xattr_sbs_lock);
+	kfree(new);
+	return 0;
+}
+
+void ksmbd_vfs_disable_meta_xattr(struct super_block *sb)
+{
+	struct ksmbd_meta_sb *msb;
+
+	spin_lock(&meta_xattr_sbs_lock);
+	msb = __meta_xattr_sb(sb);
+	if (msb && !--msb->nr_shares) {
+		list_del(&msb->list);
+		WRITE_ONCE(nr_meta_xattr_sbs, nr_meta_xattr_sbs - 1);
+	} else {
+		msb = NULL;
+	}
+	spin_unlock(&meta_xattr_sbs_lock);
+	kfree(msb);
+}
+
+static bool meta_xattr_used(struct dentry *dentry)
+{
+	bool used;
+
+	if (!READ_ONCE(nr_meta_xattr_sbs))
+		return false;
+
+	spin_lock(&meta_xattr_sbs_lock);
+	used = __meta_xattr_sb(dentry->d_sb) != NULL;
+	spin_unlock(&meta_xattr_sbs_lock);
+	return used;
+}
+
+/*
+ * Read the metadata record of @dentry. On success @dos and @acl point
+ * into @rec, which the caller has to free.
+ */
+static int ksmbd_vfs_get_meta_xattr(struct user_namespace *user_ns,
+				    struct dentry *dentry, struct ndr *rec,
+				    struct ndr *dos, struct ndr *acl)
+{
+	int rc;
+
+	rec->data = NULL;
+	memset(dos, 0, sizeof(*dos));
+	memset(acl, 0, sizeof(*acl));
+	if (!meta_xattr_used(dentry))
+		return -ENODATA;
+
+	rc = ksmbd_vfs_getxattr(user_ns, dentry, XATTR_NAME_META, &rec->data);
+	if (rc <= 0)
+		return rc ? rc : -ENODATA;
+
+	rec->length = rc;
+	rc = ndr_decode_meta(rec, dos, acl);
+	if (rc) {
+		kfree(rec->data);
+		rec->data = NULL;
+	}
+	return rc;
+}
+
+#define META_KEEP	NULL
+#define META_CLEAR	ERR_PTR(-ENODATA)
+
+/*
+ * Replace parts of the metadata record of @dentry. META_KEEP keeps a part
+ * and META_CLEAR drops it. Unless @create is set, -ENODATA is returned if
+ * the file has no record so that the caller can use the legacy xattrs.
+ */
+static int ksmbd_vfs_update_meta_xattr(struct user_namespace *user_ns,
+				       struct dentry *dentry,
+				       struct ndr *new_dos,
+				       struct ndr *new_acl, bool create)
+{
+	struct ndr rec, dos, acl, out = {0};
+	int rc;
+
+	mutex_lock(meta_xattr_lock(dentry));
+	rc = ksmbd_vfs_get_meta_xattr(user_ns, dentry, &rec, &dos, &acl);
+	if (rc && (rc != -ENODATA || !create))
+		goto out;
+
+	if (new_dos == META_CLEAR)
+		dos.data = NULL;
+	else if (new_dos)
+		dos = *new_dos;
+	if (new_acl == META_CLEAR)
+		acl.data = NULL;
+	else if (new_acl)
+		acl = *new_acl;
+	/* parts of the old record are views, mark them fully used */
+	if (dos.data && new_dos == META_KEEP)
+		dos.offset = dos.length;
+	if (acl.data && new_acl == META_KEEP)
+		acl.offset = acl.length;
+
+	if (!dos.data && !acl.data) {
+		rc = ksmbd_vfs_remove_xattr(user_ns, dentry, XATTR_NAME_META);
+		goto out;
+	}
+
+	rc = ndr_encode_meta(&out, &dos, &acl);
+	if (!rc)
+		rc = ksmbd_vfs_setxattr(user_ns, dentry, XATTR_NAME_META,
+					out.data, out.offset, 0);
+	kfree(out.data);
+out:
+	mutex_unlock(meta_xattr_lock(dentry));
+	kfree(rec.data);
+	return rc;
+}
+
+/**
+ * ksmbd_vfs_meta_batch_begin() - collect the metadata of a new file
+ * @batch:	batch to initialize
+ * @dentry:	dentry of the file being created
+ *
+ * Until ksmbd_vfs_meta_batch_end() is called, dos attributes and ntacls
+ * stored for @dentry are kept in @batch and then written as a single
+ * metadata record.
+ */
+void ksmbd_vfs_meta_batch_begin(struct ksmbd_meta_batch *batch,
+				struct dentry *dentry)
+{
+	memset(batch, 0, sizeof(*batch));
+	batch->dentry = dentry;
+	spin_lock(&meta_batch_lock);
+	list_add(&batch->list, &meta_batch_list);
+	spin_unlock(&meta_batch_lock);
+}
+
+int ksmbd_vfs_meta_batch_end(struct user_namespace *user_ns,
+			     struct ksmbd_meta_batch *batch)
+{
+	int rc = 0;
+
+	if (!batch->dentry)
+		return 0;
+
+	spin_lock(&meta_batch_lock);
+	list_del(&batch->list);
+	spin_unlock(&meta_batch_lock);
+
+	if (batch->dos.data || batch->acl.data) {
+		rc = ksmbd_vfs_update_meta_xattr(user_ns, batch->dentry,
+						 batch->dos.data ? &batch->dos : META_KEEP,
+						 batch->acl.data ? &batch->acl : META_KEEP,
+						 true);
+		if (rc)
+			pr_err("failed to store metadata xattr : %d\n", rc);
+	}
+	kfree(batch->dos.data);
+	kfree(batch->acl.data);
+	batch->dentry = NULL;
+	return rc;
+}
+
+/*
+ * Hand an encoded part over to the batch of a file being created. The
+ * ntacl moves to the batch on success, the small dos attributes blob,
+ * usually encoded on the caller's stack, is copied.
+ */
+static bool ksmbd_vfs_meta_batch_stash(struct dentry *dentry,
+				       struct ndr *dos, struct ndr *acl)
+{
+	struct ksmbd_meta_batch *batch;
+	char *dos_data = NULL;
+	bool found = false;
+
+	if (list_empty_careful(&meta_batch_list))
+		return false;
+
+	if (dos) {
+		dos_data = kmemdup(dos->data, dos->offset, GFP_KERNEL);
+		if (!dos_data)
+			return false;
+	}
+
+	spin_lock(&meta_batch_lock);
+	list_for_each_entry(batch, &meta_batch_list, list) {
+		if (batch->dentry != dentry)
+			continue;
+
+		if (dos) {
+			kfree(batch->dos.data);
+			ndr_init(&batch->dos, dos_data, dos->offset);
+			batch->dos.offset = dos->offset;
+			dos_data = NULL;
+		}
+		if (acl) {
+			kfree(batch->acl.data);
+			batch->acl = *acl;
+			acl->data = NULL;
+		}
+		found = true;
+		break;
+	}
+	spin_unlock(&meta_batch_lock);
+	kfree(dos_data);
+	return found;
+}
+
 int ksmbd_vfs_remove_sd_xattrs(struct user_namespace *user_ns,
 			       struct dentry *dentry)
 {
@@ -1449,8 +1911,18 @@ int ksmbd_vfs_remove_sd_xattrs(struct user_namespace *user_ns,
 				ksmbd_debug(SMB, "remove xattr failed : %s\n", name);
 		}
 	}
+	ksmbd_acl_cache_invalidate(d_inode(dentry));
 out:
 	kvfree(xattr_list);
+
+	if (meta_xattr_used(dentry)) {
+		int rc;
+
+		rc = ksmbd_vfs_update_meta_xattr(user_ns, dentry, META_KEEP,
+						 META_CLEAR, false);
+		if (rc && rc != -ENODATA)
+			err = rc;
+	}
 	return err;
 }
 
@@ -1523,6 +1995,10 @@ out:
 	return smb_acl;
 }
 
+/*
+ * The acl caches are left alone, a new inode has no cached decisions.
+ * Callers replacing the descriptor of an existing inode invalidate them.
+ */
 int ksmbd_vfs_set_sd_xattr(struct ksmbd_conn *conn,
 			   struct user_namespace *user_ns,
 			   struct dentry *dentry,
@@ -1583,9 +2059,17 @@ int ksmbd_vfs_set_sd_xattr(struct ksmbd_conn *conn,
 		goto out;
 	}
 
-	rc = ksmbd_vfs_setxattr(user_ns, dentry,
-				XATTR_NAME_SD, sd_ndr.data,
-				sd_ndr.offset, 0);
+	if (ksmbd_vfs_meta_batch_stash(dentry, NULL, &sd_ndr))
+		goto out;
+
+	rc = -ENODATA;
+	if (meta_xattr_used(dentry))
+		rc = ksmbd_vfs_update_meta_xattr(user_ns, dentry, META_KEEP,
+						 &sd_ndr, false);
+	if (rc == -ENODATA)
+		rc = ksmbd_vfs_setxattr(user_ns, dentry,
+					XATTR_NAME_SD, sd_ndr.data,
+					sd_ndr.offset, 0);
 	if (rc < 0)
 		pr_err("Failed to store XATTR ntacl :%d\n", rc);
 
@@ -1597,27 +2081,26 @@ out:
 	return rc;
 }
 
-int ksmbd_vfs_get_sd_xattr(struct ksmbd_conn *conn,
-			   struct user_namespace *user_ns,
-			   struct dentry *dentry,
-			   struct smb_ntsd **pntsd)
+/*
+ * Decode the ntacl in @n, which lies inside @buf. On success the security
+ * descriptor is moved to the start of @buf and @buf is handed out through
+ * @pntsd, so the caller must not free it.
+ */
+static int ksmbd_vfs_decode_sd(struct ksmbd_conn *conn,
+			       struct user_namespace *user_ns,
+			       struct dentry *dentry, struct ndr *n,
+			       char *buf, struct smb_ntsd **pntsd)
 {
 	int rc;
-	struct ndr n;
 	struct inode *inode = d_inode(dentry);
 	struct ndr acl_ndr = {0};
 	struct xattr_ntacl acl;
 	struct xattr_smb_acl *smb_acl = NULL, *def_smb_acl = NULL;
 	__u8 cmp_hash[XATTR_SD_HASH_SIZE] = {0};
 
-	rc = ksmbd_vfs_getxattr(user_ns, dentry, XATTR_NAME_SD, &n.data);
-	if (rc <= 0)
-		return rc;
-
-	n.length = rc;
-	rc = ndr_decode_v4_ntacl(&n, &acl);
+	rc = ndr_decode_v4_ntacl(n, &acl);
 	if (rc)
-		goto free_n_data;
+		return rc;
 
 	smb_acl = ksmbd_vfs_make_xattr_posix_acl(user_ns, inode,
 						 ACL_TYPE_ACCESS);
@@ -1644,12 +2127,14 @@ int ksmbd_vfs_get_sd_xattr(struct ksmbd_conn *conn,
 		goto out_free;
 	}
 
-	*pntsd = acl.sd_buf;
 	if (acl.sd_size < sizeof(struct smb_ntsd)) {
 		pr_err("sd size is invalid\n");
+		rc = -EINVAL;
 		goto out_free;
 	}
 
+	*pntsd = memmove(buf, acl.sd_buf, acl.sd_size);
+
 	(*pntsd)->osidoffset = cpu_to_le32(le32_to_cpu((*pntsd)->osidoffset) -
 					   NDR_NTSD_OFFSETOF);
 	(*pntsd)->gsidoffset = cpu_to_le32(le32_to_cpu((*pntsd)->gsidoffset) -
@@ -1662,13 +2147,36 @@ out_free:
 	kfree(acl_ndr.data);
 	kfree(smb_acl);
 	kfree(def_smb_acl);
-	if (rc < 0) {
-		kfree(acl.sd_buf);
-		*pntsd = NULL;
-	}
+	return rc;
+}
 
-free_n_data:
+int ksmbd_vfs_get_sd_xattr(struct ksmbd_conn *conn,
+			   struct user_namespace *user_ns,
+			   struct dentry *dentry,
+			   struct smb_ntsd **pntsd)
+{
+	struct ndr n, dos, acl;
+	int rc;
+
+	*pntsd = NULL;
+	rc = ksmbd_vfs_get_meta_xattr(user_ns, dentry, &n, &dos, &acl);
+	if (!rc && acl.data) {
+		rc = ksmbd_vfs_decode_sd(conn, user_ns, dentry, &acl, n.data,
+					 pntsd);
+		if (rc < 0)
+			kfree(n.data);
+		return rc;
+	}
 	kfree(n.data);
+
+	rc = ksmbd_vfs_getxattr(user_ns, dentry, XATTR_NAME_SD, &n.data);
+	if (rc <= 0)
+		return rc;
+
+	n.length = rc;
+	rc = ksmbd_vfs_decode_sd(conn, user_ns, dentry, &n, n.data, pntsd);
+	if (rc < 0)
+		kfree(n.data);
 	return rc;
 }
 
@@ -1676,18 +2184,28 @@ int ksmbd_vfs_set_dos_attrib_xattr(struct user_namespace *user_ns,
 				   struct dentry *dentry,
 				   struct xattr_dos_attrib *da)
 {
+	char buf[NDR_DOS_ATTR_MAX_SIZE];
 	struct ndr n;
 	int err;
 
+	ndr_init(&n, buf, sizeof(buf));
 	err = ndr_encode_dos_attr(&n, da);
 	if (err)
 		return err;
 
-	err = ksmbd_vfs_setxattr(user_ns, dentry, XATTR_NAME_DOS_ATTRIBUTE,
-				 (void *)n.data, n.offset, 0);
+	if (ksmbd_vfs_meta_batch_stash(dentry, &n, NULL))
+		return 0;
+
+	err = -ENODATA;
+	if (meta_xattr_used(dentry))
+		err = ksmbd_vfs_update_meta_xattr(user_ns, dentry, &n,
+						  META_KEEP, false);
+	if (err == -ENODATA)
+		err = ksmbd_vfs_setxattr(user_ns, dentry,
+					 XATTR_NAME_DOS_ATTRIBUTE,
+					 (void *)n.data, n.offset, 0);
 	if (err)
 		ksmbd_debug(SMB, "failed to store dos attribute in xattr\n");
-	kfree(n.data);
 
 	return err;
 }
@@ -1696,9 +2214,19 @@ int ksmbd_vfs_get_dos_attrib_xattr(struct user_namespace *user_ns,
 				   struct dentry *dentry,
 				   struct xattr_dos_attrib *da)
 {
-	struct ndr n;
+	struct ndr n, dos, acl;
 	int err;
 
+	err = ksmbd_vfs_get_meta_xattr(user_ns, dentry, &n, &dos, &acl);
+	if (!err && dos.data) {
+		err = dos.length;
+		if (ndr_decode_dos_attr(&dos, da))
+			err = -EINVAL;
+		kfree(n.data);
+		return err;
+	}
+	kfree(n.data);
+
 	err = ksmbd_vfs_getxattr(user_ns, dentry, XATTR_NAME_DOS_ATTRIBUTE,
 				 (char **)&n.data);
 	if (err > 0) {
@@ -1762,7 +2290,7 @@ int ksmbd_vfs_fqar_lseek(struct ksmbd_file *fp, loff_t start, loff_t length,
 	struct file *f = fp->filp;
 	struct inode *inode = file_inode(fp->filp);
 	loff_t maxbytes = (u64)inode->i_sb->s_maxbytes, end;
-	loff_t extent_start, extent_end;
+	loff_t extent_start, extent_end, pos, isize;
 	int ret = 0;
 
 	if (start > maxbytes)
@@ -1777,12 +2305,34 @@ int ksmbd_vfs_fqar_lseek(struct ksmbd_file *fp, loff_t start, loff_t length,
 	if (length > maxbytes || (maxbytes - length) < start)
 		length = maxbytes - start;
 
-	if (start + length > inode->i_size)
-		length = inode->i_size - start;
-
 	*out_count = 0;
+	isize = i_size_read(inode);
+	if (start >= isize)
+		return 0;
+
+	if (length > isize - start)
+		length = isize - start;
+
 	end = start + length;
-	while (start < end && *out_count < in_count) {
+	if (start >= end)
+		return 0;
+
+	/*
+	 * A file not marked sparse with blocks for every byte up to EOF is
+	 * reported as one range without walking its extents.
+	 */
+	if (!(fp->f_ci->m_fattr & ATTR_SPARSE_FILE_LE) &&
+	    (u64)inode->i_blocks << 9 >= isize) {
+		ranges[0].file_offset = cpu_to_le64(start);
+		ranges[0].length = cpu_to_le64(length);
+		*out_count = 1;
+		return 0;
+	}
+
+	/* SEEK_DATA and SEEK_HOLE move the file position of the handle */
+	mutex_lock(&f->f_pos_lock);
+	pos = f->f_pos;
+	while (start < end) {
 		extent_start = vfs_llseek(f, start, SEEK_DATA);
 		if (extent_start < 0) {
 			if (extent_start != -ENXIO)
@@ -1802,12 +2352,19 @@ int ksmbd_vfs_fqar_lseek(struct ksmbd_file *fp, loff_t start, loff_t length,
 			break;
 		}
 
+		if (*out_count == in_count) {
+			ret = -E2BIG;
+			break;
+		}
+
 		ranges[*out_count].file_offset = cpu_to_le64(extent_start);
 		ranges[(*out_count)++].length =
 			cpu_to_le64(min(extent_end, end) - extent_start);
 
 		start = extent_end;
 	}
+	f->f_pos = pos;
+	mutex_unlock(&f->f_pos_lock);
 
 	return ret;
 }
@@ -1815,11 +2372,16 @@ int ksmbd_vfs_fqar_lseek(struct ksmbd_file *fp, loff_t start, loff_t length,
 int ksmbd_vfs_remove_xattr(struct user_namespace *user_ns,
 			   struct dentry *dentry, char *attr_name)
 {
+	int err;
+
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 12, 0)
-	return vfs_removexattr(user_ns, dentry, attr_name);
+	err = vfs_removexattr(user_ns, dentry, attr_name);
 #else
-	return vfs_removexattr(dentry, attr_name);
+	err = vfs_removexattr(dentry, attr_name);
 #endif
+	if (ksmbd_vfs_xattr_exposed(attr_name))
+		ksmbd_inode_xattrs_changed(d_inode(dentry));
+	return err;
 }
 
 int ksmbd_vfs_unlink(struct user_namespace *user_ns,
@@ -2055,11 +2617,12 @@ int ksmbd_vfs_kern_path(struct ksmbd_work *work, char *name,
 		struct path parent;
 		size_t path_len, remain_len;
 
-		filepath = kstrdup(name, GFP_KERNEL);
+		path_len = strlen(name);
+		filepath = ksmbd_scratch_alloc(work, path_len + 1);
 		if (!filepath)
 			return -ENOMEM;
+		memcpy(filepath, name, path_len + 1);
 
-		path_len = strlen(filepath);
 		remain_len = path_len;
 
 		parent = share_conf->vfs_path;
@@ -2102,7 +2665,7 @@ int ksmbd_vfs_kern_path(struct ksmbd_work *work, char *name,
 		path_put(&parent);
 		err = -EINVAL;
 out:
-		kfree(filepath);
+		ksmbd_scratch_free(work, filepath);
 	}
 	return err;
 }
@@ -13,9 +13,11 @@
 #include <uapi/linux/xattr.h>
 #include <linux/posix_acl.h>
 #include <linux/unicode.h>
+#include <linux/refcount.h>
 
 #include "smbacl.h"
 #include "xattr.h"
+#include "ndr.h"
 
 /*
  * Enumeration for stream type.
@@ -113,6 +115,32 @@ struct ksmbd_kstat {
 	__le32			file_attributes;
 };
 
+/* Values up to this size are kept in an xattr snapshot */
+#define KSMBD_XATTR_INLINE_MAX	256
+
+struct ksmbd_xattr_entry {
+	char			*name;
+	ssize_t			value_len;
+	/* NULL if the value is longer than KSMBD_XATTR_INLINE_MAX */
+	char			*value;
+};
+
+/*
+ * The user.* xattrs of a file which are exposed as streams and EAs, see
+ * ksmbd_vfs_xattr_snapshot(). Names and values follow the entries.
+ */
+struct ksmbd_xattr_snap {
+	refcount_t		refcount;
+	struct timespec64	ctime;
+	u64			iversion;
+	/* credentials the values were read with */
+	kuid_t			fsuid;
+	kgid_t			fsgid;
+	size_t			size;
+	int			nr;
+	struct ksmbd_xattr_entry	ents[];
+};
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(5, 12, 0)
 static inline struct user_namespace *mnt_user_ns(const struct vfsmount *mnt)
 {
@@ -152,7 +180,7 @@ int ksmbd_vfs_readdir_name(struct ksmbd_work *work,
 			   struct user_namespace *user_ns,
 			   struct ksmbd_kstat *ksmbd_kstat,
 			   const char *de_name, int de_name_len,
-			   const char *dir_path);
+			   struct dentry *dir);
 #endif
 int ksmbd_vfs_fp_rename(struct ksmbd_work *work, struct ksmbd_file *fp,
 			char *newname);
@@ -175,6 +203,9 @@ ssize_t ksmbd_vfs_getxattr(struct user_namespace *user_ns,
 			   struct dentry *dentry,
 			   char *xattr_name,
 			   char **xattr_buf);
+struct ksmbd_xattr_snap *ksmbd_vfs_xattr_snapshot(struct user_namespace *user_ns,
+						 struct dentry *dentry);
+void ksmbd_vfs_put_xattr_snapshot(struct ksmbd_xattr_snap *snap);
 ssize_t ksmbd_vfs_casexattr_len(struct user_namespace *user_ns,
 				struct dentry *dentry, char *attr_name,
 				int attr_name_len);
@@ -219,6 +250,24 @@ int ksmbd_vfs_posix_lock_wait_timeout(struct file_lock *flock, long timeout);
 void ksmbd_vfs_posix_lock_unblock(struct file_lock *flock);
 int ksmbd_vfs_remove_acl_xattrs(struct user_namespace *user_ns,
 				struct dentry *dentry);
+/*
+ * Metadata of a file being created, stored as one xattr record by
+ * ksmbd_vfs_meta_batch_end().
+ */
+struct ksmbd_meta_batch {
+	struct list_head	list;
+	struct dentry		*dentry;
+	struct ndr		dos;
+	struct ndr		acl;
+};
+
+void ksmbd_vfs_meta_xattr_init(void);
+int ksmbd_vfs_enable_meta_xattr(struct super_block *sb);
+void ksmbd_vfs_disable_meta_xattr(struct super_block *sb);
+void ksmbd_vfs_meta_batch_begin(struct ksmbd_meta_batch *batch,
+				struct dentry *dentry);
+int ksmbd_vfs_meta_batch_end(struct user_namespace *user_ns,
+			     struct ksmbd_meta_batch *batch);
 int ksmbd_vfs_remove_sd_xattrs(struct user_namespace *user_ns,
 			       struct dentry *dentry);
 int ksmbd_vfs_set_sd_xattr(struct ksmbd_conn *conn,
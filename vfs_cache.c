@@ -7,6 +7,8 @@
 #include <linux/fs.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/hashtable.h>
+#include <linux/iversion.h>
 
 #include "glob.h"
 #include "vfs_cache.h"
@@ -16,6 +18,7 @@
 #include "mgmt/tree_connect.h"
 #include "mgmt/user_session.h"
 #include "smb_common.h"
+#include "misc.h"
 
 #define S_DEL_PENDING			1
 #define S_DEL_ON_CLS			2
@@ -26,6 +29,29 @@ static unsigned int inode_hash_shift __read_mostly;
 static struct hlist_head *inode_hashtable __read_mostly;
 static DEFINE_RWLOCK(inode_hash_lock);
 
+/*
+ * Number of files open under a directory. It lets a rename skip walking
+ * the dentries of a directory none of whose files are open. It is only a
+ * hint: files renamed by other programs keep counting against their old
+ * directory, so a rename confirms a non-zero count by walking them.
+ * Each open counts against the directory it was opened through, so that
+ * the links of a file in different directories are all accounted for.
+ */
+struct ksmbd_dir_count {
+	struct hlist_node	d_hash;
+	struct inode		*d_inode;
+	refcount_t		d_count;
+	struct rcu_head		d_rcu;
+};
+
+#define DIR_COUNT_HASH_BITS	10
+static DEFINE_HASHTABLE(dir_count_table, DIR_COUNT_HASH_BITS);
+/* serialize inserting and removing entries of a bucket */
+static spinlock_t dir_count_locks[1 << DIR_COUNT_HASH_BITS] = {
+	[0 ... (1 << DIR_COUNT_HASH_BITS) - 1] =
+		__SPIN_LOCK_UNLOCKED(dir_count_locks)
+};
+
 static struct ksmbd_file_table global_ft;
 static atomic_long_t fd_limit;
 static struct kmem_cache *filp_cache;
@@ -51,6 +77,140 @@ static void fd_limit_close(void)
 	atomic_long_inc(&fd_limit);
 }
 
+static spinlock_t *dir_count_lock(struct inode *dir)
+{
+	return &dir_count_locks[hash_min((unsigned long)dir,
+					 DIR_COUNT_HASH_BITS)];
+}
+
+/* Entries whose count dropped to zero may still be seen under rcu. */
+static struct ksmbd_dir_count *__ksmbd_dir_count_lookup(struct inode *dir)
+{
+	struct ksmbd_dir_count *dc;
+
+	hash_for_each_possible_rcu(dir_count_table, dc, d_hash,
+				   (unsigned long)dir) {
+		if (dc->d_inode == dir)
+			return dc;
+	}
+	return NULL;
+}
+
+static struct ksmbd_dir_count *ksmbd_dir_count_get(struct inode *dir)
+{
+	struct ksmbd_dir_count *dc, *new;
+
+	rcu_read_lock();
+	dc = __ksmbd_dir_count_lookup(dir);
+	if (dc && refcount_inc_not_zero(&dc->d_count)) {
+		rcu_read_unlock();
+		return dc;
+	}
+	rcu_read_unlock();
+
+	new = kmalloc(sizeof(struct ksmbd_dir_count), GFP_KERNEL);
+	if (!new)
+		return NULL;
+
+	spin_lock(dir_count_lock(dir));
+	/* entries are removed under the lock once their count is zero */
+	dc = __ksmbd_dir_count_lookup(dir);
+	if (dc) {
+		refcount_inc(&dc->d_count);
+	} else {
+		dc = new;
+		new = NULL;
+		ihold(dir);
+		dc->d_inode = dir;
+		refcount_set(&dc->d_count, 1);
+		hash_add_rcu(dir_count_table, &dc->d_hash, (unsigned long)dir);
+	}
+	spin_unlock(dir_count_lock(dir));
+
+	kfree(new);
+	return dc;
+}
+
+static void ksmbd_dir_count_put(struct ksmbd_dir_count *dc)
+{
+	struct inode *dir;
+
+	if (!dc)
+		return;
+
+	dir = dc->d_inode;
+	if (!refcount_dec_and_lock(&dc->d_count, dir_count_lock(dir)))
+		return;
+	hash_del_rcu(&dc->d_hash);
+	spin_unlock(dir_count_lock(dir));
+
+	iput(dir);
+	kfree_rcu(dc, d_rcu);
+}
+
+/**
+ * ksmbd_dir_has_open_children() - check if files were opened through a
+ *				   directory
+ * @dir:	directory inode
+ *
+ * Opens are counted against the directory they were opened through. Files
+ * moved into @dir by other programs are not counted, so a false return
+ * doesn't mean no file under @dir is open.
+ *
+ * Return:	true if a file opened through @dir is still open
+ */
+bool ksmbd_dir_has_open_children(struct inode *dir)
+{
+	struct ksmbd_dir_count *dc;
+	bool ret;
+
+	rcu_read_lock();
+	dc = __ksmbd_dir_count_lookup(dir);
+	ret = dc && refcount_read(&dc->d_count);
+	rcu_read_unlock();
+	return ret;
+}
+
+/**
+ * ksmbd_fd_set_parent() - move the opens of a renamed file to the directory
+ *			   it was renamed into
+ * @fp:		ksmbd file pointer of the renamed file
+ * @dir:	new parent directory inode
+ *
+ * All opens through the renamed dentry move, the opens through other
+ * links of the file stay where they are.
+ */
+void ksmbd_fd_set_parent(struct ksmbd_file *fp, struct inode *dir)
+{
+	struct ksmbd_inode *ci = fp->f_ci;
+	struct dentry *dentry = fp->filp->f_path.dentry;
+	struct ksmbd_dir_count *dc, *old;
+	struct ksmbd_file *child;
+
+	dc = ksmbd_dir_count_get(dir);
+	if (!dc)
+		return;
+
+	/* a put may sleep, move one open at a time */
+	do {
+		old = NULL;
+		write_lock(&ci->m_lock);
+		list_for_each_entry(child, &ci->m_fp_list, node) {
+			if (child->filp->f_path.dentry != dentry ||
+			    child->f_parent == dc)
+				continue;
+			old = child->f_parent;
+			refcount_inc(&dc->d_count);
+			child->f_parent = dc;
+			break;
+		}
+		write_unlock(&ci->m_lock);
+		ksmbd_dir_count_put(old);
+	} while (old);
+
+	ksmbd_dir_count_put(dc);
+}
+
 /*
  * INODE hash
  */
@@ -139,6 +299,33 @@ void ksmbd_fd_set_delete_on_close(struct ksmbd_file *fp,
 	fp->f_ci->m_flags |= S_DEL_ON_CLS;
 }
 
+/**
+ * ksmbd_close_fd_may_block() - check whether closing an open file would
+ *				 have to wait
+ * @fp:		ksmbd file pointer
+ *
+ * A close which deletes the file or races with an oplock break in
+ * progress may sleep for a long time.
+ *
+ * Return:	true if the close may block, otherwise false
+ */
+bool ksmbd_close_fd_may_block(struct ksmbd_file *fp)
+{
+	struct oplock_info *opinfo;
+	bool ret;
+
+	if (fp->f_ci->m_flags &
+	    (S_DEL_PENDING | S_DEL_ON_CLS | S_DEL_ON_CLS_STREAM))
+		return true;
+
+	opinfo = opinfo_get(fp);
+	if (!opinfo)
+		return false;
+	ret = opinfo->op_state == OPLOCK_ACK_WAIT;
+	opinfo_put(opinfo);
+	return ret;
+}
+
 static void ksmbd_inode_hash(struct ksmbd_inode *ci)
 {
 	struct hlist_head *b = inode_hashtable +
@@ -165,6 +352,8 @@ static int ksmbd_inode_init(struct ksmbd_inode *ci, struct ksmbd_file *fp)
 	INIT_LIST_HEAD(&ci->m_fp_list);
 	INIT_LIST_HEAD(&ci->m_op_list);
 	rwlock_init(&ci->m_lock);
+	ci->m_xattrs = NULL;
+	ci->m_xattr_gen = 0;
 	return 0;
 }
 
@@ -192,19 +381,21 @@ static struct ksmbd_inode *ksmbd_inode_get(struct ksmbd_file *fp)
 
 	write_lock(&inode_hash_lock);
 	tmpci = ksmbd_inode_lookup(fp);
-	if (!tmpci) {
+	if (!tmpci)
 		ksmbd_inode_hash(ci);
-	} else {
+	write_unlock(&inode_hash_lock);
+
+	if (tmpci) {
 		kfree(ci);
 		ci = tmpci;
 	}
-	write_unlock(&inode_hash_lock);
 	return ci;
 }
 
 static void ksmbd_inode_free(struct ksmbd_inode *ci)
 {
 	ksmbd_inode_unhash(ci);
+	ksmbd_vfs_put_xattr_snapshot(ci->m_xattrs);
 	kfree(ci);
 }
 
@@ -214,6 +405,110 @@ static void ksmbd_inode_put(struct ksmbd_inode *ci)
 		ksmbd_inode_free(ci);
 }
 
+/*
+ * Snapshots larger than this are not kept, a file with that many
+ * streams and EAs is rarely queried often.
+ */
+#define KSMBD_XATTR_SNAP_MAX	(64 * 1024)
+
+/*
+ * Reading user.* xattrs needs read permission on the inode, which only
+ * depends on the fsuid and fsgid ksmbd runs requests with. A snapshot
+ * is only handed to requests running with the same ones.
+ */
+static bool ksmbd_xattr_snap_valid(struct ksmbd_xattr_snap *snap,
+				   struct inode *inode)
+{
+	return timespec64_equal(&snap->ctime, &inode->i_ctime) &&
+		(!IS_I_VERSION(inode) ||
+		 snap->iversion == inode_query_iversion(inode)) &&
+		uid_eq(snap->fsuid, current_fsuid()) &&
+		gid_eq(snap->fsgid, current_fsgid());
+}
+
+/**
+ * ksmbd_inode_xattrs_get() - get the stream and EA xattrs of an open file
+ * @fp:		ksmbd file pointer
+ *
+ * The snapshot is kept with the inode until ksmbd changes one of the
+ * xattrs or the change time or i_version of the inode moves, which also
+ * covers changes made by other programs. On filesystems without
+ * i_version, a snapshot taken in the same tick as the last change is not
+ * kept, as a later change may not move the change time. Release it with
+ * ksmbd_vfs_put_xattr_snapshot().
+ *
+ * Return:	snapshot on success, otherwise error pointer
+ */
+struct ksmbd_xattr_snap *ksmbd_inode_xattrs_get(struct ksmbd_file *fp)
+{
+	struct ksmbd_inode *ci = fp->f_ci;
+	struct inode *inode = file_inode(fp->filp);
+	struct ksmbd_xattr_snap *snap, *old = NULL;
+	struct timespec64 ctime, now;
+	unsigned int gen;
+	u64 iversion = 0;
+
+	read_lock(&ci->m_lock);
+	snap = ci->m_xattrs;
+	if (snap && ksmbd_xattr_snap_valid(snap, inode))
+		refcount_inc(&snap->refcount);
+	else
+		snap = NULL;
+	gen = ci->m_xattr_gen;
+	read_unlock(&ci->m_lock);
+	if (snap)
+		return snap;
+
+	ctime = inode->i_ctime;
+	if (IS_I_VERSION(inode))
+		iversion = inode_query_iversion(inode);
+	snap = ksmbd_vfs_xattr_snapshot(file_mnt_user_ns(fp->filp),
+					fp->filp->f_path.dentry);
+	if (IS_ERR(snap) || snap->size > KSMBD_XATTR_SNAP_MAX)
+		return snap;
+	snap->ctime = ctime;
+	snap->iversion = iversion;
+	snap->fsuid = current_fsuid();
+	snap->fsgid = current_fsgid();
+
+	now = current_time(inode);
+	if (!IS_I_VERSION(inode) && timespec64_equal(&ctime, &now))
+		return snap;
+
+	/* don't keep it if ksmbd changed an xattr meanwhile */
+	write_lock(&ci->m_lock);
+	if (gen == ci->m_xattr_gen) {
+		old = ci->m_xattrs;
+		refcount_inc(&snap->refcount);
+		ci->m_xattrs = snap;
+	}
+	write_unlock(&ci->m_lock);
+	ksmbd_vfs_put_xattr_snapshot(old);
+	return snap;
+}
+
+/**
+ * ksmbd_inode_xattrs_changed() - drop the xattr snapshot of an inode
+ * @inode:	inode whose stream or EA xattrs were changed
+ */
+void ksmbd_inode_xattrs_changed(struct inode *inode)
+{
+	struct ksmbd_xattr_snap *old;
+	struct ksmbd_inode *ci;
+
+	ci = ksmbd_inode_lookup_by_vfsinode(inode);
+	if (!ci)
+		return;
+
+	write_lock(&ci->m_lock);
+	old = ci->m_xattrs;
+	ci->m_xattrs = NULL;
+	ci->m_xattr_gen++;
+	write_unlock(&ci->m_lock);
+	ksmbd_vfs_put_xattr_snapshot(old);
+	ksmbd_inode_put(ci);
+}
+
 int __init ksmbd_inode_hash_init(void)
 {
 	unsigned int loop;
@@ -312,6 +607,7 @@ static void __ksmbd_close_fd(struct ksmbd_file_table *ft, struct ksmbd_file *fp)
 	filp = fp->filp;
 
 	__ksmbd_inode_close(fp);
+	ksmbd_dir_count_put(fp->f_parent);
 	if (!IS_ERR_OR_NULL(filp))
 		fput(filp);
 
@@ -332,6 +628,7 @@ static void __ksmbd_close_fd(struct ksmbd_file_table *ft, struct ksmbd_file *fp)
 #endif
 	if (ksmbd_stream_fd(fp))
 		kfree(fp->stream.name);
+	ksmbd_free_pattern(fp->search_pattern);
 	kmem_cache_free(filp_cache, fp);
 }
 
@@ -427,9 +724,31 @@ struct ksmbd_file *ksmbd_lookup_foreign_fd(struct ksmbd_work *work, u64 id)
 	return __ksmbd_lookup_fd(&work->sess->file_table, id);
 }
 
+/*
+ * Commands following a CREATE in a related compound mostly name the file
+ * it opened, take it from the work instead of the file table. The last
+ * related command takes the reference of the work over, so that the file
+ * isn't kept pinned, failing closes from other requests, until the
+ * response is sent.
+ */
+static struct ksmbd_file *ksmbd_lookup_work_fd(struct ksmbd_work *work,
+					       u64 id)
+{
+	struct ksmbd_file *fp = work->compound_fp;
+
+	if (fp && fp->volatile_id == id) {
+		if (!work->compound_fp_last)
+			return ksmbd_fp_get(fp);
+		work->compound_fp = NULL;
+		work->compound_fp_last = false;
+		return fp;
+	}
+	return __ksmbd_lookup_fd(&work->sess->file_table, id);
+}
+
 struct ksmbd_file *ksmbd_lookup_fd_fast(struct ksmbd_work *work, u64 id)
 {
-	struct ksmbd_file *fp = __ksmbd_lookup_fd(&work->sess->file_table, id);
+	struct ksmbd_file *fp = ksmbd_lookup_work_fd(work, id);
 
 	if (__sanity_check(work->tcon, fp))
 		return fp;
@@ -448,7 +767,7 @@ struct ksmbd_file *ksmbd_lookup_fd_slow(struct ksmbd_work *work, u64 id,
 		pid = work->compound_pfid;
 	}
 
-	fp = __ksmbd_lookup_fd(&work->sess->file_table, id);
+	fp = ksmbd_lookup_work_fd(work, id);
 	if (!__sanity_check(work->tcon, fp)) {
 		ksmbd_fd_put(work, fp);
 		return NULL;
@@ -460,6 +779,28 @@ struct ksmbd_file *ksmbd_lookup_fd_slow(struct ksmbd_work *work, u64 id,
 	return fp;
 }
 
+/**
+ * ksmbd_set_compound_fp() - keep a file open by a compound CREATE at hand
+ * @work:	smb work of the compound request
+ * @fp:		ksmbd file opened by the CREATE
+ *
+ * The reference is handed to the last related command looking the file
+ * up, otherwise dropped with ksmbd_put_compound_fp() once the related
+ * commands are done. It must be dropped before the file is closed.
+ */
+void ksmbd_set_compound_fp(struct ksmbd_work *work, struct ksmbd_file *fp)
+{
+	ksmbd_put_compound_fp(work);
+	work->compound_fp = ksmbd_fp_get(fp);
+}
+
+void ksmbd_put_compound_fp(struct ksmbd_work *work)
+{
+	ksmbd_fd_put(work, work->compound_fp);
+	work->compound_fp = NULL;
+	work->compound_fp_last = false;
+}
+
 struct ksmbd_file *ksmbd_lookup_durable_fd(unsigned long long id)
 {
 	return __ksmbd_lookup_fd(&global_ft, id);
@@ -485,31 +826,47 @@ struct ksmbd_file *ksmbd_lookup_fd_cguid(char *cguid)
 }
 
 #ifdef CONFIG_SMB_INSECURE_SERVER
+/**
+ * ksmbd_lookup_fd_filename() - find an open of a file in the session
+ * @work:	smb work
+ * @filename:	path name of the file relative to the share
+ *
+ * The name is resolved once and the opens of the inode are found through
+ * the inode hash, instead of building and comparing the path of every
+ * file the session has open. This also follows renames for free.
+ *
+ * Return:	ksmbd file pointer with a reference if found, otherwise NULL
+ */
 struct ksmbd_file *ksmbd_lookup_fd_filename(struct ksmbd_work *work, char *filename)
 {
-	struct ksmbd_file	*fp = NULL;
-	unsigned int		id;
-	char			*pathname;
+	struct ksmbd_file_table	*ft = &work->sess->file_table;
+	struct ksmbd_file	*lfp, *fp = NULL;
+	struct ksmbd_inode	*ci;
+	struct path		path;
+	bool			found;
 
-	pathname = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!pathname)
+	if (ksmbd_vfs_kern_path(work, filename, LOOKUP_NO_SYMLINKS, &path, 0))
 		return NULL;
 
-	read_lock(&work->sess->file_table.lock);
-	idr_for_each_entry(work->sess->file_table.idr, fp, id) {
-		char *path = d_path(&fp->filp->f_path, pathname, PATH_MAX);
-
-		if (IS_ERR(path))
-			break;
+	ci = ksmbd_inode_lookup_by_vfsinode(d_inode(path.dentry));
+	path_put(&path);
+	if (!ci)
+		return NULL;
 
-		if (!strcmp(path, filename)) {
-			fp = ksmbd_fp_get(fp);
-			break;
+	read_lock(&ci->m_lock);
+	list_for_each_entry(lfp, &ci->m_fp_list, node) {
+		read_lock(&ft->lock);
+		found = idr_find(ft->idr, lfp->volatile_id) == lfp;
+		read_unlock(&ft->lock);
+
+		if (found) {
+			fp = ksmbd_fp_get(lfp);
+			if (fp)
+				break;
 		}
 	}
-	read_unlock(&work->sess->file_table.lock);
-
-	kfree(pathname);
+	read_unlock(&ci->m_lock);
+	ksmbd_inode_put(ci);
 	return fp;
 }
 #endif
@@ -591,6 +948,7 @@ unsigned int ksmbd_open_durable_fd(struct ksmbd_file *fp)
 struct ksmbd_file *ksmbd_open_fd(struct ksmbd_work *work, struct file *filp)
 {
 	struct ksmbd_file *fp;
+	struct dentry *parent;
 	int ret;
 
 	fp = kmem_cache_zalloc(filp_cache, GFP_KERNEL);
@@ -617,8 +975,18 @@ struct ksmbd_file *ksmbd_open_fd(struct ksmbd_work *work, struct file *filp)
 		goto err_out;
 	}
 
+	parent = dget_parent(filp->f_path.dentry);
+	fp->f_parent = ksmbd_dir_count_get(d_inode(parent));
+	dput(parent);
+	if (!fp->f_parent) {
+		ksmbd_inode_put(fp->f_ci);
+		ret = -ENOMEM;
+		goto err_out;
+	}
+
 	ret = __open_id(&work->sess->file_table, fp, OPEN_ID_TYPE_VOLATILE_ID);
 	if (ret) {
+		ksmbd_dir_count_put(fp->f_parent);
 		ksmbd_inode_put(fp->f_ci);
 		goto err_out;
 	}
@@ -27,6 +27,8 @@
 
 struct ksmbd_conn;
 struct ksmbd_session;
+struct ksmbd_pattern;
+struct ksmbd_dir_count;
 
 struct ksmbd_lock {
 	struct file_lock *fl;
@@ -58,6 +60,9 @@ struct ksmbd_inode {
 	struct list_head		m_op_list;
 	struct oplock_info		*m_opinfo;
 	__le32				m_fattr;
+	/* stream and EA xattrs, protected by m_lock */
+	struct ksmbd_xattr_snap		*m_xattrs;
+	unsigned int			m_xattr_gen;
 };
 
 struct ksmbd_file {
@@ -69,6 +74,8 @@ struct ksmbd_file {
 
 	struct ksmbd_inode		*f_ci;
 	struct ksmbd_inode		*f_parent_ci;
+	/* open count of the parent directory, protected by f_ci->m_lock */
+	struct ksmbd_dir_count		*f_parent;
 	struct oplock_info __rcu	*f_opinfo;
 	struct ksmbd_conn		*conn;
 	struct ksmbd_tree_connect	*tcon;
@@ -112,6 +119,10 @@ struct ksmbd_file {
 	/* if ls is happening on directory, below is valid*/
 	struct ksmbd_readdir_data	readdir_data;
 	int				dot_dotdot[2];
+	/* compiled pattern of the last QUERY_DIRECTORY */
+	struct ksmbd_pattern		*search_pattern;
+	/* the single entry of a wildcard free search was returned */
+	bool				search_done;
 };
 
 static inline void set_ctx_actor(struct dir_context *ctx,
@@ -140,17 +151,24 @@ static inline bool ksmbd_stream_fd(struct ksmbd_file *fp)
 int ksmbd_init_file_table(struct ksmbd_file_table *ft);
 void ksmbd_destroy_file_table(struct ksmbd_file_table *ft);
 int ksmbd_close_fd(struct ksmbd_work *work, u64 id);
+bool ksmbd_close_fd_may_block(struct ksmbd_file *fp);
 struct ksmbd_file *ksmbd_lookup_fd_fast(struct ksmbd_work *work, u64 id);
 struct ksmbd_file *ksmbd_lookup_foreign_fd(struct ksmbd_work *work, u64 id);
 struct ksmbd_file *ksmbd_lookup_fd_slow(struct ksmbd_work *work, u64 id,
 					u64 pid);
 void ksmbd_fd_put(struct ksmbd_work *work, struct ksmbd_file *fp);
+struct ksmbd_xattr_snap *ksmbd_inode_xattrs_get(struct ksmbd_file *fp);
+void ksmbd_inode_xattrs_changed(struct inode *inode);
+void ksmbd_set_compound_fp(struct ksmbd_work *work, struct ksmbd_file *fp);
+void ksmbd_put_compound_fp(struct ksmbd_work *work);
 struct ksmbd_file *ksmbd_lookup_durable_fd(unsigned long long id);
 struct ksmbd_file *ksmbd_lookup_fd_cguid(char *cguid);
 #ifdef CONFIG_SMB_INSECURE_SERVER
 struct ksmbd_file *ksmbd_lookup_fd_filename(struct ksmbd_work *work, char *filename);
 #endif
 struct ksmbd_file *ksmbd_lookup_fd_inode(struct inode *inode);
+bool ksmbd_dir_has_open_children(struct inode *dir);
+void ksmbd_fd_set_parent(struct ksmbd_file *fp, struct inode *dir);
 unsigned int ksmbd_open_durable_fd(struct ksmbd_file *fp);
 struct ksmbd_file *ksmbd_open_fd(struct ksmbd_work *work, struct file *filp);
 void ksmbd_close_tree_conn_fds(struct ksmbd_work *work);
@@ -119,4 +119,18 @@ struct xattr_ntacl {
 #define XATTR_NAME_SD_LEN	\
 		(sizeof(XATTR_SECURITY_PREFIX SD_PREFIX) - 1)
 
+/*
+ * ksmbd specific record keeping the dos attributes and the ntacl of a
+ * file in a single xattr, so that creating a file costs one xattr write.
+ * Each part is stored in the same NDR encoding as its own xattr above.
+ */
+#define META_PREFIX			"KSMBD.META"
+#define XATTR_NAME_META			(XATTR_SECURITY_PREFIX META_PREFIX)
+#define XATTR_META_VERSION		1
+
+enum {
+	XATTR_META_DOSINFO		= 0x0001,
+	XATTR_META_NTACL		= 0x0002
+};
+
 #endif /* __XATTR_H__ */